@@ -27,43 +27,84 @@
 #include "serial9.h"
 #include "Arduino.h"
 
-extern void serial9_set_8bit_mode(void);
-extern void serial9_set_9bit_mode(void);
+extern void serial9_set_8bit_mode(uint8_t ch);
+extern void serial9_set_9bit_mode(uint8_t ch);
 
-extern void serial9_set_baud(uint32_t baud);
-extern void serial9_start(void);
-extern void serial9_stop(void);
+extern void serial9_set_baud(uint8_t ch, uint32_t baud);
+extern uint32_t serial9_baud_actual(uint8_t ch, uint32_t baud);
+extern void serial9_start(uint8_t ch);
+extern void serial9_stop(uint8_t ch);
 
-extern void serial9_talk(void);
-extern void serial9_listen(void);
-extern void serial9_offline(void);
+extern void serial9_talk(uint8_t ch);
+extern void serial9_listen(uint8_t ch);
+extern void serial9_offline(uint8_t ch);
+extern void serial9_duplex(uint8_t ch);
 
-extern bool serial9_rx_available(void);
-extern uint16_t serial9_read(void);
+extern bool serial9_rx_available(uint8_t ch);
+extern uint16_t serial9_read(uint8_t ch);
 
-extern bool serial9_tx_busy(void);
-extern bool serial9_tx_complete(void);
-extern void serial9_write(uint16_t data);
+extern bool serial9_tx_busy(uint8_t ch);
+extern bool serial9_tx_complete(uint8_t ch);
+extern void serial9_write(uint8_t ch, uint16_t data);
 
-Serial9::Serial9()
+extern bool serial9_edge_start(uint8_t ch);
+extern void serial9_edge_stop(uint8_t ch);
+extern uint16_t serial9_edge_count(uint8_t ch);
+extern uint32_t serial9_edge_baud(uint8_t ch);
+
+extern uint16_t serial9_check_init(uint8_t mode);
+extern uint16_t serial9_check_update(uint8_t mode, uint16_t check, uint8_t data);
+
+Serial9::Serial9(uint8_t ch)
 {
+  _ch = ch;
+  _mux = NULL;
+
   tx_state = SERIAL9_STATE_IDLE;
   _writing = false;
+  _sniffing = false;
+  _duplex = SERIAL9_FULL_DUPLEX;
+
+  _deliver_good = false;
+  _frame_gap = 0;
+  _set_check(SERIAL9_CHECK_NONE);
+
+  _selftest = false;
+  _autobaud = false;
+
+  _credit = false;
+  _credit_freed = 0;
+  _txq_head = 0;
+  _txq_tail = 0;
+  _txq_count = 0;
+
+  _in_state = SERIAL9_STATE_IDLE;
+  _in_frame = false;
+  _pq_sending = false;
+  _pq_count = 0;
+  _pq_ready = 0;
+  _pq_pos = 0;
+  _pq_length = 0;
+  _pq_overflow = false;
+  _pq_state = SERIAL9_STATE_IDLE;
+
+  _cd_lfsr = 0;
+  _collide_set(false, 0);
 }
 
 Serial9::~Serial9() {}
 
 void Serial9::begin(uint32_t baud)
 {
-  serial9_set_baud(baud);
-  serial9_set_9bit_mode();
-  serial9_start();
-  serial9_listen();
+  _set_baud(baud);
+  serial9_set_9bit_mode(_ch);
+  serial9_start(_ch);
+  _set_duplex(_duplex);
 }
 
 void Serial9::end()
 {
-  serial9_stop();
+  serial9_stop(_ch);
 }
 
 // Here is where the escape protocol is defined ...
@@ -87,175 +128,1080 @@ void Serial9::end()
 #define SERIAL9_BAUD_57600 (0x18)
 #define SERIAL9_BAUD_115200 (0x19)
 
-#ifndef SERIAL9_BUFFER_SIZE
-  #define SERIAL9_BUFFER_SIZE (32)
-#endif
+#define SERIAL9_SNIFF_START (0x20) // Listen only, timestamp every received word
+#define SERIAL9_SNIFF_STOP (0x21)  // Back to normal half duplex operation
+#define SERIAL9_TIMESTAMP (0x22)   // To host: 4 byte micros() timestamp follows
 
-void Serial9::loop(void)
+#define SERIAL9_CHECK_OFF (0x30)       // No frame checks (default)
+#define SERIAL9_CHECK_ADD (0x31)       // MDB style 8 bit additive checksum
+#define SERIAL9_CHECK_CRC (0x32)       // Modbus style CRC-16
+#define SERIAL9_CHECK_END (0x33)       // Append the check to the outgoing frame
+#define SERIAL9_DELIVER_ALL (0x34)     // Send every incoming frame (default)
+#define SERIAL9_DELIVER_GOOD (0x35)    // Drop incoming frames that fail the check
+#define SERIAL9_CHECK_RESULT (0x36)    // To host: 1 byte check result follows
+
+#define SERIAL9_CHECK_GOOD (0x00)
+#define SERIAL9_CHECK_BAD (0x01)
+
+#define SERIAL9_SELFTEST (0x40)        // 3 parameters: count (2 bytes), mix
+#define SERIAL9_SELFTEST_RESULT (0x41) // To host: 16 byte self test result follows
+
+#define SERIAL9_CREDIT_ON (0x50)       // Queue host data and grant credits
+#define SERIAL9_CREDIT_OFF (0x51)      // Back to USB flow control only (default)
+#define SERIAL9_CREDIT (0x52)          // To host: 1 byte credit follows
+
+#define SERIAL9_COLLIDE_ON (0x70)      // 1 parameter: retries - check the echo
+#define SERIAL9_COLLIDE_OFF (0x71)     // No echo check (default)
+#define SERIAL9_FRAME_END (0x72)       // End of the frame to send again
+#define SERIAL9_COLLISION (0x73)       // To host: position, retries left
+#define SERIAL9_RETRIED (0x74)         // To host: frame sent after n retries
+
+#define SERIAL9_PRIORITY (0x80)        // 1 parameter: n - the next n bytes are urgent
+#define SERIAL9_PRIORITY_DROPPED (0x81) // To host: 1 byte length of a dropped frame
+
+#define SERIAL9_AUTOBAUD (0x90)        // Listen with DE low and find the baud rate
+#define SERIAL9_AUTOBAUD_RESULT (0x91) // To host: 4 byte baud rate, 1 byte error
+
+#define SERIAL9_DUPLEX_ON (0xa0)       // Full duplex RS-422, DE always asserted
+#define SERIAL9_DUPLEX_OFF (0xa1)      // Half duplex RS-485 (default)
+
+// The backoff after a collision is a random number of frame gaps, the
+// range doubles with every attempt up to 2^SERIAL9_BACKOFF_MAX
+
+#define SERIAL9_BACKOFF_MAX (4)
+
+// Credits are granted in batches to keep the USB traffic down, or as
+// soon as the queue is empty so the host never waits on a small grant
+
+#define SERIAL9_CREDIT_BATCH (SERIAL9_TX_QUEUE_SIZE / 4)
+
+// Modbus RTU ends a frame after 3.5 character times of silence, which is
+// 38.5 bit times for an 11 bit character - but never less than 1750 usec
+
+#define SERIAL9_FRAME_GAP_BITS (38500000UL)
+#define SERIAL9_FRAME_GAP_MIN (1750UL)
+
+// The hardware layer drops DE when it sets the baud rate, so in full
+// duplex it is asserted again here
+
+void Serial9::_set_baud(uint32_t baud)
 {
-  // UPDATE THIS COMMENT - IT IS INCORRDCT
+  serial9_set_baud(_ch, baud);
+  if (_duplex && !_sniffing) {
+    serial9_duplex(_ch);
+  }
 
-  // Highest priority is checking to see if a character is available
-  // in the hardware serial device, and sending the data back to the
-  // host using the USB9_ESCAPE sequence if necessary.
+  _frame_gap = SERIAL9_FRAME_GAP_BITS / baud;
+  if (_frame_gap < SERIAL9_FRAME_GAP_MIN) {
+    _frame_gap = SERIAL9_FRAME_GAP_MIN;
+  }
+}
 
-  // The UART has completed the current character and there are no
-  // incoming charaters available from the USB - force the interface
-  // into the listen state if we were writing
+void Serial9::_set_check(uint8_t check)
+{
+  _check = check;
 
-  if (serial9_tx_complete() && !serial9_rx_available()) {
+  _tx_check = serial9_check_init(_check);
+  _tx_pending_count = 0;
 
-    // Force listen mode, we are no longer writing
-    if (_writing) {
-      _writing = false;
-      serial9_listen();
+  _rx_open = false;
+  _rx_overflow = false;
+  _rx_count = 0;
+  _rx_length = 0;
+}
+
+// In full duplex the transmitter and receiver have their own pairs, so
+// DE is asserted for good and the talk/listen switching is skipped. Switch
+// between frames - a word still in the shift register is cut short by
+// going back to half duplex. Sniff mode keeps DE low either way.
+//
+void Serial9::_set_duplex(bool on)
+{
+  _duplex = on;
+  _writing = false;
+
+  if (_sniffing) {
+    DO_NOTHING;
+  } else if (_duplex) {
+    serial9_duplex(_ch);
+  } else {
+    serial9_listen(_ch);
+  }
+}
+
+// All writes to the UART go through here so that the talk/listen
+// bookkeeping is in one place. In sniff mode we never drive the bus,
+// so anything the host sends is quietly dropped.
+//
+void Serial9::_transmit(uint16_t data)
+{
+  if (_sniffing) {
+    DO_NOTHING;
+  } else {
+    if (SERIAL9_CHECK_NONE != _check) {
+      _tx_check = serial9_check_update(_check, _tx_check, (uint8_t)data);
+    }
+    _in_frame = true;
+    if (_collide && !_selftest && !_duplex) {
+      _collide_transmit(data);
     } else {
-      // Do nothing
-      DO_NOTHING;
+      _bus_write(data);
     }
+  }
+}
 
-//    tx_state = SERIAL9_STATE_IDLE;
+void Serial9::_bus_write(uint16_t data)
+{
+  if (_duplex) {
+    DO_NOTHING;
+  } else {
+    // Whatever was coming in has ended if we are allowed to talk
+    if (!_writing && _rx_open) {
+      _rx_close();
+    }
+    _writing = true;
+    serial9_talk(_ch);
   }
+  serial9_write(_ch, data);
+}
 
-  // A character has been received by the UART
-  //
-  if (serial9_rx_available()) {
+// Send a word received from the UART to the host using the escape
+// protocol. Yes, we could factor out the data write at the end of each
+// of the three conditions, but it's easier to understand if we don't
+//
+void Serial9::_send_word(uint16_t data)
+{
+  if ((bool)(data & SERIAL9_BIT9)) {
+    _host_write(SERIAL9_ESCAPE);
+    _host_write(SERIAL9_HIGH);
+    _host_write((uint8_t)(data & 0xff));
+  } else if (SERIAL9_ESCAPE == data) {
+    _host_write(SERIAL9_ESCAPE);
+    _host_write((uint8_t)(data & 0xff));
+  } else {
+    _host_write((uint8_t)(data & 0xff));
+  }
+}
 
-    // Check if the 9th bit is set and send the possibly ESCAPED data
-    // back to the host. Yes, we could factor out the data write at
-    // the end of each of the three conditions, but it's easier to
-    // understand if we don't
-    //
-    uint16_t rx_data = serial9_read();
-
-    if ((bool)(rx_data & SERIAL9_BIT9)) {
-      Serial.write(SERIAL9_ESCAPE);
-      Serial.write(SERIAL9_HIGH);
-      Serial.write((uint8_t)(rx_data & 0xff));
-    } else if (SERIAL9_ESCAPE == rx_data) {
-      Serial.write(SERIAL9_ESCAPE);
-      Serial.write((uint8_t)(rx_data & 0xff));
+// The timestamp record is fixed length, so the payload is NOT escaped
+// - the host simply takes the next 4 bytes, least significant first.
+//
+void Serial9::_send_timestamp(uint32_t t)
+{
+  _host_write(SERIAL9_ESCAPE);
+  _host_write(SERIAL9_TIMESTAMP);
+  _send_u32(t);
+}
+
+void Serial9::_send_u32(uint32_t value)
+{
+  _host_write((uint8_t)(value));
+  _host_write((uint8_t)(value >> 8));
+  _host_write((uint8_t)(value >> 16));
+  _host_write((uint8_t)(value >> 24));
+}
+
+// Send the possibly ESCAPED data back to the host, unless we are
+// checking frames - then it's up to the frame check
+//
+void Serial9::_receive(uint16_t rx_data)
+{
+  if (_collide && (_cd_echo != _cd_sent)) {
+    _collide_echo(rx_data);
+  } else {
+    if (_collide) {
+      // Somebody else is talking, start the backoff again
+      _cd_last = micros();
+    }
+
+    if (_sniffing) {
+      _send_timestamp(micros());
+    }
+
+    // Our own echo goes to the host as it is, it is not part of the
+    // incoming frame that is being checked
+
+    if ((SERIAL9_CHECK_NONE == _check) || _writing) {
+      _send_word(rx_data);
     } else {
-      Serial.write((uint8_t)(rx_data & 0xff));
+      _rx_word(rx_data);
     }
-  
-  // The UART is NOT ready to send a character, do nothing
+  }
+}
 
-  } else if (serial9_tx_busy()) {
-    // No point getting more from Serial if we are still
-    // busy transmitting on serial9 :-)
-    //
+// With frame checks enabled every received word is added to the check
+// for the current frame. If the host only wants good frames we have to
+// hold on to the words until the frame is complete - if the frame is too
+// big for the buffer we give up and pass it through, but still report
+// the result of the check at the end.
+//
+// The last word of an MDB frame from a peripheral has the mode bit set,
+// and MDB has no quiet time between frames to wait for - so the frame
+// ends there. In sniff mode the master's frames start with the mode bit
+// instead, and the frame gap has to do.
+//
+void Serial9::_rx_word(uint16_t data)
+{
+  if (!_rx_open) {
+    _rx_open = true;
+    _rx_overflow = false;
+    _rx_count = 0;
+    _rx_length = 0;
+    _rx_check = serial9_check_init(_check);
+  }
+
+  _rx_length++;
+  _rx_last = micros();
+  _rx_check_prev = _rx_check;
+  _rx_check = serial9_check_update(_check, _rx_check, (uint8_t)data);
+
+  if (!_deliver_good || _sniffing || _rx_overflow) {
+    _send_word(data);
+  } else if (_rx_count < SERIAL9_BUFFER_SIZE) {
+    _rx_frame[_rx_count++] = data;
+  } else {
+    for (uint8_t i = 0; i < _rx_count; ++i) {
+      _send_word(_rx_frame[i]);
+    }
+    _send_word(data);
+    _rx_count = 0;
+    _rx_overflow = true;
+  }
+
+  if ((SERIAL9_CHECK_MDB == _check) && (data & SERIAL9_BIT9) && !_sniffing) {
+    _rx_close();
+  }
+}
+
+// The bus has been quiet for long enough, the frame is complete.
+//
+// An MDB frame is good if the last word is the sum of the ones before it,
+// a single word is an ACK/NAK/RET and has no checksum. A Modbus frame
+// is good if the CRC over the whole frame, including the CRC, is 0.
+//
+void Serial9::_rx_close(void)
+{
+  uint8_t result = SERIAL9_CHECK_BAD;
+
+  if (SERIAL9_CHECK_MDB == _check) {
+    if (((uint8_t)(_rx_check - _rx_check_prev) == (uint8_t)_rx_check_prev) || (1 == _rx_length)) {
+      result = SERIAL9_CHECK_GOOD;
+    }
+  } else if ((0 == _rx_check) && (_rx_length > 2)) {
+    result = SERIAL9_CHECK_GOOD;
+  }
+
+  if (SERIAL9_CHECK_GOOD == result) {
+    for (uint8_t i = 0; i < _rx_count; ++i) {
+      _send_word(_rx_frame[i]);
+    }
+  }
+
+  _rx_open = false;
+  _rx_count = 0;
+
+  _host_write(SERIAL9_ESCAPE);
+  _host_write(SERIAL9_CHECK_RESULT);
+  _host_write(result);
+}
+
+// Escape commands with parameters - the parameters are collected by
+// the SERIAL9_STATE_PARAM state, then the command is run. Parameters are
+// raw bytes, they are NOT escaped.
+//
+void Serial9::_start_command(uint8_t command, uint8_t length)
+{
+  _command = command;
+  _param_count = 0;
+  _param_length = length;
+  tx_state = SERIAL9_STATE_PARAM;
+}
+
+// The number of raw parameter bytes that follow an escape command - the
+// Serial9Mux needs this too, so it can find the channel selects
+//
+uint8_t serial9_param_length(uint8_t command)
+{
+  if (SERIAL9_HIGH == command) {
+    return 1;
+  } else if (SERIAL9_SELFTEST == command) {
+    return 3;
+  } else if (SERIAL9_COLLIDE_ON == command) {
+    return 1;
+  } else if (SERIAL9_PRIORITY == command) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+void Serial9::_run_command(void)
+{
+  if (SERIAL9_SELFTEST == _command) {
+    _selftest_start(_params[0] | ((uint16_t)_params[1] << 8), _params[2]);
+  } else if (SERIAL9_COLLIDE_ON == _command) {
+    _collide_set(true, _params[0]);
+  } else {
     DO_NOTHING;
+  }
+}
 
-  // The UART is ready to send a character, is there USB Serial data?
+// The self test pattern comes from a 16 bit maximal length Galois LFSR.
+// The lower byte is the data, and the upper byte decides whether the 9th
+// bit is set - on average mix out of every 256 words have it set.
+//
+uint16_t serial9_prbs(uint16_t lfsr)
+{
+  return (lfsr >> 1) ^ ((lfsr & 1) ? 0xb400 : 0);
+}
+
+#define SERIAL9_PRBS_SEED (0xace1)
+
+void Serial9::_selftest_start(uint16_t count, uint8_t mix)
+{
+  _selftest = true;
+  _st_waiting = false;
+  _st_remaining = count;
+  _st_lfsr = SERIAL9_PRBS_SEED;
+  _st_mix = mix;
+  _st_words = 0;
+  _st_errors = 0;
+  _st_run = 0;
+  _st_longest = 0;
+  _st_start = micros();
+}
+
+// While the self test runs it owns the UART - the host data waits in the
+// USB buffers. Each word is sent and we wait for its echo (RE_ stays
+// enabled while we talk) before sending the next one. A word that does
+// not come back within the frame gap counts as an error.
+//
+void Serial9::_selftest_loop(void)
+{
+  if (serial9_rx_available(_ch)) {
+    uint16_t rx_data = serial9_read(_ch);
+
+    if (_st_waiting && (rx_data == _st_expect)) {
+      _st_run++;
+      if (_st_run > _st_longest) {
+        _st_longest = _st_run;
+      }
+    } else {
+      _st_errors++;
+      _st_run = 0;
+    }
+    _st_waiting = false;
 
-  } else if (Serial.available() > 0) {
+  } else if (_st_waiting) {
+    if ((uint32_t)(micros() - _st_sent) > _frame_gap) {
+      _st_errors++;
+      _st_run = 0;
+      _st_waiting = false;
+    }
 
-    uint16_t tx_data = Serial.read();
+  } else if (_st_remaining > 0) {
+    if (!serial9_tx_busy(_ch)) {
+      _st_lfsr = serial9_prbs(_st_lfsr);
+      _st_expect = (_st_lfsr & 0xff) | (((_st_lfsr >> 8) < _st_mix) ? SERIAL9_BIT9 : 0);
+      _transmit(_st_expect);
+      _st_sent = micros();
+      _st_waiting = true;
+      _st_remaining--;
+      _st_words++;
+    }
 
-    switch (tx_state) {
+  } else {
+    _selftest = false;
 
-    case SERIAL9_STATE_IDLE:
+    _host_write(SERIAL9_ESCAPE);
+    _host_write(SERIAL9_SELFTEST_RESULT);
+    _send_u32(_st_words);
+    _send_u32(_st_errors);
+    _send_u32(_st_longest);
+    _send_u32(micros() - _st_start);
+  }
+}
+
+// Autobaud times the edges on the bus until it has seen enough of them
+// for a few frames, or gives up after 2 seconds. Fewer edges than that
+// will still do if there are enough to be sure of at least one single bit.
+//
+// A measured rate within 3% of one of the standard rates is taken to be
+// that rate. Anything else is reported as not found and the baud rate is
+// left alone - a rate that far out is more likely a bad measurement than
+// a bus we could talk to. The error in the result is the measured rate
+// against the rate the UBRR/U2X setting really gives, in tenths of a
+// percent.
+
+#define SERIAL9_AUTOBAUD_EDGES (64)
+#define SERIAL9_AUTOBAUD_EDGES_MIN (16)
+#define SERIAL9_AUTOBAUD_TIMEOUT (2000000UL)
+#define SERIAL9_AUTOBAUD_SNAP (30)
+
+static const uint32_t serial9_bauds[] PROGMEM = { 300, 600, 1200, 2400, 4800, 9600,
+                                                  19200, 38400, 57600, 115200 };
+
+void Serial9::_autobaud_start(void)
+{
+  if (serial9_edge_start(_ch)) {
+    _autobaud = true;
+    _ab_start = micros();
+    serial9_listen(_ch);
+  } else {
+    // This RX pin cannot be timed - report that nothing was found
+    _host_write(SERIAL9_ESCAPE);
+    _host_write(SERIAL9_AUTOBAUD_RESULT);
+    _send_u32(0);
+    _host_write(0);
+  }
+}
+
+void Serial9::_autobaud_loop(void)
+{
+  uint16_t edges = serial9_edge_count(_ch);
+
+  if ((edges < SERIAL9_AUTOBAUD_EDGES) && ((uint32_t)(micros() - _ab_start) < SERIAL9_AUTOBAUD_TIMEOUT)) {
+    DO_NOTHING;
+  } else {
+    uint32_t measured = (edges >= SERIAL9_AUTOBAUD_EDGES_MIN) ? serial9_edge_baud(_ch) : 0;
+    uint32_t baud = 0;
+    int32_t error = 0;
+
+    serial9_edge_stop(_ch);
+    _autobaud = false;
+
+    for (uint8_t i = 0; (measured > 0) && (i < (sizeof(serial9_bauds) / sizeof(serial9_bauds[0]))); ++i) {
+      int32_t standard = (int32_t)pgm_read_dword(&serial9_bauds[i]);
+      int32_t e = ((int32_t)measured - standard) * 1000 / standard;
+      if ((e >= -SERIAL9_AUTOBAUD_SNAP) && (e <= SERIAL9_AUTOBAUD_SNAP)) {
+        baud = (uint32_t)standard;
+      }
+    }
+
+    if (baud > 0) {
+      int32_t actual = (int32_t)serial9_baud_actual(_ch, baud);
+      error = ((int32_t)measured - actual) * 1000 / actual;
+      _set_baud(baud);
+    } else if (_duplex && !_sniffing) {
+      // Listening for the edges dropped DE, and _set_baud() is not
+      // there to assert it again
+      serial9_duplex(_ch);
+    }
+
+    _host_write(SERIAL9_ESCAPE);
+    _host_write(SERIAL9_AUTOBAUD_RESULT);
+    _send_u32(baud);
+    _host_write((uint8_t)(int8_t)error);
+  }
+}
+
+// With credit flow control on, we take everything the host sends into
+// the queue right away, even while the UART is busy - the host never
+// sends more than the credit we have granted, so it always fits. The
+// state machine then takes its bytes from the queue instead of Serial.
+//
+// After credits are turned off we keep going to the end of the escape
+// sequence or priority frame that is coming in, so it is not cut in two.
+// Priority frames are outside the credit, but the reserve the host is
+// never granted leaves room to read one behind a full grant.
+//
+void Serial9::_fill_queue(void)
+{
+  if (NULL == _mux) {
+    while ((_txq_count < SERIAL9_TX_QUEUE_SIZE) && (_credit || (SERIAL9_STATE_IDLE != _in_state))
+        && (Serial.available() > 0)) {
+      _queue(Serial.read());
+    }
+  }
+
+  if (!_credit) {
+    DO_NOTHING;
+  } else if ((_credit_freed >= SERIAL9_CREDIT_BATCH) || ((_credit_freed > 0) && (0 == _txq_count))) {
+    _host_write(SERIAL9_ESCAPE);
+    _host_write(SERIAL9_CREDIT);
+    _host_write(_credit_freed);
+    _credit_freed = 0;
+  }
+}
+
+// Bytes from the host are sorted into the two lanes as they are queued.
+// We follow the escape protocol just far enough to skip raw parameter
+// bytes, and hold on to an ESCAPE until we know whether it starts a
+// priority frame. Only bytes that go into _txq are credited - the host
+// sends priority frames outside the credit.
+//
+void Serial9::_queue(uint8_t data)
+{
+  switch (_in_state) {
+
+  case SERIAL9_STATE_IDLE:
+    if (SERIAL9_ESCAPE == data) {
+      _in_state = SERIAL9_STATE_ESCAPE;
+    } else {
+      _txq_put(data);
+    }
+    break;
+
+  case SERIAL9_STATE_ESCAPE:
+    if (SERIAL9_PRIORITY == data) {
+      _in_state = SERIAL9_STATE_LENGTH;
+    } else {
+      _txq_put(SERIAL9_ESCAPE);
+      _txq_put(data);
+      _in_count = serial9_param_length(data);
+      _in_state = (_in_count > 0) ? SERIAL9_STATE_PARAM : SERIAL9_STATE_IDLE;
+    }
+    break;
+
+  case SERIAL9_STATE_PARAM:
+    _txq_put(data);
+    if (0 == --_in_count) {
+      _in_state = SERIAL9_STATE_IDLE;
+    }
+    break;
 
-      if (SERIAL9_ESCAPE == tx_data) {
-        tx_state = SERIAL9_STATE_ESCAPE;
+  case SERIAL9_STATE_LENGTH:
+    _in_count = data;
+    _pq_length = data;
+    _pq_overflow = false;
+    _in_state = (_in_count > 0) ? SERIAL9_STATE_PRIORITY : SERIAL9_STATE_IDLE;
+    break;
 
+  case SERIAL9_STATE_PRIORITY:
+    // A frame that does not fit behind the ones still waiting is dropped
+    // whole - half a frame must never go out on the bus
+    if (_pq_count < SERIAL9_PRIORITY_SIZE) {
+      _pq[_pq_count++] = data;
+    } else {
+      _pq_overflow = true;
+    }
+    if (0 == --_in_count) {
+      if (_pq_overflow) {
+        _pq_count = _pq_ready;
+        _host_write(SERIAL9_ESCAPE);
+        _host_write(SERIAL9_PRIORITY_DROPPED);
+        _host_write(_pq_length);
       } else {
-        _writing = true;
-        serial9_talk();
-        serial9_write(tx_data);
+        _pq_ready = _pq_count;
       }
-      break;
+      _in_state = SERIAL9_STATE_IDLE;
+    }
+    break;
 
-    case SERIAL9_STATE_ESCAPE:
+  default:
+    _in_state = SERIAL9_STATE_IDLE;
+    break;
+  }
+}
 
-      // Most of the time the next state will be SERIAL9_STATE_IDLE
-      // so we set it here - override if necessary!
-      //
-      tx_state = SERIAL9_STATE_IDLE;
+void Serial9::_txq_put(uint8_t data)
+{
+  _txq[_txq_tail] = data;
+  _txq_tail = (_txq_tail + 1) % SERIAL9_TX_QUEUE_SIZE;
+  _txq_count++;
+}
+
+// Anything left in the queue after credits are turned off is still
+// sent before we go back to reading Serial directly. A channel of a
+// Serial9Mux only ever reads from its queue, the mux fills it.
+//
+bool Serial9::_host_available(void)
+{
+  if (_txq_count > 0) {
+    return true;
+  } else if (_credit || (NULL != _mux)) {
+    return false;
+  } else {
+    return Serial.available() > 0;
+  }
+}
+
+uint8_t Serial9::_host_read(void)
+{
+  if (_txq_count > 0) {
+    uint8_t data = _txq[_txq_head];
+    _txq_head = (_txq_head + 1) % SERIAL9_TX_QUEUE_SIZE;
+    _txq_count--;
+    _credit_freed++;
+    return data;
+  } else {
+    return Serial.read();
+  }
+}
+
+// A priority frame starts only between frames, and once started it goes
+// out in one piece. The first word of the next frame may already be half
+// way through the state machine - that is put aside and picked up again
+// afterwards, the priority frame holds nothing but whole words.
+//
+bool Serial9::_priority_ready(void)
+{
+  if (!_pq_sending && (_pq_pos < _pq_ready) && !_in_frame && (SERIAL9_STATE_PARAM != tx_state)) {
+    _pq_sending = true;
+    _pq_state = tx_state;
+    tx_state = SERIAL9_STATE_IDLE;
+  }
+  return _pq_sending;
+}
+
+void Serial9::_priority_read(void)
+{
+  _host_byte(_pq[_pq_pos++]);
+
+  if (_pq_pos == _pq_ready) {
+    _pq_sending = false;
+    _in_frame = false;
+    tx_state = _pq_state;
+    if (_pq_pos == _pq_count) {
+      _pq_pos = 0;
+      _pq_count = 0;
+      _pq_ready = 0;
+    }
+  }
+}
+
+void Serial9::_host_write(uint8_t data)
+{
+  if (NULL == _mux) {
+    Serial.write(data);
+  } else {
+    _mux->write(_ch, data);
+  }
+}
+
+// Collision detect relies on RE_ staying enabled while we talk, so every
+// word sent comes straight back. The host marks the end of each frame
+// with ESCAPE FRAME_END - until then the frame is kept in _cd_frame, and
+// a frame longer than that can still be checked, but not sent again.
+// There is no echo in full duplex, so frames are sent without the check.
+//
+void Serial9::_collide_set(bool on, uint8_t retries)
+{
+  _collide = on;
+  _cd_retries = retries;
+  _cd_state = SERIAL9_COLLIDE_SENDING;
+  _cd_attempt = 0;
+  _cd_count = 0;
+  _cd_sent = 0;
+  _cd_echo = 0;
+}
+
+void Serial9::_collide_transmit(uint16_t data)
+{
+  _cd_frame[_cd_count % SERIAL9_RETRY_BUFFER_SIZE] = data;
+  _cd_count++;
+
+  // After a collision the rest of the frame is only kept for the retry
+  if (SERIAL9_COLLIDE_SENDING == _cd_state) {
+    _cd_sent++;
+    _cd_last = micros();
+    _bus_write(data);
+  }
+}
+
+void Serial9::_collide_echo(uint16_t data)
+{
+  if (data == _cd_frame[_cd_echo % SERIAL9_RETRY_BUFFER_SIZE]) {
+    _cd_echo++;
+    _cd_last = micros();
+  } else {
+    _collision();
+  }
+}
 
-      if (SERIAL9_HIGH == tx_data) {
-        tx_state = SERIAL9_STATE_HIGH;
+// Let go of the bus right away - the word in the shift register is cut
+// short, which tells the other master something is wrong too
+//
+void Serial9::_collision(void)
+{
+  _writing = false;
+  serial9_listen(_ch);
+
+  _cd_position = _cd_echo;
+  _cd_sent = 0;
+  _cd_echo = 0;
+  _cd_attempt++;
 
-      } else if (SERIAL9_ESCAPE == tx_data) {
-        // It's an escaped ESCAPE character, just send it
-        _writing = true;
-        serial9_talk();
-        serial9_write(tx_data);
+  if (SERIAL9_COLLIDE_SENDING == _cd_state) {
+    _cd_state = SERIAL9_COLLIDE_ABORTED;
+  } else {
+    _collide_decide();
+  }
+}
+
+void Serial9::_collide_end(void)
+{
+  if (!_collide) {
+    DO_NOTHING;
+  } else if (SERIAL9_COLLIDE_ABORTED == _cd_state) {
+    _collide_decide();
+  } else {
+    _cd_state = SERIAL9_COLLIDE_ENDING;
+  }
+}
+
+// The whole frame is here and it has collided - tell the host, and
+// either back off for a random number of frame gaps or drop the frame
+//
+void Serial9::_collide_decide(void)
+{
+  bool retry = (_cd_attempt <= _cd_retries) && (_cd_count <= SERIAL9_RETRY_BUFFER_SIZE);
+
+  _host_write(SERIAL9_ESCAPE);
+  _host_write(SERIAL9_COLLISION);
+  _host_write((_cd_position > 0xff) ? 0xff : (uint8_t)_cd_position);
+  _host_write(retry ? (_cd_retries - _cd_attempt + 1) : 0);
+
+  if (retry) {
+    uint8_t range = (_cd_attempt < SERIAL9_BACKOFF_MAX) ? _cd_attempt : SERIAL9_BACKOFF_MAX;
+
+    _cd_last = micros();
+    _cd_lfsr = serial9_prbs(_cd_lfsr ^ (uint16_t)_cd_last);
+    if (0 == _cd_lfsr) {
+      _cd_lfsr = SERIAL9_PRBS_SEED;
+    }
+    _cd_backoff = _frame_gap * (1 + (_cd_lfsr & ((1 << range) - 1)));
+    _cd_state = SERIAL9_COLLIDE_BACKOFF;
+  } else {
+    _collide_set(true, _cd_retries);
+  }
+}
+
+// Wait for the echo of the end of the frame, wait for the bus to be
+// quiet for the backoff, or send the frame again - one word per pass
+//
+void Serial9::_collide_loop(void)
+{
+  if (SERIAL9_COLLIDE_ENDING == _cd_state) {
+    if (_cd_echo == _cd_sent) {
+      if (_cd_attempt > 0) {
+        _host_write(SERIAL9_ESCAPE);
+        _host_write(SERIAL9_RETRIED);
+        _host_write(_cd_attempt);
+      }
+      _collide_set(true, _cd_retries);
+    }
+
+  } else if (SERIAL9_COLLIDE_BACKOFF == _cd_state) {
+    if ((uint32_t)(micros() - _cd_last) > _cd_backoff) {
+      _cd_state = SERIAL9_COLLIDE_RESEND;
+    }
+
+  } else if (_cd_sent < _cd_count) {
+    _cd_last = micros();
+    _bus_write(_cd_frame[_cd_sent++]);
+
+  } else {
+    _cd_state = SERIAL9_COLLIDE_ENDING;
+  }
+}
+
+// The escape protocol state machine, for one byte from the host - from
+// the priority lane or the normal one
+//
+void Serial9::_host_byte(uint8_t tx_data)
+{
+  switch (tx_state) {
+
+  case SERIAL9_STATE_IDLE:
+
+    if (SERIAL9_ESCAPE == tx_data) {
+      tx_state = SERIAL9_STATE_ESCAPE;
+
+    } else {
+      _transmit(tx_data);
+    }
+    break;
+
+  case SERIAL9_STATE_ESCAPE:
+
+    // Most of the time the next state will be SERIAL9_STATE_IDLE
+    // so we set it here - override if necessary!
+    //
+    tx_state = SERIAL9_STATE_IDLE;
 
-      } else if (SERIAL9_8BIT == tx_data) {
-        serial9_set_8bit_mode();
+    if (SERIAL9_HIGH == tx_data) {
+      tx_state = SERIAL9_STATE_HIGH;
 
-      } else if (SERIAL9_9BIT == tx_data) {
-        serial9_set_9bit_mode();
+    } else if (SERIAL9_ESCAPE == tx_data) {
+      // It's an escaped ESCAPE character, just send it
+      _transmit(tx_data);
 
-      } else if (SERIAL9_BAUD_300 == tx_data) {
-        serial9_set_baud(300);
+    } else if (SERIAL9_8BIT == tx_data) {
+      serial9_set_8bit_mode(_ch);
 
-      } else if (SERIAL9_BAUD_600 == tx_data) {
-        serial9_set_baud(600);
+    } else if (SERIAL9_9BIT == tx_data) {
+      serial9_set_9bit_mode(_ch);
 
-      } else if (SERIAL9_BAUD_1200 == tx_data) {
-        serial9_set_baud(1200);
+    } else if (SERIAL9_BAUD_300 == tx_data) {
+      _set_baud(300);
 
-      } else if (SERIAL9_BAUD_2400 == tx_data) {
-        serial9_set_baud(2400);
+    } else if (SERIAL9_BAUD_600 == tx_data) {
+      _set_baud(600);
 
-      } else if (SERIAL9_BAUD_4800 == tx_data) {
-        serial9_set_baud(4800);
+    } else if (SERIAL9_BAUD_1200 == tx_data) {
+      _set_baud(1200);
 
-      } else if (SERIAL9_BAUD_9600 == tx_data) {
-        serial9_set_baud(9600);
+    } else if (SERIAL9_BAUD_2400 == tx_data) {
+      _set_baud(2400);
 
-      } else if (SERIAL9_BAUD_19200 == tx_data) {
-        serial9_set_baud(19200);
+    } else if (SERIAL9_BAUD_4800 == tx_data) {
+      _set_baud(4800);
 
-      } else if (SERIAL9_BAUD_38400 == tx_data) {
-        serial9_set_baud(38400);
+    } else if (SERIAL9_BAUD_9600 == tx_data) {
+      _set_baud(9600);
 
-      } else if (SERIAL9_BAUD_57600 == tx_data) {
-        serial9_set_baud(57600);
+    } else if (SERIAL9_BAUD_19200 == tx_data) {
+      _set_baud(19200);
 
-      } else if (SERIAL9_BAUD_115200 == tx_data) {
-        serial9_set_baud(115200);
+    } else if (SERIAL9_BAUD_38400 == tx_data) {
+      _set_baud(38400);
 
+    } else if (SERIAL9_BAUD_57600 == tx_data) {
+      _set_baud(57600);
+
+    } else if (SERIAL9_BAUD_115200 == tx_data) {
+      _set_baud(115200);
+
+    } else if (SERIAL9_SNIFF_START == tx_data) {
+      // Keep DE low for good - everything on the bus is reported
+      // back to the host with a timestamp
+      _sniffing = true;
+      serial9_listen(_ch);
+
+    } else if (SERIAL9_SNIFF_STOP == tx_data) {
+      _sniffing = false;
+      if (_duplex) {
+        serial9_duplex(_ch);
+      }
+
+    } else if (SERIAL9_DUPLEX_ON == tx_data) {
+      _set_duplex(true);
+
+    } else if (SERIAL9_DUPLEX_OFF == tx_data) {
+      _set_duplex(false);
+
+    } else if (SERIAL9_CHECK_OFF == tx_data) {
+      _set_check(SERIAL9_CHECK_NONE);
+
+    } else if (SERIAL9_CHECK_ADD == tx_data) {
+      _set_check(SERIAL9_CHECK_MDB);
+
+    } else if (SERIAL9_CHECK_CRC == tx_data) {
+      _set_check(SERIAL9_CHECK_CRC16);
+
+    } else if (SERIAL9_CHECK_END == tx_data) {
+      // The MDB checksum is a single byte, the CRC is sent least
+      // significant byte first. Both go out ahead of any more data.
+      if (SERIAL9_CHECK_MDB == _check) {
+        _tx_pending[1] = (uint8_t)_tx_check;
+        _tx_pending_count = 1;
+      } else if (SERIAL9_CHECK_CRC16 == _check) {
+        _tx_pending[0] = (uint8_t)_tx_check;
+        _tx_pending[1] = (uint8_t)(_tx_check >> 8);
+        _tx_pending_count = 2;
       } else {
-        // illegal character - ignore it
+        DO_NOTHING;
+      }
+
+    } else if (SERIAL9_DELIVER_ALL == tx_data) {
+      _deliver_good = false;
+
+    } else if (SERIAL9_DELIVER_GOOD == tx_data) {
+      _deliver_good = true;
+
+    } else if (SERIAL9_SELFTEST == tx_data) {
+      _start_command(tx_data, serial9_param_length(tx_data));
+
+    } else if (SERIAL9_CREDIT_ON == tx_data) {
+      // The first grant is whatever room is left in the queue, less the
+      // reserve for priority frames
+      if (!_credit) {
+        _credit = true;
+        if (_txq_count < (SERIAL9_TX_QUEUE_SIZE - SERIAL9_CREDIT_RESERVE)) {
+          _credit_freed = SERIAL9_TX_QUEUE_SIZE - SERIAL9_CREDIT_RESERVE - _txq_count;
+        } else {
+          _credit_freed = 0;
+        }
+      }
+
+    } else if (SERIAL9_CREDIT_OFF == tx_data) {
+      _credit = false;
+
+    } else if (SERIAL9_COLLIDE_ON == tx_data) {
+      _start_command(tx_data, serial9_param_length(tx_data));
+
+    } else if (SERIAL9_COLLIDE_OFF == tx_data) {
+      _collide_set(false, 0);
+
+    } else if (SERIAL9_FRAME_END == tx_data) {
+      _collide_end();
+      _in_frame = false;
+
+    } else if (SERIAL9_AUTOBAUD == tx_data) {
+      _autobaud_start();
+
+    } else if (SERIAL9_PRIORITY == tx_data) {
+      // Only seen when nothing is queued - the frame is in the stream
+      // right here, so it is simply sent in order
+      _start_command(tx_data, serial9_param_length(tx_data));
+
+    } else {
+      // illegal character - ignore it
 //      tx_state = SERIAL9_STATE_IDLE;
+    }
+    break;
+
+  case SERIAL9_STATE_PARAM:
+      _params[_param_count++] = tx_data;
+      if (_param_count == _param_length) {
+        tx_state = SERIAL9_STATE_IDLE;
+        _run_command();
       }
       break;
 
-    case SERIAL9_STATE_HIGH:
-        // It's a character that should be sent with the 9th bit high
-        tx_state = SERIAL9_STATE_IDLE;
-        _writing = true;
-        serial9_talk();
-        serial9_write(tx_data | SERIAL9_BIT9);
-        break;
-
-    default:
-       // Weird state when we got this character, ignore it and
-       // force the IDLE state
-       //
-       tx_state = SERIAL9_STATE_IDLE;
+  case SERIAL9_STATE_HIGH:
+      // It's a character that should be sent with the 9th bit high
+      tx_state = SERIAL9_STATE_IDLE;
+      _transmit(tx_data | SERIAL9_BIT9);
+      break;
+
+  default:
+     // Weird state when we got this character, ignore it and
+     // force the IDLE state
+     //
+     tx_state = SERIAL9_STATE_IDLE;
+  }
+}
+
+void Serial9::loop(void)
+{
+  if (_selftest) {
+    _selftest_loop();
+    return;
+  }
+
+  if (_autobaud) {
+    _autobaud_loop();
+    return;
+  }
+
+  if (_credit || (SERIAL9_STATE_IDLE != _in_state)) {
+    _fill_queue();
+  }
+
+  // Close the incoming frame once the bus has been quiet for long enough
+
+  if (_rx_open && ((uint32_t)(micros() - _rx_last) > _frame_gap)) {
+    _rx_close();
+  }
+
+  // An echo that never comes back is a collision too - the other
+  // master may have wiped it out completely
+
+  if (_collide && (_cd_echo != _cd_sent) && ((uint32_t)(micros() - _cd_last) > _frame_gap)) {
+    _collision();
+  }
+
+  // UPDATE THIS COMMENT - IT IS INCORRDCT
+
+  // Highest priority is checking to see if a character is available
+  // in the hardware serial device, and sending the data back to the
+  // host using the USB9_ESCAPE sequence if necessary.
+
+  // The UART has completed the current character and there are no
+  // incoming charaters available from the USB - force the interface
+  // into the listen state if we were writing
+
+  if (_duplex) {
+    // DE stays asserted, there is no direction to switch
+    DO_NOTHING;
+
+  } else if (serial9_tx_complete(_ch) && !serial9_rx_available(_ch)) {
+
+    // Force listen mode, we are no longer writing
+    if (_writing) {
+      _writing = false;
+      serial9_listen(_ch);
+    } else {
+      // Do nothing
+      DO_NOTHING;
+    }
+
+//    tx_state = SERIAL9_STATE_IDLE;
+  }
+
+  // A character has been received by the UART. In half duplex that is
+  // all for this pass, in full duplex the UART transmitter is looked
+  // after in the same pass
+  //
+  bool received = serial9_rx_available(_ch);
+
+  if (received) {
+    _receive(serial9_read(_ch));
+  }
+
+  if (received && !_duplex) {
+    DO_NOTHING;
+
+  // The UART is NOT ready to send a character, do nothing
+
+  } else if (serial9_tx_busy(_ch)) {
+    // No point getting more from Serial if we are still
+    // busy transmitting on serial9 :-)
+    //
+    DO_NOTHING;
+
+  // The UART is ready to send a character, finish off the check at the
+  // end of the outgoing frame before taking any more USB Serial data
+
+  } else if (_tx_pending_count > 0) {
+
+    _transmit(_tx_pending[sizeof(_tx_pending) - _tx_pending_count]);
+    _tx_pending_count--;
+
+    if (0 == _tx_pending_count) {
+      _tx_check = serial9_check_init(_check);
+      _in_frame = false;
     }
 
+  // A frame that has been sent is checked, or sent again after a
+  // collision, before any more USB Serial data is taken
+
+  } else if (_collide && (_cd_state >= SERIAL9_COLLIDE_ENDING)) {
+    _collide_loop();
+
+  // An urgent frame from the priority lane goes out at the next frame
+  // boundary, ahead of anything else from the host
+
+  } else if (_priority_ready()) {
+    _priority_read();
+
+  // The UART is ready to send a character, is there USB Serial data?
+
+  } else if (_host_available()) {
+    _host_byte(_host_read());
+
   // The UART has completed the current character and there are no
   // incoming charaters available from the USB - force the interface
   // into the listen state if we were writing
 
-  } else if (serial9_tx_complete()) {
+  } else if (serial9_tx_complete(_ch)) {
 
     // Force listen mode, we are no longer writing
     if (_writing) {
       _writing = false;
-      serial9_listen();
+      serial9_listen(_ch);
     } else {
       // Do nothing
       DO_NOTHING;
     }
 
-    tx_state = SERIAL9_STATE_IDLE;
+    // The host has nothing more for the bus, so this is a frame boundary
+    _in_frame = false;
+
+    // Keep tx_state - an escape sequence can be split across two USB
+    // packets, and the rest of it is still on the way
 
   // No other cases to cover ... we are done
 
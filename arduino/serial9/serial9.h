@@ -10,17 +10,219 @@
 enum serial9_state_e { SERIAL9_STATE_IDLE,
                        SERIAL9_STATE_ESCAPE,
                        SERIAL9_STATE_HIGH,
+                       SERIAL9_STATE_PARAM,
+                       SERIAL9_STATE_LENGTH,
+                       SERIAL9_STATE_PRIORITY,
                      };
 
+enum serial9_check_e { SERIAL9_CHECK_NONE,
+                       SERIAL9_CHECK_MDB,
+                       SERIAL9_CHECK_CRC16,
+                     };
+
+enum serial9_collide_e { SERIAL9_COLLIDE_SENDING,
+                         SERIAL9_COLLIDE_ABORTED,
+                         SERIAL9_COLLIDE_ENDING,
+                         SERIAL9_COLLIDE_BACKOFF,
+                         SERIAL9_COLLIDE_RESEND,
+                       };
+
+// Big enough for the longest MDB frame - 36 data bytes, the address and
+// the checksum - so an incoming frame can be held until its check is known
+
+#ifndef SERIAL9_BUFFER_SIZE
+  #define SERIAL9_BUFFER_SIZE (40)
+#endif
+
+// The same again, so a collided frame can be sent again
+
+#ifndef SERIAL9_RETRY_BUFFER_SIZE
+  #define SERIAL9_RETRY_BUFFER_SIZE (SERIAL9_BUFFER_SIZE)
+#endif
+
+// Room for a short urgent frame, as the host sends it - escapes included
+
+#ifndef SERIAL9_PRIORITY_SIZE
+  #define SERIAL9_PRIORITY_SIZE (16)
+#endif
+
+// The credit is sent to the host as a single byte, so the queue must
+// not be bigger than 255 bytes
+
+#ifndef SERIAL9_TX_QUEUE_SIZE
+  #define SERIAL9_TX_QUEUE_SIZE (128)
+#endif
+
+// Queue room held back from the credit. Priority frames are sent outside
+// the credit, and the host may have to finish an escape sequence before
+// one - this keeps room for that, so a priority frame can always be read
+
+#define SERIAL9_CREDIT_RESERVE (8)
+
+// The number of USARTs the hardware layer can drive, at most 3 - each is a
+// separate bus, shared over the one USB link by a Serial9Mux
+
+#ifndef SERIAL9_CHANNELS
+  #if defined(__AVR_ATmega2560__)
+    #define SERIAL9_CHANNELS (3)
+  #else
+    #define SERIAL9_CHANNELS (1)
+  #endif
+#endif
+
+// Full duplex RS-422 - DE stays asserted and RE_ stays enabled, so there
+// is no direction switching. Build with (1) to start up that way, the host
+// can still switch with ESCAPE 0xA0/0xA1
+
+#ifndef SERIAL9_FULL_DUPLEX
+  #define SERIAL9_FULL_DUPLEX (0)
+#endif
+
+class Serial9Mux;
+
 class Serial9 // : public Stream
 {
+  friend class Serial9Mux;
+
   private:
+    uint8_t _ch;
+    Serial9Mux *_mux;
+
     bool _writing;
+    bool _sniffing;
+    bool _duplex;
 
     enum serial9_state_e tx_state;
 
+    // Escape commands with parameters collect them here first
+
+    uint8_t _command;
+    uint8_t _params[4];
+    uint8_t _param_count;
+    uint8_t _param_length;
+
+    // Frame checks - the checksum of the outgoing frame is appended from
+    // _tx_pending, the incoming frame is held in _rx_frame if the host
+    // only wants good frames
+
+    uint8_t _check;
+    bool _deliver_good;
+    uint32_t _frame_gap;
+
+    uint16_t _tx_check;
+    uint8_t _tx_pending[2];
+    uint8_t _tx_pending_count;
+
+    bool _rx_open;
+    bool _rx_overflow;
+    uint32_t _rx_last;
+    uint16_t _rx_check;
+    uint16_t _rx_check_prev;
+    uint8_t _rx_count;
+    uint16_t _rx_length;
+    uint16_t _rx_frame[SERIAL9_BUFFER_SIZE];
+
+    // Self test - send a PRBS pattern and check the echo of each word
+
+    bool _selftest;
+    bool _st_waiting;
+    uint16_t _st_remaining;
+    uint16_t _st_lfsr;
+    uint16_t _st_expect;
+    uint8_t _st_mix;
+    uint32_t _st_words;
+    uint32_t _st_errors;
+    uint32_t _st_run;
+    uint32_t _st_longest;
+    uint32_t _st_start;
+    uint32_t _st_sent;
+
+    // Credit flow control - bytes from the host wait in _txq, and the
+    // host gets a credit for every byte we take out of it
+
+    bool _credit;
+    uint8_t _credit_freed;
+    uint8_t _txq[SERIAL9_TX_QUEUE_SIZE];
+    uint8_t _txq_head;
+    uint8_t _txq_tail;
+    uint8_t _txq_count;
+
+    // Autobaud - listen with DE low and time the edges on the RX pin,
+    // the shortest time between two edges that others agree with is one
+    // bit
+
+    bool _autobaud;
+    uint32_t _ab_start;
+
+    // Priority lane - ESCAPE PRIORITY n and the n bytes after it are taken
+    // out of the host stream as it is queued, and sent ahead of the rest
+    // of the queue at the next frame boundary
+
+    enum serial9_state_e _in_state;
+    uint8_t _in_count;
+    bool _in_frame;
+    bool _pq_sending;
+    uint8_t _pq[SERIAL9_PRIORITY_SIZE];
+    uint8_t _pq_count;
+    uint8_t _pq_ready;
+    uint8_t _pq_pos;
+    uint8_t _pq_length;
+    bool _pq_overflow;
+    enum serial9_state_e _pq_state;
+
+    // Collision detect - the echo of every word sent must match it. The
+    // frame is kept in _cd_frame until the host ends it, so it can be
+    // sent again after a collision
+
+    bool _collide;
+    enum serial9_collide_e _cd_state;
+    uint8_t _cd_retries;
+    uint8_t _cd_attempt;
+    uint16_t _cd_frame[SERIAL9_RETRY_BUFFER_SIZE];
+    uint16_t _cd_count;
+    uint16_t _cd_sent;
+    uint16_t _cd_echo;
+    uint16_t _cd_position;
+    uint16_t _cd_lfsr;
+    uint32_t _cd_last;
+    uint32_t _cd_backoff;
+
+    void _set_baud(uint32_t baud);
+    void _set_check(uint8_t check);
+    void _set_duplex(bool on);
+    void _transmit(uint16_t data);
+    void _bus_write(uint16_t data);
+    void _send_word(uint16_t data);
+    void _send_timestamp(uint32_t t);
+    void _receive(uint16_t data);
+    void _rx_word(uint16_t data);
+    void _rx_close(void);
+    void _start_command(uint8_t command, uint8_t length);
+    void _run_command(void);
+    void _selftest_start(uint16_t count, uint8_t mix);
+    void _selftest_loop(void);
+    void _send_u32(uint32_t value);
+    void _autobaud_start(void);
+    void _autobaud_loop(void);
+    void _fill_queue(void);
+    bool _host_available(void);
+    uint8_t _host_read(void);
+    void _host_write(uint8_t data);
+    void _queue(uint8_t data);
+    void _txq_put(uint8_t data);
+    bool _priority_ready(void);
+    void _priority_read(void);
+    void _host_byte(uint8_t tx_data);
+    void _collide_set(bool on, uint8_t retries);
+    void _collide_transmit(uint16_t data);
+    void _collide_echo(uint16_t data);
+    void _collide_end(void);
+    void _collide_loop(void);
+    void _collision(void);
+    void _collide_decide(void);
+
   public:
-    Serial9();
+    Serial9(uint8_t ch = 0);
     ~Serial9();
 
     void begin(uint32_t baud);
@@ -28,6 +230,34 @@ class Serial9 // : public Stream
     void loop(void);
 };
 
+// Shares the USB link between one Serial9 per USART. ESCAPE 0x6n selects
+// channel n for everything the host sends after it, and the same escape
+// goes to the host before data from a different channel than the last.
+// Channel 0 is selected to start with, so a single channel stream looks
+// exactly like one without a mux. Each channel select from the host is
+// answered with the channel of the data going to the host.
+
+class Serial9Mux
+{
+  private:
+    Serial9 *_channels[SERIAL9_CHANNELS];
+    uint8_t _count;
+
+    enum serial9_state_e _state;
+    uint8_t _param_count;
+    uint8_t _rx_ch;
+    uint8_t _tx_ch;
+
+    void _ingest(void);
+
+  public:
+    Serial9Mux();
+
+    bool add(Serial9 *s9);
+    void write(uint8_t ch, uint8_t data);
+    void loop(void);
+};
+
 // This macro is used to provide code coverage for empty cases
 // or conditional clauses - when we are compiling normally
 // it evaluates to nothing 
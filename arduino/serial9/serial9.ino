@@ -8,16 +8,47 @@ See README and LICENCE for more information
 
 #include "Arduino.h"
 
-#if !defined(HAVE_CDCSERIAL)
+#if defined(ARDUINO_AVR_MEGA2560)
+  // The host link is Serial on USART0 through the 16U2, and each of the
+  // other three USARTs is a bus
+#elif !defined(HAVE_CDCSERIAL)
   #error This project requires an Arduino with USB-CDC capabilities
-#endif
-
-#if !defined(ARDUINO_AVR_LEONARDO)
+#elif !defined(ARDUINO_AVR_LEONARDO)
   #error This project requires an AVR_LEONARDO compatible board (Pro Micro)
 #endif
 
 #include "serial9.h"
 
+#if (SERIAL9_CHANNELS > 1)
+
+Serial9 s9[SERIAL9_CHANNELS] = {
+  Serial9(0),
+  Serial9(1),
+#if (SERIAL9_CHANNELS > 2)
+  Serial9(2),
+#endif
+};
+
+Serial9Mux mux;
+
+// the setup function runs once when you press reset or power the board
+void setup() {
+#if defined(ARDUINO_AVR_MEGA2560)
+  Serial.begin(1000000);
+#endif
+  for (uint8_t ch = 0; ch < SERIAL9_CHANNELS; ++ch) {
+    s9[ch].begin(9600);
+    mux.add(&s9[ch]);
+  }
+}
+
+// the loop function runs over and over again forever
+void loop() {
+   mux.loop();
+}
+
+#else
+
 Serial9 s9;
 
 // the setup function runs once when you press reset or power the board
@@ -29,3 +60,5 @@ void setup() {
 void loop() {
    s9.loop();
 }
+
+#endif
@@ -1,11 +1,19 @@
 /* ---------------------------------------------------------------------------
   serial9_atmega_32u.cpp - hardware specific support for serial9
 
-  Currently only the __AVR_ATmega32U4__ is supported
+  Currently the __AVR_ATmega32U4__ (one USART) and the __AVR_ATmega2560__
+  (three USARTs, USART0 is the host link) are supported.
+
+  Every function takes the channel number, which picks the USART and
+  the DE/RE_ pins from the serial9_usart table.
 */
 #include "Arduino.h"
 
-#if defined(__AVR_ATmega32U4__)
+#include "serial9.h"
+
+#if defined(__AVR_ATmega32U4__) || defined(__AVR_ATmega2560__)
+  // The bits are in the same place in every USART, so the USART1
+  // names will do for all of them
   #define TXC TXC1
   #define RXC RXC1
   #define RXEN RXEN1
@@ -22,20 +30,51 @@
   #define TXB8 TXB81
   #define RXB8 RXB81
 
-  #define UBRRH UBRR1H
-  #define UBRRL UBRR1L
+#else
+  #error This library currently only works with ATmega32U4 or ATmega2560
+#endif
+
+struct serial9_usart_s {
+  volatile uint8_t *ucsra;
+  volatile uint8_t *ucsrb;
+  volatile uint8_t *ucsrc;
+  volatile uint8_t *ubrrh;
+  volatile uint8_t *ubrrl;
+  volatile uint8_t *udr;
+  uint8_t re_;
+  uint8_t de;
+};
 
-  #define UCSRA UCSR1A
-  #define UCSRB UCSR1B
-  #define UCSRC UCSR1C
-  #define UDR UDR1
+// USART0 is the host link on the 2560, which leaves three for the buses
 
-  #define RE_ (2)
-  #define DE  (3)
-#else
-  #error This library currently only works with ATmega32U4
+#if (SERIAL9_CHANNELS > 3)
+  #error There are only USARTs for up to 3 channels
 #endif
 
+static const struct serial9_usart_s serial9_usart[SERIAL9_CHANNELS] = {
+    { &UCSR1A, &UCSR1B, &UCSR1C, &UBRR1H, &UBRR1L, &UDR1, 2, 3 },
+#if (SERIAL9_CHANNELS > 1)
+    { &UCSR2A, &UCSR2B, &UCSR2C, &UBRR2H, &UBRR2L, &UDR2, 4, 5 },
+#endif
+#if (SERIAL9_CHANNELS > 2)
+    { &UCSR3A, &UCSR3B, &UCSR3C, &UBRR3H, &UBRR3L, &UDR3, 6, 7 },
+#endif
+};
+
+// These keep the register access below looking like the datasheet, they
+// only work where there is a ch in scope
+
+#define UBRRH (*serial9_usart[ch].ubrrh)
+#define UBRRL (*serial9_usart[ch].ubrrl)
+
+#define UCSRA (*serial9_usart[ch].ucsra)
+#define UCSRB (*serial9_usart[ch].ucsrb)
+#define UCSRC (*serial9_usart[ch].ucsrc)
+#define UDR (*serial9_usart[ch].udr)
+
+#define RE_ (serial9_usart[ch].re_)
+#define DE  (serial9_usart[ch].de)
+
 // UCSRA has three bits that are R/W - we need to be sure we are writing
 // the correct value to the other bits when writing to a specific bit!
 //
@@ -52,22 +91,24 @@
 // is complete, we can preset the ucsra_shadow variable with the correct
 // value and always use the shadow copy when writing to UCSRA.
 //
-static uint8_t ucsra_shadow = bit(TXC);
+static uint8_t ucsra_shadow[SERIAL9_CHANNELS];
 
-void serial9_set_8bit_mode(void)
+void serial9_set_8bit_mode(uint8_t ch)
 {
   UCSRB &= ~bit(UCSZ2);
 }
 
-void serial9_set_9bit_mode(void)
+void serial9_set_9bit_mode(uint8_t ch)
 {
   UCSRB |= bit(UCSZ2);
 }
 
-void serial9_set_baud(uint32_t baud)
+// Returns the UBRR setting for a baud rate, and whether it needs U2X
+
+static uint16_t serial9_ubrr(uint32_t baud, bool *u2x)
 {
   uint16_t baud_setting = (F_CPU / 4 / baud - 1) / 2;
-  ucsra_shadow |= bit(U2X);
+  *u2x = true;
 
   // Hardcoded exception for 57600 for compatibility with the bootloader
   // shipped with the Duemilanove and previous boards and the firmware
@@ -77,10 +118,23 @@ void serial9_set_baud(uint32_t baud)
   if (((F_CPU == 16000000UL) && (baud == 57600)) || (baud_setting >4095))
   {
     baud_setting = (F_CPU / 8 / baud - 1) / 2;
-    ucsra_shadow &= ~bit(U2X);
+    *u2x = false;
+  }
+
+  return baud_setting;
+}
+
+void serial9_set_baud(uint8_t ch, uint32_t baud)
+{
+  bool u2x;
+  uint16_t baud_setting = serial9_ubrr(baud, &u2x);
+
+  ucsra_shadow[ch] = bit(TXC);
+  if (u2x) {
+    ucsra_shadow[ch] |= bit(U2X);
   }
 
-  UCSRA = ucsra_shadow;
+  UCSRA = ucsra_shadow[ch];
 
   // assign the baud_setting, a.k.a. ubrr (USART Baud Rate Register)
   UBRRH = baud_setting >> 8;
@@ -90,7 +144,17 @@ void serial9_set_baud(uint32_t baud)
   digitalWrite(RE_, LOW);
 }
 
-void serial9_start(void)
+// The rate the USART really runs at when it is set to a baud rate
+
+uint32_t serial9_baud_actual(uint8_t ch, uint32_t baud)
+{
+  bool u2x;
+  uint32_t divisor = (uint32_t)(serial9_ubrr(baud, &u2x) + 1) * (u2x ? 8 : 16);
+
+  return (F_CPU + divisor / 2) / divisor;
+}
+
+void serial9_start(uint8_t ch)
 {
   // Disable interrupts, set 9bit mode, enable rx/tx - this completely
   // overwrites any previous UCSRB bits
@@ -104,7 +168,7 @@ void serial9_start(void)
   pinMode(RE_, OUTPUT);
 }
 
-void serial9_stop(void)
+void serial9_stop(uint8_t ch)
 {
   // Turn off RX and TX
   UCSRB &= ~(bit(TXEN) | bit(RXEN));
@@ -114,7 +178,7 @@ void serial9_stop(void)
   pinMode(RE_, INPUT);
 }
 
-void serial9_talk(void)
+void serial9_talk(uint8_t ch)
 {
   digitalWrite(DE, HIGH);
 }
@@ -123,25 +187,34 @@ void serial9_talk(void)
 //       you set the DE to LOW - then set RE_ low to enable
 //       receiving again
 
-void serial9_listen(void)
+void serial9_listen(uint8_t ch)
 {
   digitalWrite(RE_, HIGH);
   digitalWrite(DE, LOW);
   digitalWrite(RE_, LOW);
 }
 
-void serial9_offline(void)
+void serial9_offline(uint8_t ch)
 {
   digitalWrite(DE, LOW);
   digitalWrite(RE_, HIGH);
 }
 
-bool serial9_rx_available(void)
+// Full duplex - the driver and receiver are on separate pairs, so both
+// stay on all the time
+
+void serial9_duplex(uint8_t ch)
+{
+  digitalWrite(RE_, LOW);
+  digitalWrite(DE, HIGH);
+}
+
+bool serial9_rx_available(uint8_t ch)
 {
   return (bool)(UCSRA & bit(RXC));
 }
 
-uint16_t serial9_read(void)
+uint16_t serial9_read(uint8_t ch)
 {
   if (!(bool)(UCSRA & bit(RXC))) {
     return -1;
@@ -152,20 +225,20 @@ uint16_t serial9_read(void)
   }
 }
 
-bool serial9_tx_busy(void)
+bool serial9_tx_busy(uint8_t ch)
 {
   return 0 == (UCSRA & bit(UDRE));
 }
 
-bool serial9_tx_complete(void)
+bool serial9_tx_complete(uint8_t ch)
 {
   return (bool)(UCSRA & bit(TXC));
 }
 
-void serial9_write(uint16_t data)
+void serial9_write(uint8_t ch, uint16_t data)
 {
   if ((bool)(UCSRA & bit(TXC))) {
-      UCSRA = ucsra_shadow;
+      UCSRA = ucsra_shadow[ch];
   }
 
   if (data & bit(8)) {
@@ -176,3 +249,156 @@ void serial9_write(uint16_t data)
 
   UDR = (uint8_t)(data & 0xff);
 }
+
+// Autobaud - RXD1 is PD2 on both parts, which is also INT2, so every edge
+// on the channel 0 RX pin can be timed against Timer1 running at F_CPU.
+// The other channels have no external interrupt on their RX pins.
+//
+// Timer1 overflows every 4 msec at 16 MHz, which is not even two bit
+// times at 300 baud, so the overflows are counted to make a 32 bit time.
+// Timer1 is set back the way it was when we are done, but PWM on the
+// Timer1 pins stops while autobaud runs.
+//
+// Anything shorter than a bit at 250 kbaud is taken to be a glitch.
+//
+// A single short interval from noise that got past the glitch filter
+// would set the rate on its own if we kept only the shortest one, so the
+// ISR keeps the SERIAL9_EDGE_WIDTHS shortest, sorted. Once that list has
+// filled up with single bits almost every edge is longer than the last
+// one kept and costs one compare.
+
+#define SERIAL9_EDGE_GLITCH (F_CPU / 250000UL)
+#define SERIAL9_EDGE_WIDTHS (8)
+
+static volatile uint16_t serial9_edges;
+static volatile uint16_t serial9_edge_overflows;
+static volatile uint32_t serial9_edge_last;
+static volatile uint32_t serial9_edge_widths[SERIAL9_EDGE_WIDTHS];
+
+static uint8_t serial9_tccr1a;
+static uint8_t serial9_tccr1b;
+static uint8_t serial9_timsk1;
+
+ISR(TIMER1_OVF_vect)
+{
+  serial9_edge_overflows++;
+}
+
+ISR(INT2_vect)
+{
+  uint16_t low = TCNT1;
+  uint16_t high = serial9_edge_overflows;
+
+  // An overflow that has not been counted yet comes before this edge if
+  // the counter has only just wrapped
+  if ((TIFR1 & bit(TOV1)) && (low < 0x8000)) {
+    high++;
+  }
+
+  uint32_t now = ((uint32_t)high << 16) | low;
+
+  if (serial9_edges > 0) {
+    uint32_t width = now - serial9_edge_last;
+    if ((width >= SERIAL9_EDGE_GLITCH) && (width < serial9_edge_widths[SERIAL9_EDGE_WIDTHS - 1])) {
+      uint8_t i = SERIAL9_EDGE_WIDTHS - 1;
+      while ((i > 0) && (width < serial9_edge_widths[i - 1])) {
+        serial9_edge_widths[i] = serial9_edge_widths[i - 1];
+        --i;
+      }
+      serial9_edge_widths[i] = width;
+    }
+  }
+
+  serial9_edge_last = now;
+  if (serial9_edges < 0xffff) {
+    serial9_edges++;
+  }
+}
+
+bool serial9_edge_start(uint8_t ch)
+{
+  if (0 != ch) {
+    return false;
+  }
+
+  // The USART would only pass garbage to the host while we measure
+  UCSRB &= ~bit(RXEN);
+
+  serial9_edges = 0;
+  serial9_edge_overflows = 0;
+  for (uint8_t i = 0; i < SERIAL9_EDGE_WIDTHS; ++i) {
+    serial9_edge_widths[i] = 0xffffffffUL;
+  }
+
+  serial9_tccr1a = TCCR1A;
+  serial9_tccr1b = TCCR1B;
+  serial9_timsk1 = TIMSK1;
+
+  TCCR1A = 0;
+  TCCR1B = bit(CS10);
+  TCNT1 = 0;
+  TIFR1 = bit(TOV1);
+  TIMSK1 = bit(TOIE1);
+
+  // Interrupt on any edge of INT2
+  EICRA = (EICRA & ~(bit(ISC21) | bit(ISC20))) | bit(ISC20);
+  EIFR = bit(INTF2);
+  EIMSK |= bit(INT2);
+
+  return true;
+}
+
+void serial9_edge_stop(uint8_t ch)
+{
+  EIMSK &= ~bit(INT2);
+
+  TIMSK1 = serial9_timsk1;
+  TCCR1A = serial9_tccr1a;
+  TCCR1B = serial9_tccr1b;
+
+  UCSRB |= bit(RXEN);
+}
+
+uint16_t serial9_edge_count(uint8_t ch)
+{
+  noInterrupts();
+  uint16_t edges = serial9_edges;
+  interrupts();
+
+  return edges;
+}
+
+// One bit is the shortest interval that at least SERIAL9_EDGE_AGREE of
+// the kept ones are within 1/8 of - the 1 bit intervals of a UART are
+// much closer together than that, and 2 bits is well outside it. The
+// rate comes from the average of the ones that agree.
+
+#define SERIAL9_EDGE_AGREE (4)
+
+uint32_t serial9_edge_baud(uint8_t ch)
+{
+  uint32_t widths[SERIAL9_EDGE_WIDTHS];
+
+  noInterrupts();
+  for (uint8_t i = 0; i < SERIAL9_EDGE_WIDTHS; ++i) {
+    widths[i] = serial9_edge_widths[i];
+  }
+  interrupts();
+
+  for (uint8_t i = 0; (i <= SERIAL9_EDGE_WIDTHS - SERIAL9_EDGE_AGREE) && (0xffffffffUL != widths[i]); ++i) {
+    uint32_t limit = widths[i] + widths[i] / 8;
+    uint32_t sum = 0;
+    uint8_t n = 0;
+
+    for (uint8_t j = i; (j < SERIAL9_EDGE_WIDTHS) && (widths[j] <= limit); ++j) {
+      sum += widths[j];
+      ++n;
+    }
+
+    if (n >= SERIAL9_EDGE_AGREE) {
+      return (F_CPU * n + sum / 2) / sum;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,52 @@
+/* ---------------------------------------------------------------------------
+  serial9_check.cpp - frame checksums for serial9
+
+  Two kinds of check are supported:
+
+  1. SERIAL9_CHECK_MDB   - 8 bit additive checksum, as used by MDB
+  2. SERIAL9_CHECK_CRC16 - CRC-16 as used by Modbus RTU, polynomial 0xA001
+                           (reflected 0x8005), initial value 0xFFFF
+
+  The CRC uses a 16 entry nibble table instead of the usual 256 entry byte
+  table - 32 bytes instead of 512, and only two lookups per byte. The table
+  is in program memory so it takes no RAM.
+
+  Only the lower 8 bits of each word are included in the check.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "serial9.h"
+#include "Arduino.h"
+
+static const uint16_t crc16_nibble[16] PROGMEM = {
+  0x0000, 0xcc01, 0xd801, 0x1400, 0xf001, 0x3c00, 0x2800, 0xe401,
+  0xa001, 0x6c00, 0x7800, 0xb401, 0x5000, 0x9c01, 0x8801, 0x4400,
+};
+
+uint16_t serial9_crc16_update(uint16_t crc, uint8_t data)
+{
+  crc ^= data;
+  crc = (crc >> 4) ^ pgm_read_word(&crc16_nibble[crc & 0x0f]);
+  crc = (crc >> 4) ^ pgm_read_word(&crc16_nibble[crc & 0x0f]);
+  return crc;
+}
+
+uint16_t serial9_check_init(uint8_t mode)
+{
+  if (SERIAL9_CHECK_CRC16 == mode) {
+    return 0xffff;
+  } else {
+    return 0;
+  }
+}
+
+uint16_t serial9_check_update(uint8_t mode, uint16_t check, uint8_t data)
+{
+  if (SERIAL9_CHECK_CRC16 == mode) {
+    return serial9_crc16_update(check, data);
+  } else {
+    return (uint8_t)(check + data);
+  }
+}
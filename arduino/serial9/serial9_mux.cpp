@@ -0,0 +1,133 @@
+/* ---------------------------------------------------------------------------
+  serial9_mux.cpp - several serial9 buses over one USB link
+
+  The host stream is split up as it arrives, not when each channel gets
+  around to reading it. Each byte goes into the queue of the selected
+  channel, so a busy bus never holds up the others - unless the host
+  ignores the credits and fills the queue, then USB flow control kicks
+  in as usual.
+
+  To find the channel selects we have to follow the escape protocol just
+  far enough to skip over raw parameter bytes, which can be anything,
+  including 0xff 0x6n.
+
+  Opening the USB port does not reset the firmware, so a host that has
+  just started cannot know which channels are selected. Every channel
+  select from the host is answered with the channel select for the data
+  going to the host, which puts the host back in step.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "serial9.h"
+#include "Arduino.h"
+
+#define SERIAL9_ESCAPE (0xff)
+#define SERIAL9_CHANNEL (0x60) // Lower 4 bits are the channel number
+
+extern uint8_t serial9_param_length(uint8_t command);
+
+Serial9Mux::Serial9Mux()
+{
+  _count = 0;
+  _state = SERIAL9_STATE_IDLE;
+  _param_count = 0;
+  _rx_ch = 0;
+  _tx_ch = 0;
+}
+
+// Channels are numbered in the order they are added - each Serial9 must
+// have been created with the matching channel number
+//
+bool Serial9Mux::add(Serial9 *s9)
+{
+  if ((_count >= SERIAL9_CHANNELS) || (s9->_ch != _count)) {
+    return false;
+  } else {
+    s9->_mux = this;
+    _channels[_count++] = s9;
+    return true;
+  }
+}
+
+void Serial9Mux::write(uint8_t ch, uint8_t data)
+{
+  if (ch != _tx_ch) {
+    Serial.write(SERIAL9_ESCAPE);
+    Serial.write(SERIAL9_CHANNEL | ch);
+    _tx_ch = ch;
+  }
+  Serial.write(data);
+}
+
+// Leave room for an ESCAPE and the byte after it, they go into the
+// queue together
+//
+void Serial9Mux::_ingest(void)
+{
+  while (Serial.available() > 0) {
+
+    Serial9 *s9 = _channels[_rx_ch];
+
+    if (s9->_txq_count > (SERIAL9_TX_QUEUE_SIZE - 2)) {
+      break;
+    }
+
+    uint8_t data = Serial.read();
+
+    switch (_state) {
+
+    case SERIAL9_STATE_IDLE:
+      if (SERIAL9_ESCAPE == data) {
+        _state = SERIAL9_STATE_ESCAPE;
+      } else {
+        s9->_queue(data);
+      }
+      break;
+
+    case SERIAL9_STATE_ESCAPE:
+      _state = SERIAL9_STATE_IDLE;
+
+      if (SERIAL9_CHANNEL == (data & 0xf0)) {
+        // Selects of channels we don't have are dropped
+        if ((data & 0x0f) < _count) {
+          _rx_ch = data & 0x0f;
+        } else {
+          DO_NOTHING;
+        }
+        Serial.write(SERIAL9_ESCAPE);
+        Serial.write(SERIAL9_CHANNEL | _tx_ch);
+      } else {
+        s9->_queue(SERIAL9_ESCAPE);
+        s9->_queue(data);
+
+        _param_count = serial9_param_length(data);
+        if (_param_count > 0) {
+          _state = SERIAL9_STATE_PARAM;
+        }
+      }
+      break;
+
+    case SERIAL9_STATE_PARAM:
+      s9->_queue(data);
+      if (0 == --_param_count) {
+        _state = SERIAL9_STATE_IDLE;
+      }
+      break;
+
+    default:
+      _state = SERIAL9_STATE_IDLE;
+      break;
+    }
+  }
+}
+
+void Serial9Mux::loop(void)
+{
+  _ingest();
+
+  for (uint8_t i = 0; i < _count; ++i) {
+    _channels[i]->loop();
+  }
+}
@@ -0,0 +1,8 @@
+# Shell script to build the serial9 bridge
+#
+# Run from the top level serial9 folder, the bridge goes in the build
+# folder
+#
+mkdir -p build
+
+g++ -O2 -Wall host/serial9_bridge.cpp host/serial9_shm.cpp -I host -o build/serial9_bridge
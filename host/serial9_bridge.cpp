@@ -0,0 +1,278 @@
+/* ---------------------------------------------------------------------------
+  serial9_bridge.cpp - owns the serial9 adapter for a host process
+
+  Usage: serial9_bridge socket_path (tty_device | --echo)
+
+  Listens on a Unix socket for one host process at a time. The host
+  passes the shared memory rings over the socket (see ShmConn.connect()
+  in python/serial9/shm.py), and from then on the bridge copies bytes
+  between the rings and the serial9 adapter until the host closes the
+  socket. With --echo whatever the host sends comes straight back, for
+  testing and benchmarking.
+
+  The bridge only ever sleeps in poll(), after telling the host with the
+  waiting flags. The poll has a short timeout as well, because the
+  Python side cannot fence its flag and ring updates.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "serial9_shm.h"
+
+#define SERIAL9_BRIDGE_CHUNK (4096)
+#define SERIAL9_BRIDGE_POLL_MS (10)
+
+static int open_tty(const char *device)
+{
+  struct termios tio;
+
+  int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // The adapter is USB CDC, so the baud rate does not matter - it just
+  // has to be raw
+  if (0 == tcgetattr(fd, &tio)) {
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+
+  return fd;
+}
+
+static int listen_socket(const char *path)
+{
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 1) < 0)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// The host sends the magic with the memfd, the eventfd that wakes the
+// bridge and the eventfd that wakes the host attached
+//
+static bool receive_rings(int client, Serial9Shm &shm)
+{
+  char magic[8];
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { magic, sizeof(magic) };
+  struct msghdr msg;
+  int fds[3];
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t length = recvmsg(client, &msg, MSG_CMSG_CLOEXEC);
+  if (length < 0) {
+    return false;
+  }
+
+  // Anything but exactly three fds in one message is refused, and every
+  // fd that did arrive is closed - they are ours as soon as recvmsg()
+  // returns
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (((ssize_t)sizeof(magic) != length) || (msg.msg_flags & MSG_CTRUNC)
+   || (NULL == cmsg) || (SOL_SOCKET != cmsg->cmsg_level) || (SCM_RIGHTS != cmsg->cmsg_type)
+   || (CMSG_LEN(sizeof(fds)) != cmsg->cmsg_len) || (NULL != CMSG_NXTHDR(&msg, cmsg))) {
+    for (cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((SOL_SOCKET == cmsg->cmsg_level) && (SCM_RIGHTS == cmsg->cmsg_type)) {
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i) {
+          int fd;
+          memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+          close(fd);
+        }
+      }
+    }
+    return false;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  // Attach even if the magic is wrong, so the fds get closed
+  bool attached = shm.attach(fds[0], fds[1], fds[2]);
+
+  return attached && (0 == memcmp(magic, SERIAL9_SHM_MAGIC, sizeof(magic)));
+}
+
+// Copy between the rings and the tty (or back to the host) until the
+// host closes the socket
+//
+static void bridge(int client, Serial9Shm &shm, int tty)
+{
+  uint8_t out[SERIAL9_BRIDGE_CHUNK];
+  size_t out_length = 0;
+  size_t out_pos = 0;
+  uint8_t in[SERIAL9_BRIDGE_CHUNK];
+
+  for (;;) {
+    bool busy = false;
+
+    // Host to bus - take the next chunk from the ring once the last one
+    // has gone
+    if (out_pos == out_length) {
+      out_length = shm.rx.read(out, sizeof(out));
+      out_pos = 0;
+      if ((out_length > 0) && shm.rx.take_writer_waiting()) {
+        shm.wake_peer();
+      }
+    }
+
+    if (out_pos < out_length) {
+      ssize_t n;
+      if (tty < 0) {
+        n = shm.tx.write(out + out_pos, out_length - out_pos);
+        if ((n > 0) && shm.tx.take_reader_waiting()) {
+          shm.wake_peer();
+        }
+      } else {
+        n = write(tty, out + out_pos, out_length - out_pos);
+      }
+      if (n > 0) {
+        out_pos += n;
+        busy = true;
+      }
+    }
+
+    // Bus to host - only read what the ring has room for
+    if ((tty >= 0) && (shm.tx.room() > 0)) {
+      size_t room = shm.tx.room();
+      ssize_t n = read(tty, in, (room < sizeof(in)) ? room : sizeof(in));
+      if (n > 0) {
+        shm.tx.write(in, n);
+        if (shm.tx.take_reader_waiting()) {
+          shm.wake_peer();
+        }
+        busy = true;
+      }
+    }
+
+    // The host has written nonsense into the head or tail of a ring
+    if (shm.rx.corrupt() || shm.tx.corrupt()) {
+      fprintf(stderr, "serial9_bridge: shared memory ring is corrupt\n");
+      return;
+    }
+
+    if (busy) {
+      continue;
+    }
+
+    // Nothing moved - say what we are waiting for, check once more and
+    // go to sleep
+    struct pollfd fds[3];
+    nfds_t count = 0;
+
+    fds[count++] = { client, POLLIN, 0 };
+    fds[count++] = { shm.wake_fd(), POLLIN, 0 };
+
+    if (out_pos == out_length) {
+      shm.rx.set_reader_waiting();
+      if (shm.rx.used() > 0) {
+        continue;
+      }
+    } else if (tty < 0) {
+      shm.tx.set_writer_waiting();
+      if (shm.tx.room() > 0) {
+        continue;
+      }
+    }
+
+    if (tty >= 0) {
+      short events = (out_pos < out_length) ? POLLOUT : 0;
+      if (shm.tx.room() > 0) {
+        events |= POLLIN;
+      } else {
+        shm.tx.set_writer_waiting();
+      }
+      fds[count++] = { tty, events, 0 };
+    }
+
+    poll(fds, count, SERIAL9_BRIDGE_POLL_MS);
+    shm.clear_wake();
+
+    if (fds[0].revents) {
+      char c;
+      if (recv(client, &c, 1, MSG_DONTWAIT) <= 0) {
+        return;
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  if (3 != argc) {
+    fprintf(stderr, "Usage: %s socket_path (tty_device | --echo)\n", argv[0]);
+    return 2;
+  }
+
+  int tty = -1;
+  if (0 != strcmp(argv[2], "--echo")) {
+    tty = open_tty(argv[2]);
+    if (tty < 0) {
+      perror(argv[2]);
+      return 1;
+    }
+  }
+
+  int server = listen_socket(argv[1]);
+  if (server < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  for (;;) {
+    int client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      perror("accept");
+      return 1;
+    }
+
+    Serial9Shm shm;
+
+    if (receive_rings(client, shm)) {
+      bridge(client, shm, tty);
+    } else {
+      fprintf(stderr, "serial9_bridge: not a serial9 shared memory ring\n");
+    }
+
+    shm.detach();
+    close(client);
+  }
+}
@@ -0,0 +1,107 @@
+/* ---------------------------------------------------------------------------
+  serial9_shm.cpp - the bridge side of the shared memory rings
+
+  See serial9_shm.h
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "serial9_shm.h"
+
+#define SERIAL9_SHM_DATA (sizeof(serial9_shm_header) + 2 * sizeof(serial9_shm_control))
+
+Serial9Shm::Serial9Shm()
+{
+  _base = MAP_FAILED;
+  _length = 0;
+  _memfd = -1;
+  _wake_fd = -1;
+  _peer_fd = -1;
+}
+
+Serial9Shm::~Serial9Shm()
+{
+  detach();
+}
+
+bool Serial9Shm::attach(int memfd, int wake_fd, int peer_fd)
+{
+  struct stat st;
+
+  _memfd = memfd;
+  _wake_fd = wake_fd;
+  _peer_fd = peer_fd;
+
+  if ((fstat(memfd, &st) < 0) || ((size_t)st.st_size < SERIAL9_SHM_DATA)) {
+    return false;
+  }
+
+  // A memfd the host could still shrink would kill us with SIGBUS on the
+  // next access past the new end
+
+  int seals = fcntl(memfd, F_GET_SEALS);
+  if ((seals < 0) || !(seals & F_SEAL_SHRINK)) {
+    return false;
+  }
+
+  _length = st.st_size;
+  _base = mmap(NULL, _length, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (MAP_FAILED == _base) {
+    return false;
+  }
+
+  serial9_shm_header *header = (serial9_shm_header *)_base;
+  uint32_t size = header->size;
+
+  if ((0 != memcmp(header->magic, SERIAL9_SHM_MAGIC, sizeof(header->magic)))
+   || (SERIAL9_SHM_VERSION != header->version)
+   || (0 == size) || (0 != (size & (size - 1)))
+   || (_length < SERIAL9_SHM_DATA + 2 * (size_t)size)) {
+    return false;
+  }
+
+  serial9_shm_control *control = (serial9_shm_control *)(header + 1);
+  uint8_t *data = (uint8_t *)_base + SERIAL9_SHM_DATA;
+
+  rx.attach(&control[0], data, size);
+  tx.attach(&control[1], data + size, size);
+
+  return true;
+}
+
+void Serial9Shm::detach(void)
+{
+  if (MAP_FAILED != _base) {
+    munmap(_base, _length);
+    _base = MAP_FAILED;
+  }
+
+  int *fds[] = { &_memfd, &_wake_fd, &_peer_fd };
+
+  for (int *fd : fds) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+}
+
+void Serial9Shm::wake_peer(void)
+{
+  eventfd_write(_peer_fd, 1);
+}
+
+void Serial9Shm::clear_wake(void)
+{
+  eventfd_t value;
+
+  // The eventfd is non blocking, so this fails harmlessly if nobody
+  // has woken us
+  eventfd_read(_wake_fd, &value);
+}
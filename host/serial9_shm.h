@@ -0,0 +1,205 @@
+/* ---------------------------------------------------------------------------
+  serial9_shm.h - the bridge side of the shared memory rings
+
+  The host creates a memfd holding two single producer, single consumer
+  byte rings and two eventfds, and passes all three over a Unix socket.
+  The layout is described in python/serial9/shm.py, which is the host
+  side - the two have to agree exactly.
+
+  Each ring has one producer and one consumer, so the only shared state
+  is the head (written by the producer) and the tail (written by the
+  consumer). Before going to sleep a side sets the waiting flag in the
+  ring it is blocked on, and then checks the ring once more - the other
+  side only writes the eventfd when it finds the flag set.
+
+  The head and tail are in memory the host can write, so they are not
+  trusted - a ring that holds more than its size is corrupt, nothing more
+  is copied in or out of it and the bridge drops the connection.
+
+  The memfd has to be sealed against shrinking, or the host could cut it
+  short under the mapping.
+*/
+
+#ifndef SERIAL9_SHM_H
+#define SERIAL9_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+#define SERIAL9_SHM_MAGIC "S9SHRING"
+#define SERIAL9_SHM_VERSION (1)
+
+struct serial9_shm_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;
+  uint8_t reserved[48];
+};
+
+struct serial9_shm_control {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) std::atomic<uint32_t> reader_waiting;
+  alignas(64) std::atomic<uint32_t> writer_waiting;
+};
+
+static_assert(sizeof(serial9_shm_header) == 64, "header must be 64 bytes");
+static_assert(sizeof(serial9_shm_control) == 256, "control block must be 256 bytes");
+
+class Serial9ShmRing
+{
+  public:
+    void attach(serial9_shm_control *control, uint8_t *data, uint32_t size)
+    {
+      _control = control;
+      _data = data;
+      _size = size;
+      _corrupt = false;
+    }
+
+    bool corrupt(void)
+    {
+      return _corrupt;
+    }
+
+    size_t used(void)
+    {
+      return _fill(_control->head.load(std::memory_order_acquire),
+                   _control->tail.load(std::memory_order_acquire));
+    }
+
+    size_t room(void)
+    {
+      return _corrupt ? 0 : _size - used();
+    }
+
+    // Producer side - copy as much as fits, return how much
+    //
+    size_t write(const uint8_t *d, size_t length)
+    {
+      uint64_t head = _control->head.load(std::memory_order_relaxed);
+      uint64_t tail = _control->tail.load(std::memory_order_acquire);
+      size_t n = _size - _fill(head, tail);
+
+      if (_corrupt) {
+        return 0;
+      }
+
+      if (length < n) {
+        n = length;
+      }
+
+      size_t start = head & (_size - 1);
+      size_t first = (n < _size - start) ? n : _size - start;
+      memcpy(_data + start, d, first);
+      memcpy(_data, d + first, n - first);
+
+      _control->head.store(head + n, std::memory_order_release);
+      return n;
+    }
+
+    // Consumer side - copy out up to length bytes, return how many
+    //
+    size_t read(uint8_t *d, size_t length)
+    {
+      uint64_t tail = _control->tail.load(std::memory_order_relaxed);
+      uint64_t head = _control->head.load(std::memory_order_acquire);
+      size_t n = _fill(head, tail);
+
+      if (_corrupt) {
+        return 0;
+      }
+
+      if (length < n) {
+        n = length;
+      }
+
+      size_t start = tail & (_size - 1);
+      size_t first = (n < _size - start) ? n : _size - start;
+      memcpy(d, _data + start, first);
+      memcpy(d + first, _data, n - first);
+
+      _control->tail.store(tail + n, std::memory_order_release);
+      return n;
+    }
+
+    // Set a waiting flag, then look at the ring again - the fence keeps
+    // the flag from being set after the other side has looked at it
+    //
+    void set_reader_waiting(void)
+    {
+      _control->reader_waiting.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void set_writer_waiting(void)
+    {
+      _control->writer_waiting.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    // After a write - true if the reader is asleep and must be woken
+    //
+    bool take_reader_waiting(void)
+    {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return 0 != _control->reader_waiting.exchange(0, std::memory_order_relaxed);
+    }
+
+    // After a read - true if the writer is asleep and must be woken
+    //
+    bool take_writer_waiting(void)
+    {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return 0 != _control->writer_waiting.exchange(0, std::memory_order_relaxed);
+    }
+
+  private:
+    serial9_shm_control *_control;
+    uint8_t *_data;
+    uint32_t _size;
+    bool _corrupt;
+
+    // The number of bytes in the ring, 0 once it is found to be corrupt
+    //
+    size_t _fill(uint64_t head, uint64_t tail)
+    {
+      if ((head - tail) > _size) {
+        _corrupt = true;
+      }
+      return _corrupt ? 0 : (size_t)(head - tail);
+    }
+};
+
+class Serial9Shm
+{
+  public:
+    Serial9Shm();
+    ~Serial9Shm();
+
+    // Map the memfd and take over the eventfds, in the order the host
+    // sends them. Returns false if the memory is not a serial9 ring, or
+    // is not sealed against shrinking.
+    //
+    bool attach(int memfd, int wake_fd, int peer_fd);
+    void detach(void);
+
+    Serial9ShmRing rx;  // host to bridge
+    Serial9ShmRing tx;  // bridge to host
+
+    int wake_fd(void) { return _wake_fd; }
+
+    void wake_peer(void);
+    void clear_wake(void);
+
+  private:
+    void *_base;
+    size_t _length;
+    int _memfd;
+    int _wake_fd;
+    int _peer_fd;
+};
+
+#endif // SERIAL9_SHM_H
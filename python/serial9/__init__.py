@@ -0,0 +1 @@
+from .serial9 import Serial9
@@ -0,0 +1,88 @@
+# -----------------------------------------------------------------------------
+"""Measures what it costs the host to send a frame
+
+Each way of sending the same frames goes to a ``conn`` device that only
+counts its ``tx()`` calls - with a real adapter each one is a ``write()``
+system call and at least one USB transfer. The result is the number of
+calls and the host time per frame.
+
+A typical MDB style frame is an address with bit 9 high and a few data
+bytes, sent as:
+
+- ``tx9`` + ``tx8``: the address and the data in two calls
+- ``tx_words``: the whole frame in one call
+- ``tx_words`` with write combining: many frames per call
+
+.. autofunction:: serial9.benchmark.run
+"""
+# -----------------------------------------------------------------------------
+
+import sys
+import time
+
+from .serial9 import Serial9
+
+# -----------------------------------------------------------------------------
+class CountingConn():
+    '''A ``conn`` device that counts ``tx()`` calls and throws the data away'''
+
+    def __init__(self):
+        self.tx_calls = 0
+        self.tx_bytes = 0
+
+    def tx(self, d):
+        self.tx_calls += 1
+        self.tx_bytes += len(d)
+
+    def rx(self):
+        return b""
+
+def _tx9_tx8(s9, frames):
+    for address, data in frames:
+        s9.tx9(address)
+        s9.tx8(data)
+
+def _tx_words(s9, frames):
+    for address, data in frames:
+        s9.tx_words([address[0] | 0x100] + list(data))
+
+def _tx_words_combined(s9, frames):
+    s9.write_combining(deadline=1.0)
+    _tx_words(s9, frames)
+    s9.flush()
+    s9.write_combining(None)
+
+METHODS = [
+    ("tx9 + tx8", _tx9_tx8),
+    ("tx_words", _tx_words),
+    ("tx_words combined", _tx_words_combined),
+]
+
+# -----------------------------------------------------------------------------
+def run(count=10000, length=8):
+    '''Send ``count`` frames of an address and ``length - 1`` data bytes each way
+
+    Returns:
+        [ (name, calls per frame, usec per frame), ... ]
+    '''
+
+    frames = [(bytes([0x30 + (i & 0x07)]), bytes((i + j) & 0xff for j in range(length - 1)))
+              for i in range(count)]
+
+    results = []
+    for name, method in METHODS:
+        conn = CountingConn()
+        s9 = Serial9(conn)
+        start = time.perf_counter()
+        method(s9, frames)
+        elapsed = time.perf_counter() - start
+        results.append((name, conn.tx_calls / count, elapsed * 1e6 / count))
+
+    return results
+
+# -----------------------------------------------------------------------------
+if __name__ == "__main__": # pragma no cover
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 10000
+    print(f"{'method':<20} {'tx/frame':>9} {'usec/frame':>11}")
+    for name, calls, usec in run(count):
+        print(f"{name:<20} {calls:>9.4f} {usec:>11.2f}")
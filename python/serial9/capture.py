@@ -0,0 +1,350 @@
+# -----------------------------------------------------------------------------
+"""Compact, memory mapped capture files for 9 bit bus traffic
+
+Recording a busy bus for hours as Python lists is not practical, so the
+capture writer appends every ``(timestamp, word)`` pair straight into a
+memory mapped file that grows a few chunks at a time.
+
+File Layout
+===========
+
+All values are little endian.
+
+- A 64 byte file header: magic, version, records per chunk and chunk count
+- Any number of fixed size chunks, each made up of:
+
+  - A 64 byte chunk header: first and last timestamp, record count and a
+    256 bit map of the 9 bit addresses (words with bit 9 high) in the chunk
+  - ``records per chunk`` records of 6 bytes: the timestamp as an offset in
+    microseconds from the first timestamp in the chunk, and the 9 bit word
+
+Because every chunk is the same size, the chunk headers are the index. The
+reader finds a point in time with a binary search over the chunk headers,
+and skips any chunk whose address map does not have the address it is
+looking for - neither needs to scan the whole file.
+
+.. autoclass:: serial9.capture.CaptureWriter
+    :members:
+.. autoclass:: serial9.capture.CaptureReader
+    :members:
+.. autofunction:: serial9.capture.capture
+"""
+# -----------------------------------------------------------------------------
+
+import mmap
+import time
+import bisect
+import struct
+import logging
+
+CAPTURE_MAGIC = b"S9CAPTUR"
+CAPTURE_VERSION = 1
+
+# magic, version, records per chunk, chunk count
+FILE_HEADER = struct.Struct("<8sHII")
+FILE_HEADER_SIZE = 64
+
+# first timestamp, last timestamp, record count, address map
+CHUNK_HEADER = struct.Struct("<QQI32s")
+CHUNK_HEADER_SIZE = 64
+
+# timestamp offset from the first timestamp in the chunk, word
+RECORD = struct.Struct("<IH")
+
+# The offset in a record is only 32 bits, a chunk never spans more than this
+CHUNK_MAX_SPAN = 0xffffffff
+
+# -----------------------------------------------------------------------------
+class CaptureWriter():
+    '''Append ``(timestamp, word)`` pairs to a capture file
+
+    Parameters:
+        path (str): Name of the capture file, it is overwritten
+        chunk_records (int): Number of records in each chunk
+        grow_chunks (int): Number of chunks to add when the file is full
+    '''
+
+    def __init__(self, path, chunk_records=4096, grow_chunks=16):
+
+        self.logger = logging.getLogger(__name__)
+        self._chunk_records = chunk_records
+        self._chunk_size = CHUNK_HEADER_SIZE + chunk_records * RECORD.size
+        self._grow_chunks = grow_chunks
+
+        self._file = open(path, "w+b")
+        self._capacity = 0
+        self._mm = None
+        self._grow()
+
+        self._chunk_count = 0
+        self._chunk = -1
+        self._count = 0
+        self._first = 0
+        self._last = 0
+        self._addresses = bytearray(32)
+
+        self._write_file_header()
+
+    def _grow(self):
+        if self._mm is not None:
+            self._mm.close()
+        self._capacity += self._grow_chunks
+        self._file.truncate(FILE_HEADER_SIZE + self._capacity * self._chunk_size)
+        self._mm = mmap.mmap(self._file.fileno(), 0)
+
+    def _write_file_header(self):
+        FILE_HEADER.pack_into(self._mm, 0, CAPTURE_MAGIC, CAPTURE_VERSION,
+                              self._chunk_records, self._chunk_count)
+
+    def _chunk_offset(self, chunk):
+        return FILE_HEADER_SIZE + chunk * self._chunk_size
+
+    def _new_chunk(self, timestamp):
+        self._chunk += 1
+        self._chunk_count += 1
+        if self._chunk_count > self._capacity:
+            self._grow()
+        self._count = 0
+        self._first = timestamp
+        self._addresses = bytearray(32)
+        self._write_file_header()
+
+    def append(self, timestamp, word):
+        '''Append a single word to the capture
+
+        Parameters:
+            timestamp (int): Time the word was received in microseconds,
+                             must not go backwards
+            word (int): The 9 bit word
+        '''
+
+        if ((self._chunk < 0) or (self._count == self._chunk_records)
+                or (timestamp - self._first > CHUNK_MAX_SPAN)):
+            self._new_chunk(timestamp)
+
+        offset = self._chunk_offset(self._chunk)
+        RECORD.pack_into(self._mm, offset + CHUNK_HEADER_SIZE + self._count * RECORD.size,
+                         timestamp - self._first, word)
+        self._count += 1
+        self._last = timestamp
+
+        if word & 0x100:
+            self._addresses[(word >> 3) & 0x1f] |= 1 << (word & 0x07)
+
+        CHUNK_HEADER.pack_into(self._mm, offset, self._first, self._last,
+                               self._count, bytes(self._addresses))
+
+    def append_many(self, pairs):
+        '''Append a list of ``(timestamp, word)`` pairs, as returned by
+        :meth:`serial9.Serial9.rx_timed`
+
+        Pairs without a timestamp are given the most recent one.
+        '''
+
+        for timestamp, word in pairs:
+            if timestamp is None:
+                timestamp = self._last
+            self.append(timestamp, word)
+
+    def flush(self):
+        '''Make sure everything written so far is on disk'''
+        self._mm.flush()
+
+    def close(self):
+        '''Trim the unused chunks off the end of the file and close it'''
+        if self._mm is None:
+            return
+        self._mm.flush()
+        self._mm.close()
+        self._mm = None
+        self._file.truncate(self._chunk_offset(self._chunk_count))
+        self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+# -----------------------------------------------------------------------------
+class CaptureReader():
+    '''Random access to a capture file written by :class:`CaptureWriter`
+
+    Records are addressed by their index in the capture, counting through
+    the chunks in order. A chunk is closed early if the bus is quiet for
+    more than 71 minutes, so the index of the first record in each chunk is
+    taken from the record counts in the chunk headers before it.
+
+    The file may still be growing, call :meth:`refresh` to pick up
+    chunks added since the reader was opened.
+    '''
+
+    def __init__(self, path):
+
+        self._file = open(path, "rb")
+        self._mm = None
+        self.refresh()
+
+    def refresh(self):
+        '''Re-map the file and re-read the file header'''
+        if self._mm is not None:
+            self._mm.close()
+        self._mm = mmap.mmap(self._file.fileno(), 0, access=mmap.ACCESS_READ)
+
+        magic, version, self._chunk_records, self._chunk_count = FILE_HEADER.unpack_from(self._mm, 0)
+        if (CAPTURE_MAGIC != magic) or (CAPTURE_VERSION != version):
+            raise ValueError("Not a serial9 capture file")
+
+        self._chunk_size = CHUNK_HEADER_SIZE + self._chunk_records * RECORD.size
+
+        # Index of the first record in each chunk - only the last chunk can
+        # still be filling up, so its count is read when it is needed
+        self._starts = []
+        start = 0
+        for chunk in range(self._chunk_count):
+            self._starts.append(start)
+            start += self._chunk_header(chunk)[2]
+
+    def close(self):
+        self._mm.close()
+        self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __len__(self):
+        if 0 == self._chunk_count:
+            return 0
+        return self._starts[-1] + self._chunk_header(self._chunk_count - 1)[2]
+
+    def _locate(self, index):
+        # The chunk a record index is in, and the position in that chunk
+        chunk = max(0, bisect.bisect_right(self._starts, index) - 1)
+        return chunk, index - self._starts[chunk]
+
+    def _chunk_offset(self, chunk):
+        return FILE_HEADER_SIZE + chunk * self._chunk_size
+
+    def _chunk_header(self, chunk):
+        return CHUNK_HEADER.unpack_from(self._mm, self._chunk_offset(chunk))
+
+    def _record(self, chunk, first, i):
+        offset, word = RECORD.unpack_from(self._mm, self._chunk_offset(chunk)
+                                          + CHUNK_HEADER_SIZE + i * RECORD.size)
+        return first + offset, word
+
+    def records(self, start=0, stop=None):
+        '''Iterate over ``(timestamp, word)`` from record index ``start`` up to
+        but not including ``stop``
+        '''
+
+        if stop is None or stop > len(self):
+            stop = len(self)
+
+        if start >= stop:
+            return
+
+        chunk, i = self._locate(start)
+        while (chunk < self._chunk_count) and (self._starts[chunk] < stop):
+            first, last, count, addresses = self._chunk_header(chunk)
+            for i in range(i, count):
+                if self._starts[chunk] + i >= stop:
+                    return
+                yield self._record(chunk, first, i)
+            chunk += 1
+            i = 0
+
+    def seek_time(self, timestamp):
+        '''Return the index of the first record at or after ``timestamp``
+
+        Returns ``len(self)`` if every record is older than ``timestamp``.
+        '''
+
+        # Binary search the chunk headers for the first chunk that ends
+        # at or after the timestamp ...
+        lo, hi = 0, self._chunk_count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._chunk_header(mid)[1] < timestamp:
+                lo = mid + 1
+            else:
+                hi = mid
+
+        if lo == self._chunk_count:
+            return len(self)
+
+        # ... and then the records in that chunk
+        first, last, count, addresses = self._chunk_header(lo)
+        l, h = 0, count
+        while l < h:
+            mid = (l + h) // 2
+            if self._record(lo, first, mid)[0] < timestamp:
+                l = mid + 1
+            else:
+                h = mid
+
+        return self._starts[lo] + l
+
+    def between(self, start, stop):
+        '''Iterate over ``(timestamp, word)`` with ``start <= timestamp < stop``'''
+
+        return self.records(self.seek_time(start), self.seek_time(stop))
+
+    def find_address(self, address, start=None, stop=None):
+        '''Iterate over ``(index, timestamp)`` of every 9 bit address word
+
+        Parameters:
+            address (int): The address, with or without bit 9 set
+            start (int): Optional earliest timestamp
+            stop (int): Optional timestamp to stop before
+        '''
+
+        address &= 0xff
+        byte, mask = address >> 3, 1 << (address & 0x07)
+        word = address | 0x100
+
+        first_chunk = 0 if start is None else self._locate(self.seek_time(start))[0]
+
+        for chunk in range(first_chunk, self._chunk_count):
+            first, last, count, addresses = self._chunk_header(chunk)
+
+            if (stop is not None) and (first >= stop):
+                break
+            if (start is not None) and (last < start):
+                continue
+            if not (addresses[byte] & mask):
+                continue
+
+            for i in range(count):
+                timestamp, w = self._record(chunk, first, i)
+                if (w == word and ((start is None) or (timestamp >= start))
+                        and ((stop is None) or (timestamp < stop))):
+                    yield self._starts[chunk] + i, timestamp
+
+# -----------------------------------------------------------------------------
+def capture(s9, path, duration=None, poll=0.001): # pragma no cover
+    '''Put the target in sniff mode and record everything on the bus
+
+    Parameters:
+        s9 (Serial9): An instance connected to the target
+        path (str): Name of the capture file
+        duration (float): Seconds to capture for, or forever if ``None``
+        poll (float): Seconds to sleep when there is nothing to read
+    '''
+
+    end = None if duration is None else time.monotonic() + duration
+
+    s9.sniff_start()
+    try:
+        with CaptureWriter(path) as writer:
+            while (end is None) or (time.monotonic() < end):
+                pairs = s9.rx_timed()
+                if pairs:
+                    writer.append_many(pairs)
+                else:
+                    time.sleep(poll)
+    finally:
+        s9.sniff_stop()
@@ -0,0 +1,130 @@
+# -----------------------------------------------------------------------------
+"""Latency and throughput metrics for ``Serial9``
+
+Slow transactions can come from the encoding on the host, the USB link, the
+firmware or the slave on the bus. Hand a :class:`Metrics` instance to
+``Serial9`` and it records:
+
+- ``encode_ns_per_byte``: host time to escape the data sent, per escaped byte
+- ``decode_ns_per_byte``: host time to decode each byte received
+- ``tx_bytes``: bytes per ``conn.tx()`` call
+- ``rx_bytes``: bytes per ``conn.rx()`` call, including empty polls
+- ``reply_latency_seconds``: time from the end of the echo of a frame that
+  starts with a 9 bit address to the first word of the reply, per address
+
+On a half duplex bus every word sent comes back first, so the words of the
+echo are counted off before the reply starts - the latency is how long the
+slave took to answer, plus the USB polling. In full duplex mode there is no
+echo, and the latency is measured from the ``tx9()`` or ``tx_words()`` call,
+so any time spent in the credit backlog or the write combining buffer is
+included.
+
+Every histogram has fixed buckets, so recording a value is a short binary
+search and two additions. Without a ``Metrics`` instance ``Serial9`` does
+not even read the clock.
+
+Read the results with :meth:`Metrics.snapshot` or export them with
+:meth:`Metrics.prometheus`.
+
+.. autoclass:: serial9.metrics.Metrics
+    :members:
+.. autoclass:: serial9.metrics.Histogram
+    :members:
+"""
+# -----------------------------------------------------------------------------
+
+import bisect
+
+# Upper bounds of the default buckets for each kind of value
+NS_BUCKETS = (50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000)
+BYTE_BUCKETS = (0, 1, 4, 16, 64, 256, 1024, 4096, 16384)
+SECONDS_BUCKETS = (0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0)
+
+# -----------------------------------------------------------------------------
+class Histogram():
+    '''Counts values into buckets with fixed upper bounds
+
+    Parameters:
+        bounds: Increasing upper bounds of the buckets, values above the
+                last one go into an overflow bucket
+    '''
+
+    def __init__(self, bounds):
+        self.bounds = tuple(bounds)
+        self.counts = [0] * (len(self.bounds) + 1)
+        self.count = 0
+        self.sum = 0
+
+    def observe(self, value):
+        self.counts[bisect.bisect_left(self.bounds, value)] += 1
+        self.count += 1
+        self.sum += value
+
+    def snapshot(self):
+        '''Return the histogram as a dict with cumulative bucket counts'''
+        cumulative = []
+        total = 0
+        for bound, n in zip(self.bounds + (float("inf"),), self.counts):
+            total += n
+            cumulative.append((bound, total))
+        return {"count": self.count, "sum": self.sum, "buckets": cumulative}
+
+    def _prometheus(self, name, labels=""):
+        lines = []
+        for bound, total in self.snapshot()["buckets"]:
+            le = "+Inf" if bound == float("inf") else f"{bound:g}"
+            lines.append(f'{name}_bucket{{{labels}le="{le}"}} {total}')
+        braces = f"{{{labels[:-1]}}}" if labels else ""
+        lines.append(f"{name}_sum{braces} {self.sum:g}")
+        lines.append(f"{name}_count{braces} {self.count}")
+        return lines
+
+# -----------------------------------------------------------------------------
+class Metrics():
+    '''The metrics for one or more ``Serial9`` instances
+
+    One instance can be shared by several ``Serial9`` instances, for example
+    all the channels of a :class:`serial9.mux.Mux`.
+    '''
+
+    def __init__(self):
+        self.encode_ns_per_byte = Histogram(NS_BUCKETS)
+        self.decode_ns_per_byte = Histogram(NS_BUCKETS)
+        self.tx_bytes = Histogram(BYTE_BUCKETS)
+        self.rx_bytes = Histogram(BYTE_BUCKETS)
+        self.reply_latency_seconds = {}
+
+    def observe_latency(self, address, seconds):
+        histogram = self.reply_latency_seconds.get(address)
+        if histogram is None:
+            histogram = Histogram(SECONDS_BUCKETS)
+            self.reply_latency_seconds[address] = histogram
+        histogram.observe(seconds)
+
+    def snapshot(self):
+        '''Return all the metrics as a dict of :meth:`Histogram.snapshot`
+        results, the latencies are a dict indexed by address
+        '''
+        return {
+            "encode_ns_per_byte": self.encode_ns_per_byte.snapshot(),
+            "decode_ns_per_byte": self.decode_ns_per_byte.snapshot(),
+            "tx_bytes": self.tx_bytes.snapshot(),
+            "rx_bytes": self.rx_bytes.snapshot(),
+            "reply_latency_seconds": {address: h.snapshot()
+                                      for address, h in sorted(self.reply_latency_seconds.items())},
+        }
+
+    def prometheus(self, prefix="serial9"):
+        '''Return all the metrics in the Prometheus text exposition format'''
+
+        lines = []
+        for name in ("encode_ns_per_byte", "decode_ns_per_byte", "tx_bytes", "rx_bytes"):
+            lines.append(f"# TYPE {prefix}_{name} histogram")
+            lines.extend(getattr(self, name)._prometheus(f"{prefix}_{name}"))
+
+        lines.append(f"# TYPE {prefix}_reply_latency_seconds histogram")
+        for address, h in sorted(self.reply_latency_seconds.items()):
+            lines.extend(h._prometheus(f"{prefix}_reply_latency_seconds",
+                                       f'address="0x{address:02x}",'))
+
+        return "\n".join(lines) + "\n"
@@ -0,0 +1,128 @@
+# -----------------------------------------------------------------------------
+"""Several buses on one ``Serial9`` adapter
+
+Firmware built with more than one channel (an ATmega2560 has three buses)
+shares the one USB link between them. ESCAPE 0x6n in either direction says
+that the data after it belongs to channel n.
+
+The :class:`Mux` takes the ``conn`` device for the adapter, and hands out a
+``conn`` device for each channel. Give each of those to its own ``Serial9``
+instance, and everything else - escapes, records, frame checks, credits -
+works per channel exactly as it does with a single bus::
+
+    mux = Mux(SerialConn())
+    bus0 = Serial9(mux.channel(0))
+    bus1 = Serial9(mux.channel(1))
+
+Opening the port does not reset the firmware, so it may still have the
+channels selected by the last host. The first data sent always starts with
+a channel select, and the firmware answers every channel select with its
+own, so data received after that is sorted correctly.
+
+.. autoclass:: serial9.mux.Mux
+    :members:
+"""
+# -----------------------------------------------------------------------------
+
+import logging
+
+from .serial9 import Serial9, _Scanner
+
+SERIAL9_CHANNEL = 0x60
+
+# -----------------------------------------------------------------------------
+class MuxChannel():
+    '''The ``conn`` device for one channel of a :class:`Mux`'''
+
+    def __init__(self, mux, ch):
+        self._mux = mux
+        self._ch = ch
+
+    def tx(self, d):
+        self._mux._tx(self._ch, d)
+
+    def rx(self):
+        return self._mux._rx(self._ch)
+
+# -----------------------------------------------------------------------------
+class Mux():
+    '''Split the ``conn`` device of a multi channel adapter into channels
+
+    Parameters:
+        conn: The ``conn`` device for the adapter
+        channels (int): Number of channels the firmware was built with,
+                        at most 3
+    '''
+
+    def __init__(self, conn, channels=3):
+
+        self.logger = logging.getLogger(__name__)
+        self._conn = conn
+        self._channels = [MuxChannel(self, ch) for ch in range(channels)]
+
+        # The firmware may be on any channel, so the first data sent
+        # selects one. Received data is taken to be for channel 0 until the
+        # firmware answers with its channel select.
+        self._tx_ch = None
+        self._rx_ch = 0
+
+        # Bytes sent by the host that do not end on a sequence boundary
+        # yet, and the escape state of each channel
+        self._tx_held = [b""] * channels
+        self._tx_scan = [_Scanner(Serial9.SERIAL9_PARAM_LENGTH) for ch in range(channels)]
+
+        # Bytes received for each channel that have not been read yet
+        self._rx_buffers = [bytearray() for ch in range(channels)]
+        self._rx_escape = False
+        self._rx_remaining = 0
+
+    def channel(self, ch):
+        '''Return the ``conn`` device for channel ``ch``'''
+        return self._channels[ch]
+
+    def _tx(self, ch, d):
+        boundary = self._tx_scan[ch].scan(d)
+        if 0 == boundary:
+            self._tx_held[ch] += d
+            return
+
+        d, self._tx_held[ch] = self._tx_held[ch] + d[:boundary], d[boundary:]
+
+        if ch != self._tx_ch:
+            self._tx_ch = ch
+            d = bytes([Serial9.SERIAL9_ESCAPE, SERIAL9_CHANNEL | ch]) + d
+        self._conn.tx(d)
+
+    def poll(self):
+        '''Read everything waiting from the adapter and sort it by channel
+
+        Each channel's ``rx()`` does this too, so calling it is only needed
+        to keep the USB link drained while no channel is being read.
+        '''
+
+        for c in self._conn.rx():
+            if self._rx_remaining > 0:
+                self._rx_remaining -= 1
+                self._rx_buffers[self._rx_ch].append(c)
+
+            elif self._rx_escape:
+                self._rx_escape = False
+                if SERIAL9_CHANNEL == (c & 0xf0):
+                    self._rx_ch = c & 0x0f
+                else:
+                    self._rx_buffers[self._rx_ch] += bytes([Serial9.SERIAL9_ESCAPE, c])
+                    self._rx_remaining = Serial9.SERIAL9_RECORD_LENGTH.get(c, 0)
+                    if Serial9.SERIAL9_HIGH == c:
+                        self._rx_remaining = 1
+
+            elif Serial9.SERIAL9_ESCAPE == c:
+                self._rx_escape = True
+
+            else:
+                self._rx_buffers[self._rx_ch].append(c)
+
+    def _rx(self, ch):
+        self.poll()
+        d = bytes(self._rx_buffers[ch])
+        self._rx_buffers[ch].clear()
+        return d
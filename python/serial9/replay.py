@@ -0,0 +1,198 @@
+# -----------------------------------------------------------------------------
+"""Replays captured bus traffic with the original timing, or faster
+
+This is used for load testing - replay a capture against a device under test
+at 1x, 2x, 5x or 10x the original speed and see where the slave, or the
+adapter, stops keeping up.
+
+The capture is split into frames, each starting at a word with bit 9 high,
+and every frame is scheduled at its original time divided by the speed.
+All the frames are encoded before the replay starts, and frames that are
+due within ``window`` seconds of each other go out in a single USB write.
+
+The drift between the scheduled and actual time of every write is recorded
+in the :class:`ReplayReport`. If the drift keeps growing, the target is not
+keeping up at that speed.
+
+.. autofunction:: serial9.replay.frames
+.. autoclass:: serial9.replay.Replay
+    :members:
+.. autoclass:: serial9.replay.ReplayReport
+    :members:
+"""
+# -----------------------------------------------------------------------------
+
+import sys
+import time
+import logging
+
+from .serial9 import Serial9, SerialConn
+from .capture import CaptureReader
+
+# -----------------------------------------------------------------------------
+def frames(pairs, gap=None):
+    '''Split ``(timestamp, word)`` pairs into ``(timestamp, [ word, ... ])`` frames
+
+    A new frame starts at every word with bit 9 high, and optionally after
+    the bus has been quiet for ``gap`` microseconds.
+
+    Parameters:
+        pairs: Iterable of ``(timestamp, word)``, for example from
+               :meth:`serial9.capture.CaptureReader.records`
+        gap (int): Optional quiet time in microseconds that ends a frame
+    '''
+
+    result = []
+    words = None
+    last = None
+
+    for timestamp, word in pairs:
+        if ((words is None) or (word & 0x100)
+                or ((gap is not None) and (timestamp - last > gap))):
+            words = []
+            result.append((timestamp, words))
+        words.append(word)
+        last = timestamp
+
+    return result
+
+# -----------------------------------------------------------------------------
+class ReplayReport():
+    '''Timing results of a replay, all times are in seconds
+
+    Attributes:
+        speed (float): The replay speed factor
+        frames (int): Number of frames sent
+        writes (int): Number of USB writes
+        bytes (int): Number of escaped bytes written
+        duration (float): Time from the first to the end of the last write
+        drift ([ float, ... ]): Actual minus scheduled time of each write
+    '''
+
+    def __init__(self, speed):
+        self.speed = speed
+        self.frames = 0
+        self.writes = 0
+        self.bytes = 0
+        self.duration = 0.0
+        self.drift = []
+
+    @property
+    def max_drift(self):
+        return max(self.drift, default=0.0)
+
+    @property
+    def mean_drift(self):
+        return sum(self.drift) / len(self.drift) if self.drift else 0.0
+
+    @property
+    def final_drift(self):
+        return self.drift[-1] if self.drift else 0.0
+
+    def __str__(self):
+        return (f"speed {self.speed:g}x: {self.frames} frames in {self.writes} writes, "
+                f"{self.bytes} bytes in {self.duration:.3f} s, drift "
+                f"mean {self.mean_drift * 1e3:.3f} ms "
+                f"max {self.max_drift * 1e3:.3f} ms "
+                f"final {self.final_drift * 1e3:.3f} ms")
+
+# -----------------------------------------------------------------------------
+class Replay():
+    '''Pre-encode a list of frames and replay them through a ``Serial9`` instance
+
+    Parameters:
+        s9 (Serial9): Instance connected to the device under test
+        frames: List of ``(timestamp, [ word, ... ])`` as returned by :func:`frames`,
+                timestamps are in microseconds
+        window (float): Frames due within this many seconds of the first frame
+                        in a batch are combined into one write
+        clock: Function returning the current time in seconds
+        sleep: Function that sleeps for a number of seconds
+        spin (float): Sleeping is not precise enough, so we busy wait for
+                      the last ``spin`` seconds before each write
+    '''
+
+    def __init__(self, s9, frames, window=0.002, clock=time.perf_counter, sleep=time.sleep,
+                 spin=0.001):
+
+        self.logger = logging.getLogger(__name__)
+        self._s9 = s9
+        self._clock = clock
+        self._sleep = sleep
+        self._spin = spin
+
+        # Each batch is (offset in microseconds from the first frame,
+        # number of frames, escaped data)
+        self._batches = []
+
+        if not frames:
+            return
+
+        start = frames[0][0]
+        window_us = window * 1e6
+        batch_offset = None
+        batch_frames = 0
+        batch_data = []
+
+        for timestamp, words in frames:
+            offset = timestamp - start
+            if (batch_offset is not None) and (offset - batch_offset > window_us):
+                self._batches.append((batch_offset, batch_frames, b"".join(batch_data)))
+                batch_offset = None
+            if batch_offset is None:
+                batch_offset = offset
+                batch_frames = 0
+                batch_data = []
+            batch_frames += 1
+            batch_data.append(Serial9.encode(words))
+
+        self._batches.append((batch_offset, batch_frames, b"".join(batch_data)))
+
+    def _wait_until(self, when):
+        while True:
+            remaining = when - self._clock()
+            if remaining <= 0:
+                return
+            if remaining > self._spin:
+                self._sleep(remaining - self._spin)
+
+    def run(self, speed=1.0):
+        '''Replay all the frames at ``speed`` times the original rate
+
+        Returns:
+            :class:`ReplayReport`
+        '''
+
+        report = ReplayReport(speed)
+        start = self._clock()
+
+        for offset, count, data in self._batches:
+            scheduled = start + offset / 1e6 / speed
+            self._wait_until(scheduled)
+            report.drift.append(self._clock() - scheduled)
+            self._s9.tx_encoded(data)
+            report.frames += count
+            report.writes += 1
+            report.bytes += len(data)
+
+        report.duration = self._clock() - start
+        return report
+
+# -----------------------------------------------------------------------------
+def replay(path, port=None, speeds=(1, 2, 5, 10), gap=None): # pragma no cover
+    '''Replay a capture file at each of the speeds and print the drift'''
+
+    with CaptureReader(path) as reader:
+        r = Replay(Serial9(SerialConn(port)), frames(reader.records(), gap))
+
+    for speed in speeds:
+        print(r.run(speed))
+
+# -----------------------------------------------------------------------------
+if __name__ == "__main__": # pragma no cover
+    if 2 == len(sys.argv):
+        replay(sys.argv[1])
+    elif 3 == len(sys.argv):
+        replay(sys.argv[1], sys.argv[2])
+    else:
+        print(f"Usage: {sys.argv[0]} capture_file [port]")
@@ -0,0 +1,74 @@
+# -----------------------------------------------------------------------------
+"""Sweeps the firmware self test over a range of baud rates
+
+When a bus segment misbehaves it is hard to tell whether the adapter, the
+cabling or the baud rate is to blame. Loop the bus back (or rely on the
+transceiver echo), run the self test at every baud rate, and compare the
+measured throughput and error counts against what the baud rate should
+manage.
+
+A 9 bit word on the wire is a start bit, 9 data bits and a stop bit, so the
+theoretical capacity is ``baud / 11`` words per second. The self test waits
+for each echo before sending the next word, so expect somewhat less.
+
+.. autofunction:: serial9.selftest.sweep
+.. autofunction:: serial9.selftest.capacity_table
+"""
+# -----------------------------------------------------------------------------
+
+import sys
+
+from .serial9 import Serial9, SerialConn
+
+BITS_PER_WORD = 11
+
+# -----------------------------------------------------------------------------
+def sweep(s9, bauds=None, count=1000, mix=0x80, timeout=10.0):
+    '''Run the self test at each baud rate
+
+    The target is left at the last baud rate in the sweep.
+
+    Parameters:
+        s9 (Serial9): An instance connected to the target
+        bauds ([ int, ... ]): Baud rates to test, defaults to all of them
+        count (int): Number of words to send at each baud rate
+        mix (int): On average ``mix`` out of every 256 words have bit 9 high
+        timeout (float): Seconds to wait for each result
+
+    Returns:
+        [ (baud, result), ... ] - result is the dict from
+        :meth:`serial9.Serial9.self_test`, or ``None`` if the test timed out
+    '''
+
+    if bauds is None:
+        bauds = sorted(Serial9.BAUD_CODES)
+
+    results = []
+    for baud in bauds:
+        s9.set_baud(Serial9.BAUD_CODES[baud])
+        results.append((baud, s9.self_test(count, mix, timeout)))
+
+    return results
+
+# -----------------------------------------------------------------------------
+def capacity_table(results):
+    '''Format the results of :func:`sweep` as a text table'''
+
+    lines = [f"{'baud':>8} {'words':>7} {'errors':>7} {'longest':>8} "
+             f"{'words/s':>9} {'max/s':>9} {'usage':>6}"]
+
+    for baud, r in results:
+        theoretical = baud / BITS_PER_WORD
+        if r is None:
+            lines.append(f"{baud:>8} {'timed out':>7}")
+        else:
+            lines.append(f"{baud:>8} {r['words']:>7} {r['errors']:>7} {r['longest_run']:>8} "
+                         f"{r['words_per_second']:>9.1f} {theoretical:>9.1f} "
+                         f"{100 * r['words_per_second'] / theoretical:>5.1f}%")
+
+    return "\n".join(lines)
+
+# -----------------------------------------------------------------------------
+if __name__ == "__main__": # pragma no cover
+    port = sys.argv[1] if 2 == len(sys.argv) else None
+    print(capacity_table(sweep(Serial9(SerialConn(port)))))
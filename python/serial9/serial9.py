@@ -49,6 +49,29 @@ Public API
 .. automethod:: serial9.Serial9.tx8
 .. automethod:: serial9.Serial9.tx9
 .. automethod:: serial9.Serial9.rx
+.. automethod:: serial9.Serial9.tx_words
+.. automethod:: serial9.Serial9.encode
+.. automethod:: serial9.Serial9.tx_encoded
+
+Each call normally turns into one ``conn.tx()``. With write combining on, the
+data is collected and sent in one go by :meth:`~serial9.Serial9.flush`, by
+the next read, or by the first call after the deadline - whichever is first.
+There is no timer behind the deadline: data held after the last write stays
+held until the application flushes or reads, so call
+:meth:`~serial9.Serial9.flush` after the last frame of a burst if nothing
+is read next.
+
+.. automethod:: serial9.Serial9.write_combining
+.. automethod:: serial9.Serial9.flush
+
+The ``SerialConn`` class is a ``conn`` device for the physical ``Serial9``
+adapter, using pyserial.
+
+.. autoclass:: serial9.SerialConn
+    :members:
+
+For a bridge process on the same host that owns the serial port, use the
+shared memory ``conn`` device in :mod:`serial9.shm`.
 
 Optional API
 ============
@@ -60,6 +83,138 @@ rate, instead fo just the default of 9600 .
 
 .. automethod:: serial9.Serial9.set_baud
 
+When the baud rate of the bus is not known, the firmware can find it. It
+listens with DE low, times the edges on the RX pin for a few frames and takes
+the shortest time between two edges that several others agree with as one bit,
+so a single noise spike does not count. A rate within 3% of one of the standard
+rates is taken to be that rate. Anything else is reported as not found and the
+baud rate is left alone. Only channel 0 can be timed, its RX pin doubles as an
+external interrupt.
+
+.. automethod:: serial9.Serial9.autobaud
+
+On a 4 wire RS-422 bus the driver and receiver have their own pairs. In full
+duplex mode the firmware keeps DE asserted and RE_ enabled, never switches
+direction, and sends and receives in the same pass of its loop. Collision
+detect has no echo to check there, so frames go out unchecked. Building the
+firmware with ``SERIAL9_FULL_DUPLEX`` set to 1 starts it in full duplex mode.
+
+.. automethod:: serial9.Serial9.full_duplex
+
+Bus Capture
+===========
+
+In sniff mode the ``Serial9`` firmware keeps DE low permanently, drops anything the
+host tries to send, and precedes every word received from the bus with a timestamp.
+Use :meth:`~serial9.Serial9.rx_timed` to get the words along with their timestamps,
+or hand the whole job to :func:`serial9.capture.capture`.
+
+.. automethod:: serial9.Serial9.sniff_start
+.. automethod:: serial9.Serial9.sniff_stop
+.. automethod:: serial9.Serial9.rx_timed
+
+Frame Checks
+============
+
+The ``Serial9`` firmware can append an MDB style additive checksum or a Modbus
+style CRC-16 to outgoing frames, and check incoming frames. An incoming frame ends
+when the bus has been quiet for 3.5 character times (at least 1750 usec), when
+the firmware starts to talk, or - for MDB, outside sniff mode - with the word that
+has the mode bit set. It is followed by a CHECK_RESULT record. The echo of the
+words the firmware sends is passed on as it is, and is not part of any frame.
+The host can ask the firmware to drop bad frames so that only good frames are
+ever delivered. The firmware holds up to 40 words of a frame, enough for the
+longest MDB frame. The start of a longer frame, which can only be Modbus, is
+passed on before its check is known, so check the CHECK_RESULT for those.
+
+.. automethod:: serial9.Serial9.set_check
+.. automethod:: serial9.Serial9.check_end
+.. automethod:: serial9.Serial9.deliver_good_only
+.. automethod:: serial9.Serial9.rx_frames
+
+Self Test
+=========
+
+The ``Serial9`` firmware can send a pseudo random pattern of 8 and 9 bit words
+at the current baud rate and check that every word comes back, either through a
+loopback plug or the echo of the RS-485 transceiver. Each word must be echoed
+before the next one is sent, and a word that does not come back within the frame
+gap counts as an error. Use :mod:`serial9.selftest` to sweep over baud rates.
+
+.. automethod:: serial9.Serial9.self_test
+
+Flow Control
+============
+
+The USB side is much faster than the bus. With credit flow control on, the
+``Serial9`` firmware queues whatever the host sends and tells the host how many
+bytes it has room for with CREDIT records. The host never sends more than that,
+so a large write turns into a backlog on the host that drains at the bus rate -
+the host is never blocked in a USB write and can look after other buses in the
+meantime.
+
+Credits are counted in bytes as they are sent over USB, escapes and commands
+included, so :meth:`~serial9.Serial9.encode` output can be sent as is.
+
+.. automethod:: serial9.Serial9.credit_on
+.. automethod:: serial9.Serial9.credit_off
+.. automethod:: serial9.Serial9.drain
+.. autoattribute:: serial9.Serial9.credit
+.. autoattribute:: serial9.Serial9.backlog
+
+Metrics
+=======
+
+Pass a :class:`serial9.metrics.Metrics` instance as ``metrics`` to record
+encode and decode times, bytes per USB call and reply latency per address.
+
+Collision Detect
+================
+
+On a bus with more than one master, two of them can start talking at the same
+time. With collision detect on, the ``Serial9`` firmware checks the echo of every
+word it sends and lets go of the bus on the first one that does not match -
+instead of the host finding out from a reply timeout. The frame is sent again
+after a random backoff of 1 to 16 frame gaps, counted from the last word seen
+on the bus. The host ends every frame with :meth:`~serial9.Serial9.frame_end`
+so the firmware knows what to send again.
+
+.. automethod:: serial9.Serial9.collide_on
+.. automethod:: serial9.Serial9.collide_off
+.. automethod:: serial9.Serial9.frame_end
+.. automethod:: serial9.Serial9.collisions
+
+Priority Lane
+=============
+
+With credit flow control on, a large write can leave a lot of bulk data queued
+ahead of anything urgent. :meth:`~serial9.Serial9.tx_priority` sends a short
+frame outside the credit, ahead of the host backlog, and the ``Serial9``
+firmware keeps it in a lane of its own that goes out at the next frame
+boundary - so it waits for at most the rest of the bulk frame on the bus.
+Channels of a :mod:`serial9.mux` have a priority lane too.
+
+The lane only works with :meth:`~serial9.Serial9.credit_on` or on a mux
+channel, where the firmware reads the host data ahead into its queue. On a
+plain adapter without credits the firmware reads the USB link one byte at
+a time as the bus takes it, so the priority frame goes out in order behind
+everything sent before it.
+
+:meth:`~serial9.Serial9.tx_words` does not end its frame. End bulk frames
+with :meth:`~serial9.Serial9.frame_end`, otherwise the next boundary is when
+the bulk queue runs dry. A priority frame that does not fit in the lane
+behind the ones still waiting is dropped whole and reported by
+:meth:`~serial9.Serial9.priority_dropped`.
+
+.. automethod:: serial9.Serial9.tx_priority
+.. automethod:: serial9.Serial9.priority_dropped
+
+Multiple Buses
+==============
+
+Firmware for a part with more than one USART bridges several buses over the
+one USB link, see :mod:`serial9.mux` for how to get a ``conn`` device for each.
+
 Encoding 9 Bit Data for an 8 Bit Interface
 ==========================================
 
@@ -105,6 +260,29 @@ are not passed to the physical serial interface.
     Baud_115200 = 0x19;
     Escape = "0xff";
     @endebnf
+
+The firmware also sends fixed length records back to the host. The payload of a
+record is NOT escaped, the host just takes the next N bytes.
+
+.. uml::
+    :caption: EBNF Railroad Diagrams for ``Serial9`` Records
+    :align: center
+
+    @startebnf
+    Record = Escape, ( Timestamp | Check_Result | Self_Test_Result | Credit | Collision | Retried | Priority_Dropped | Autobaud_Result );
+    Timestamp = 0x22, Byte, Byte, Byte, Byte;
+    Check_Result = 0x36, ( Good | Bad );
+    Self_Test_Result = 0x41, 16 * Byte;
+    Credit = 0x52, Byte;
+    Collision = 0x73, Byte, Byte;
+    Retried = 0x74, Byte;
+    Priority_Dropped = 0x81, Byte;
+    Autobaud_Result = 0x91, Byte, Byte, Byte, Byte, Byte;
+    Good = 0x00;
+    Bad = 0x01;
+    Escape = "0xff";
+    Byte = "0x00 - 0xff";
+    @endebnf
 """
 # -----------------------------------------------------------------------------
 
@@ -116,6 +294,82 @@ import logging
 import serial
 import serial.tools.list_ports
 
+# -----------------------------------------------------------------------------
+class SerialConn():
+    '''A ``conn`` device for a ``Serial9`` adapter on a physical serial port
+
+    Parameters:
+        port (str): Name of the serial port, if ``None`` use the first
+                    Arduino ProMicro we can find
+    '''
+
+    PROMICRO_VID = 0x2341
+    PROMICRO_PID = 0x8036
+
+    def __init__(self, port=None):
+
+        self.logger = logging.getLogger(__name__)
+
+        if port is None:
+            for p in sorted(serial.tools.list_ports.comports()):
+                if ((p.vid == self.PROMICRO_VID) and (p.pid == self.PROMICRO_PID)):
+                    self.logger.info('Found an Arduino ProMicro device')
+                    port = p.device
+                    break
+
+        if port is None:
+            raise IOError("No Serial9 device found")
+
+        self._port = serial.Serial(port, timeout=0)
+
+    def tx(self, d):
+        self._port.write(d)
+
+    def rx(self):
+        return self._port.read(self._port.in_waiting)
+
+    def close(self):
+        self._port.close()
+
+# -----------------------------------------------------------------------------
+class _Scanner():
+    # Follows the escape protocol just far enough to know where one escape
+    # sequence ends, so nothing gets put in the middle of one.
+
+    def __init__(self, lengths):
+        self._lengths = lengths
+        self._escape = False
+        self._remaining = 0
+
+    def scan(self, d):
+        '''Return the length of the part of ``d`` that ends on a boundary'''
+        boundary = 0
+        for i, c in enumerate(d):
+            if self._remaining > 0:
+                self._remaining -= 1
+            elif self._escape:
+                self._escape = False
+                self._remaining = self._lengths.get(c, 0)
+            elif Serial9.SERIAL9_ESCAPE == c:
+                self._escape = True
+                continue
+            if 0 == self._remaining:
+                boundary = i + 1
+        return boundary
+
+    def pending(self, d):
+        '''Return how much of ``d`` finishes the escape sequence in progress'''
+        escape, remaining = self._escape, self._remaining
+        n = 0
+        while (escape or (remaining > 0)) and (n < len(d)):
+            if remaining > 0:
+                remaining -= 1
+            else:
+                escape = False
+                remaining = self._lengths.get(d[n], 0)
+            n += 1
+        return n
+
 # -----------------------------------------------------------------------------
 class Serial9():
 
@@ -125,6 +379,7 @@ class Serial9():
     SERIAL9_STATE_IDLE = 0x00
     SERIAL9_STATE_ESCAPE = 0x01
     SERIAL9_STATE_HIGH = 0x02
+    SERIAL9_STATE_RECORD = 0x03
 
     SERIAL_9_BAUD_300 = 0x10
     SERIAL_9_BAUD_600 = 0x11
@@ -137,12 +392,198 @@ class Serial9():
     SERIAL_9_BAUD_57600 = 0x18
     SERIAL_9_BAUD_115200 = 0x19
 
-    def __init__(self, conn=None):
+    SERIAL9_SNIFF_START = 0x20
+    SERIAL9_SNIFF_STOP = 0x21
+    SERIAL9_TIMESTAMP = 0x22
+
+    SERIAL9_CHECK_OFF = 0x30
+    SERIAL9_CHECK_ADD = 0x31
+    SERIAL9_CHECK_CRC = 0x32
+    SERIAL9_CHECK_END = 0x33
+    SERIAL9_DELIVER_ALL = 0x34
+    SERIAL9_DELIVER_GOOD = 0x35
+    SERIAL9_CHECK_RESULT = 0x36
+
+    SERIAL9_SELFTEST = 0x40
+    SERIAL9_SELFTEST_RESULT = 0x41
+
+    SERIAL9_CREDIT_ON = 0x50
+    SERIAL9_CREDIT_OFF = 0x51
+    SERIAL9_CREDIT = 0x52
+
+    SERIAL9_COLLIDE_ON = 0x70
+    SERIAL9_COLLIDE_OFF = 0x71
+    SERIAL9_FRAME_END = 0x72
+    SERIAL9_COLLISION = 0x73
+    SERIAL9_RETRIED = 0x74
+
+    SERIAL9_PRIORITY = 0x80
+    SERIAL9_PRIORITY_DROPPED = 0x81
+
+    SERIAL9_AUTOBAUD = 0x90
+    SERIAL9_AUTOBAUD_RESULT = 0x91
+
+    SERIAL9_DUPLEX_ON = 0xa0
+    SERIAL9_DUPLEX_OFF = 0xa1
+
+    # Longest priority frame the firmware has room for, escapes included
+    SERIAL9_PRIORITY_SIZE = 16
+
+    # Baud rate escape code for each supported baud rate
+    BAUD_CODES = {
+        300: SERIAL_9_BAUD_300,
+        600: SERIAL_9_BAUD_600,
+        1200: SERIAL_9_BAUD_1200,
+        2400: SERIAL_9_BAUD_2400,
+        4800: SERIAL_9_BAUD_4800,
+        9600: SERIAL_9_BAUD_9600,
+        19200: SERIAL_9_BAUD_19200,
+        38400: SERIAL_9_BAUD_38400,
+        57600: SERIAL_9_BAUD_57600,
+        115200: SERIAL_9_BAUD_115200,
+    }
+
+    # Number of raw parameter bytes after the escape commands that have them
+    SERIAL9_PARAM_LENGTH = {
+        SERIAL9_HIGH: 1,
+        SERIAL9_SELFTEST: 3,
+        SERIAL9_COLLIDE_ON: 1,
+        SERIAL9_PRIORITY: 1,
+    }
+
+    # Payload length of the fixed length records sent by the firmware,
+    # indexed by the escape code that introduces them
+    SERIAL9_RECORD_LENGTH = {
+        SERIAL9_TIMESTAMP: 4,
+        SERIAL9_CHECK_RESULT: 1,
+        SERIAL9_SELFTEST_RESULT: 16,
+        SERIAL9_CREDIT: 1,
+        SERIAL9_COLLISION: 2,
+        SERIAL9_RETRIED: 1,
+        SERIAL9_PRIORITY_DROPPED: 1,
+        SERIAL9_AUTOBAUD_RESULT: 5,
+    }
+
+    def __init__(self, conn=None, metrics=None):
 
         self.logger = logging.getLogger(__name__)
         self._conn = conn
+        self._metrics = metrics
+
+        # The address of the last frame sent, the number of words of its
+        # echo still to come and the time the echo ended, until the first
+        # word of the reply comes back - only used with metrics
+        self._request = None
+
+        # Everything sent comes back on a half duplex bus
+        self._echo = True
         self._rx_state = self.SERIAL9_STATE_IDLE
-        self._loopback_buffer = b""
+        self._loopback_buffer = bytearray()
+
+        self._record_code = None
+        self._record = bytearray()
+
+        # The firmware timestamp is micros() which wraps every 71 minutes,
+        # so we keep the upper bits here
+        self._timestamp = None
+        self._timestamp_wrap = 0
+
+        # CHECK_RESULT records as (index in the decoded data, good), and
+        # the words of a frame that is not complete yet
+        self._check_results = []
+        self._frame_words = []
+
+        # The most recent SELFTEST_RESULT record
+        self._self_test_result = None
+
+        # The most recent AUTOBAUD_RESULT record
+        self._autobaud_result = None
+
+        # COLLISION and RETRIED records not yet read by collisions()
+        self._collisions = []
+
+        # Lengths from PRIORITY_DROPPED records not yet read by
+        # priority_dropped()
+        self._priority_dropped = []
+
+        # Write combining - None when it is off, otherwise the longest time
+        # data waits in the combine buffer
+        self._combine_deadline = None
+        self._combine_buffer = bytearray()
+        self._combine_start = 0.0
+
+        # Reused by tx_words() so a frame is encoded without new buffers
+        self._tx_buffer = bytearray()
+
+        # Credit flow control - None when it is off, otherwise the number
+        # of bytes the target has room for. Anything beyond that waits in
+        # the backlog until the target grants more credit
+        self._credit = None
+        self._credit_closing = False
+        self._backlog = bytearray()
+
+        # Where the data sent so far has got to in the escape protocol - a
+        # grant can end in the middle of an escape sequence
+        self._sent_scan = _Scanner(self.SERIAL9_PARAM_LENGTH)
+
+    def _write(self, d):
+        if self._combine_deadline is None:
+            self._conn_tx(d)
+        else:
+            if not self._combine_buffer:
+                self._combine_start = time.monotonic()
+            self._combine_buffer += d
+            if time.monotonic() - self._combine_start >= self._combine_deadline:
+                self.flush()
+
+    def _conn_tx(self, d):
+        if self._metrics is not None:
+            self._metrics.tx_bytes.observe(len(d))
+        try:
+            self._conn.tx(d)
+        except:
+            self._loopback_buffer += d
+
+    def write_combining(self, deadline=0.001):
+        '''Collect everything sent into as few ``conn.tx()`` calls as possible
+
+        The deadline is only checked when data is sent, it does not send
+        anything on its own. Anything held after the last write goes out
+        with :meth:`flush` or the next read.
+
+        Parameters:
+            deadline (float): Longest time in seconds data is held before
+                              the next call sends it, ``None`` turns write
+                              combining off and sends anything held
+        '''
+        if deadline is None:
+            self.flush()
+        self._combine_deadline = deadline
+
+    def flush(self):
+        '''Send anything held back by write combining'''
+        if self._combine_buffer:
+            self._conn_tx(bytes(self._combine_buffer))
+            self._combine_buffer.clear()
+
+    def _send(self, d):
+        if self._credit is None:
+            self._write(d)
+        else:
+            self._backlog += d
+            self._pump()
+
+    def _pump(self):
+        n = min(self._credit, len(self._backlog))
+        if n > 0:
+            self._write(bytes(self._backlog[:n]))
+            self._sent_scan.scan(self._backlog[:n])
+            del self._backlog[:n]
+            self._credit -= n
+
+        if self._credit_closing and not self._backlog:
+            self._credit = None
+            self._credit_closing = False
 
     def tx8(self, s):
         '''Send string to target with bit 9 low in all bytes, handle escape character
@@ -152,28 +593,93 @@ class Serial9():
 
         '''
 
-        self.logger.debug(f"tx8 {s}")
-        d = re.sub(b"\xff", b"\xff\xff", s, flags=re.DOTALL)
-        try:
-            self._conn.tx(d)
-        except:
-            self._loopback_buffer += d
+        if self.logger.isEnabledFor(logging.DEBUG):
+            self.logger.debug(f"tx8 {s}")
+
+        if self._metrics is None:
+            d = re.sub(b"\xff", b"\xff\xff", s, flags=re.DOTALL)
+        else:
+            start = time.perf_counter_ns()
+            d = re.sub(b"\xff", b"\xff\xff", s, flags=re.DOTALL)
+            self._observe_encode(start, len(d))
+            if (self._request is not None) and self._echo:
+                self._request[1] += len(s)
+        self._send(d)
+
+    def _observe_encode(self, start, length):
+        if length:
+            self._metrics.encode_ns_per_byte.observe((time.perf_counter_ns() - start) / length)
 
     def _escape_9(self, m):
         return b"\xff\x01" + m.group(0)
 
+    # Pre-computed escape sequence for every possible 9 bit word
+    ENCODED = ([bytes([c]) for c in range(0, 0xff)]
+               + [bytes([0xff, 0xff])]
+               + [bytes([0xff, 0x01, c]) for c in range(0, 0x100)])
+
+    @classmethod
+    def encode(cls, words):
+        '''Return the escaped byte string for a list of 9 bit words
+
+        Parameters:
+            words ([ integer, ... ]): Words in the range ``0x0000`` to ``0x01ff``,
+                                      bit 9 high is sent with bit 9 high
+
+        Returns:
+            bytes
+        '''
+        encoded = cls.ENCODED
+        return b"".join([encoded[w] for w in words])
+
+    def tx_words(self, words):
+        '''Send a frame of mixed 8 and 9 bit words with a single write
+
+        Parameters:
+            words ([ integer, ... ]): Words in the range ``0x0000`` to ``0x01ff``,
+                                      bit 9 high is sent with bit 9 high
+        '''
+        if self._metrics is not None:
+            start = time.perf_counter_ns()
+
+        encoded = self.ENCODED
+        buffer = self._tx_buffer
+        buffer.clear()
+        for w in words:
+            buffer += encoded[w]
+
+        if self._metrics is not None:
+            self._observe_encode(start, len(buffer))
+            if buffer[:2] == b"\xff\x01":
+                self._request = [buffer[2], len(words) if self._echo else 0, time.perf_counter()]
+        self._send(bytes(buffer))
+
+    def tx_encoded(self, d):
+        '''Send data that is already escaped, for example by :meth:`encode`
+
+        Parameters:
+            d (bytes): Escaped data to be sent to the target
+        '''
+        self._send(d)
+
     def tx9(self, s):
         '''Send string to target with bit 9 high in all bytes
 
         Parameters:
             s (bytes): Data to be sent to the target
         '''
-        self.logger.debug(f"tx9 {s}")
-        d = re.sub(b".", self._escape_9, s, flags=re.DOTALL)
-        try:
-            self._conn.tx(d)
-        except:
-            self._loopback_buffer += d
+        if self.logger.isEnabledFor(logging.DEBUG):
+            self.logger.debug(f"tx9 {s}")
+
+        if self._metrics is None:
+            d = re.sub(b".", self._escape_9, s, flags=re.DOTALL)
+        else:
+            start = time.perf_counter_ns()
+            d = re.sub(b".", self._escape_9, s, flags=re.DOTALL)
+            self._observe_encode(start, len(d))
+            if s:
+                self._request = [s[0], len(s) if self._echo else 0, time.perf_counter()]
+        self._send(d)
 
     def rx(self):
         '''Return the data from the target as a list of integers
@@ -188,13 +694,66 @@ class Serial9():
             [ integer, ... ] 
         '''
 
+        return self._decode(self._rx_raw())
+
+    def rx_timed(self):
+        '''Return the data from the target as a list of (timestamp, integer)
+
+        The timestamp is the firmware ``micros()`` value of the most recent
+        TIMESTAMP record, extended to 64 bits. In sniff mode every word is
+        preceded by its own TIMESTAMP record, otherwise the timestamp is
+        ``None`` until the first record arrives.
+
+        Returns:
+            [ (integer, integer), ... ]
+        '''
+
+        t = []
+        d = self._decode(self._rx_raw(), t)
+        return list(zip(t, d))
+
+    def _rx_raw(self):
+        # A reply can't come before the request has gone out
+        self.flush()
         try:
             raw_data = self._conn.rx()
         except:
-            raw_data = self._loopback_buffer
-            self._loopback_buffer = b""
+            raw_data = bytes(self._loopback_buffer)
+            self._loopback_buffer = bytearray()
+
+        if self._metrics is not None:
+            self._metrics.rx_bytes.observe(len(raw_data))
+        return raw_data
+
+    def rx_frames(self):
+        '''Return the complete frames from the target, when frame checks are on
+
+        The words of a frame that has not been followed by a CHECK_RESULT yet
+        are held back until the next call.
+
+        Returns:
+            [ (bool, [ integer, ... ]), ... ] - good flag and words for each frame
+        '''
+
+        d = self._decode(self._rx_raw())
+
+        frames = []
+        start = 0
+        for end, good in self._check_results:
+            self._frame_words.extend(d[start:end])
+            frames.append((good, self._frame_words))
+            self._frame_words = []
+            start = end
+
+        self._frame_words.extend(d[start:])
+        return frames
+
+    def _decode(self, raw_data, t=None):
+        if self._metrics is not None:
+            start = time.perf_counter_ns()
 
         d = []
+        self._check_results = []
 
         for c in raw_data:
             if self._rx_state == self.SERIAL9_STATE_IDLE:
@@ -203,6 +762,8 @@ class Serial9():
                 else:
                     # It's an unescaped character, just append it
                     d.append(c)
+                    if t is not None:
+                        t.append(self._timestamp)
 
             elif self._rx_state == self.SERIAL9_STATE_ESCAPE:
                 if self.SERIAL9_HIGH == c:
@@ -212,6 +773,14 @@ class Serial9():
                     # It's an escaped ESCAPE character, just append it
                     self._rx_state = self.SERIAL9_STATE_IDLE
                     d.append(c)
+                    if t is not None:
+                        t.append(self._timestamp)
+
+                elif c in self.SERIAL9_RECORD_LENGTH:
+                    # It's the start of a fixed length record
+                    self._rx_state = self.SERIAL9_STATE_RECORD
+                    self._record_code = c
+                    self._record = bytearray()
 
                 else:
                     # It's an illegal character - ignore it
@@ -221,22 +790,345 @@ class Serial9():
                      # It's a character with the 9th bit high, append it
                      self._rx_state = self.SERIAL9_STATE_IDLE
                      d.append(c + 0x100)
+                     if t is not None:
+                         t.append(self._timestamp)
+
+            elif self._rx_state == self.SERIAL9_STATE_RECORD:
+                self._record.append(c)
+                if len(self._record) == self.SERIAL9_RECORD_LENGTH[self._record_code]:
+                    self._rx_state = self.SERIAL9_STATE_IDLE
+                    self._on_record(self._record_code, bytes(self._record), d)
 
             else:
                 self._rx_state = self.SERIAL9_STATE_IDLE
                 d.append(c)
+                if t is not None:
+                    t.append(self._timestamp)
                 self.logger.error("Unhandled state")
 
-        self.logger.debug(f"rx loop return {d}")
+        if self._metrics is not None:
+            if raw_data:
+                self._metrics.decode_ns_per_byte.observe((time.perf_counter_ns() - start)
+                                                         / len(raw_data))
+            if d and (self._request is not None):
+                # The echo of the request comes first, the reply latency
+                # is timed from the end of it
+                request = self._request
+                echo = min(request[1], len(d))
+                request[1] -= echo
+                now = time.perf_counter()
+                if echo > 0:
+                    request[2] = now
+                if len(d) > echo:
+                    self._metrics.observe_latency(request[0], now - request[2])
+                    self._request = None
+
+        if self.logger.isEnabledFor(logging.DEBUG):
+            self.logger.debug(f"rx loop return {d}")
         return d
 
+    def _on_record(self, code, payload, d):
+        if self.SERIAL9_TIMESTAMP == code:
+            timestamp = int.from_bytes(payload, "little")
+            if self._timestamp is not None and timestamp < (self._timestamp & 0xffffffff):
+                self._timestamp_wrap += 1 << 32
+            self._timestamp = self._timestamp_wrap + timestamp
+
+        elif self.SERIAL9_CHECK_RESULT == code:
+            self._check_results.append((len(d), 0 == payload[0]))
+
+        elif self.SERIAL9_SELFTEST_RESULT == code:
+            words, errors, longest, elapsed = [int.from_bytes(payload[i:i + 4], "little")
+                                               for i in range(0, 16, 4)]
+            self._self_test_result = {
+                "words": words,
+                "errors": errors,
+                "longest_run": longest,
+                "elapsed_us": elapsed,
+                "words_per_second": words * 1e6 / elapsed if elapsed else 0.0,
+            }
+
+        elif self.SERIAL9_CREDIT == code:
+            if self._credit is not None:
+                self._credit += payload[0]
+                self._pump()
+
+        elif self.SERIAL9_COLLISION == code:
+            self._collisions.append(("collision", payload[0], payload[1]))
+
+        elif self.SERIAL9_RETRIED == code:
+            self._collisions.append(("retried", payload[0]))
+
+        elif self.SERIAL9_PRIORITY_DROPPED == code:
+            self._priority_dropped.append(payload[0])
+
+        elif self.SERIAL9_AUTOBAUD_RESULT == code:
+            self._autobaud_result = {
+                "baud": int.from_bytes(payload[0:4], "little"),
+                "error_percent": int.from_bytes(payload[4:5], "little", signed=True) / 10,
+            }
+
     def set_baud(self, baud):
         '''Send baud rate change escape sequence to the target
 
         Parameters:
             baud (int): One of the SERIAL_9_BAUD_xxx constants
         '''
-        self._conn.tx(bytes([self.SERIAL9_ESCAPE, baud]))
+        self._send(bytes([self.SERIAL9_ESCAPE, baud]))
+
+    def autobaud(self, timeout=5.0, poll=0.01):
+        '''Have the target find the baud rate of the bus and switch to it
+
+        Nothing is sent on the bus. Other traffic has to be going on for
+        the target to measure - a few frames is enough. Anything else
+        received while it runs is discarded.
+
+        Parameters:
+            timeout (float): Seconds to wait for the result, the target
+                             gives up by itself after 2 seconds
+            poll (float): Seconds to sleep between reads
+
+        Returns:
+            dict with ``baud``, the rate now set or 0 if the bus was too
+            quiet to tell or not at a standard rate, and ``error_percent``,
+            how far the measured rate was from the rate the UART really
+            runs at when set to it - or ``None`` on a timeout
+        '''
+
+        self._autobaud_result = None
+        self._send(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_AUTOBAUD]))
+
+        end = time.monotonic() + timeout
+        while self._autobaud_result is None:
+            if time.monotonic() > end:
+                return None
+            if not self._decode(self._rx_raw()):
+                time.sleep(poll)
+
+        return self._autobaud_result
+
+    def set_check(self, check):
+        '''Select the frame check used by the target in both directions
+
+        Parameters:
+            check (int): One of SERIAL9_CHECK_OFF, SERIAL9_CHECK_ADD (MDB)
+                         or SERIAL9_CHECK_CRC (Modbus)
+        '''
+        self._send(bytes([self.SERIAL9_ESCAPE, check]))
+
+    def check_end(self):
+        '''Mark the end of the outgoing frame, the target appends the check
+        '''
+        self._send(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_CHECK_END]))
+
+    def deliver_good_only(self, good_only=True):
+        '''Ask the target to drop incoming frames that fail the check
+
+        Parameters:
+            good_only (bool): ``False`` to get every frame again
+        '''
+        deliver = self.SERIAL9_DELIVER_GOOD if good_only else self.SERIAL9_DELIVER_ALL
+        self._send(bytes([self.SERIAL9_ESCAPE, deliver]))
+
+    def self_test(self, count=1000, mix=0x80, timeout=10.0, poll=0.01):
+        '''Run the firmware self test at the current baud rate
+
+        The bus must be looped back, or the transceiver must echo what the
+        target sends. Anything else received while the test runs is discarded.
+
+        Parameters:
+            count (int): Number of words to send, up to 65535
+            mix (int): On average ``mix`` out of every 256 words have bit 9 high
+            timeout (float): Seconds to wait for the result
+            poll (float): Seconds to sleep between reads
+
+        Returns:
+            dict with ``words``, ``errors``, ``longest_run`` (error free words),
+            ``elapsed_us`` and ``words_per_second``, or ``None`` on a timeout
+        '''
+
+        self._self_test_result = None
+        self._send(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_SELFTEST,
+                             count & 0xff, (count >> 8) & 0xff, mix & 0xff]))
+
+        end = time.monotonic() + timeout
+        while self._self_test_result is None:
+            if time.monotonic() > end:
+                return None
+            if not self._decode(self._rx_raw()):
+                time.sleep(poll)
+
+        return self._self_test_result
+
+    def credit_on(self):
+        '''Turn on credit flow control
+
+        From now on nothing is sent to the target until it has granted
+        credit for it - the target sends its first grant as soon as it sees
+        this command. Data beyond the credit waits in the backlog, and goes
+        out as new credit arrives with the data from :meth:`rx`.
+        '''
+        if self._credit is None:
+            self._write(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_CREDIT_ON]))
+            self._credit = 0
+
+    def credit_off(self):
+        '''Turn off credit flow control once the backlog has been sent
+        '''
+        if (self._credit is not None) and not self._credit_closing:
+            self._credit_closing = True
+            self._send(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_CREDIT_OFF]))
+
+    @property
+    def credit(self):
+        '''Bytes the target has room for, or ``None`` if credits are off
+
+        It goes below zero when :meth:`tx_priority` has to finish an escape
+        sequence the last grant cut in two.
+        '''
+        return self._credit
+
+    @property
+    def backlog(self):
+        '''Bytes waiting for credit from the target'''
+        return len(self._backlog)
+
+    def drain(self, timeout=None, poll=0.001):
+        '''Keep reading from the target until the backlog has been sent
+
+        Parameters:
+            timeout (float): Seconds to wait, or forever if ``None``
+            poll (float): Seconds to sleep when there is nothing to read
+
+        Returns:
+            [ integer, ... ] - the words received in the meantime, as :meth:`rx`
+        '''
+
+        end = None if timeout is None else time.monotonic() + timeout
+        d = []
+
+        while self._backlog:
+            if (end is not None) and (time.monotonic() > end):
+                break
+            words = self.rx()
+            if words:
+                d.extend(words)
+            else:
+                time.sleep(poll)
+
+        return d
+
+    def collide_on(self, retries=3):
+        '''Turn on collision detect
+
+        The target checks the echo of every word it sends, so RE_ must stay
+        enabled while it talks. On the first word that does not match it
+        releases the bus, and once the frame has been ended with
+        :meth:`frame_end` it sends the whole frame again after a random
+        backoff, up to ``retries`` times.
+
+        Parameters:
+            retries (int): Number of times to send a collided frame again,
+                           0 to only report collisions
+        '''
+        self._send(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_COLLIDE_ON, retries & 0xff]))
+
+    def collide_off(self):
+        '''Turn off collision detect
+        '''
+        self._send(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_COLLIDE_OFF]))
+
+    def frame_end(self):
+        '''Mark the end of the outgoing frame
+
+        With collision detect on every frame must be ended, the target
+        holds on to the frame until then in case it has to be sent again.
+        It is also where a priority frame can go out ahead of the rest.
+        '''
+        self._send(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_FRAME_END]))
+
+    def tx_priority(self, words):
+        '''Send a short urgent frame ahead of everything else queued
+
+        The frame is ended with FRAME_END, and is sent right away even with
+        write combining on or no credit left. It only gets ahead of bulk data
+        with credit flow control on or on a mux channel.
+
+        Parameters:
+            words (list): The 9 bit words of the frame, no more than fit in
+                          ``SERIAL9_PRIORITY_SIZE`` bytes once escaped
+        '''
+
+        payload = self.encode(words) + bytes([self.SERIAL9_ESCAPE, self.SERIAL9_FRAME_END])
+        if len(payload) > self.SERIAL9_PRIORITY_SIZE:
+            raise ValueError(f"priority frame is {len(payload)} bytes, "
+                             f"the most is {self.SERIAL9_PRIORITY_SIZE}")
+
+        frame = bytes([self.SERIAL9_ESCAPE, self.SERIAL9_PRIORITY, len(payload)]) + payload
+
+        # An escape sequence cut in two by the last grant is finished off
+        # first, the target keeps room for it
+        if self._credit is not None:
+            n = self._sent_scan.pending(self._backlog)
+            if n > 0:
+                frame = bytes(self._backlog[:n]) + frame
+                self._sent_scan.scan(self._backlog[:n])
+                del self._backlog[:n]
+                self._credit -= n
+
+        self._write(frame)
+        self.flush()
+
+    def collisions(self):
+        '''Return the collision reports that have come in with the data read
+        by :meth:`rx` since the last call
+
+        Returns:
+            [ ("collision", position, retries left) | ("retried", retries), ... ]
+            - a collision with 0 retries left means the frame was dropped
+        '''
+        collisions, self._collisions = self._collisions, []
+        return collisions
+
+    def priority_dropped(self):
+        '''Return the lengths of the priority frames the target has dropped,
+        as reported with the data read by :meth:`rx` since the last call
+
+        A priority frame is dropped whole when it does not fit in the lane
+        behind the frames still waiting there.
+
+        Returns:
+            [ integer, ... ]
+        '''
+        dropped, self._priority_dropped = self._priority_dropped, []
+        return dropped
+
+    def full_duplex(self, on=True):
+        '''Switch the target between full duplex RS-422 and half duplex
+        RS-485 operation
+
+        Switch between frames - a word still going out when the target
+        goes back to half duplex is cut short.
+
+        Parameters:
+            on (bool): True for full duplex, False for half duplex (default)
+        '''
+        code = self.SERIAL9_DUPLEX_ON if on else self.SERIAL9_DUPLEX_OFF
+        self._send(bytes([self.SERIAL9_ESCAPE, code]))
+        self._echo = not on
+
+    def sniff_start(self):
+        '''Put the target into listen only sniff mode
+
+        The target never drives the bus in sniff mode, and every word it
+        receives is preceded by a TIMESTAMP record.
+        '''
+        self._send(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_SNIFF_START]))
+
+    def sniff_stop(self):
+        '''Return the target to normal half or full duplex operation
+        '''
+        self._send(bytes([self.SERIAL9_ESCAPE, self.SERIAL9_SNIFF_STOP]))
 
 # -----------------------------------------------------------------------------
 def serial9(conn=None): # pragma no cover
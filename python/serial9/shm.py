@@ -0,0 +1,397 @@
+# -----------------------------------------------------------------------------
+"""A shared memory ``conn`` device for a bridge process on the same host
+
+When the serial port is owned by another process on the same machine - the
+``serial9_bridge`` in the ``host`` folder, or anything else that speaks this
+layout - a Unix socket between the two costs a system call and two copies
+through the kernel for every read and write. :class:`ShmConn` replaces the
+socket with two single producer, single consumer byte rings in a ``memfd``
+that both processes map:
+
+- ``tx()`` copies the data straight into the ring the bridge reads
+- ``rx()`` copies whatever the bridge has put in the other ring out of it
+
+Neither makes a system call unless the other side is asleep. Each side has
+an ``eventfd`` that the other side writes to wake it up, and only when it
+has said it is going to sleep. Waking up costs several system calls, so
+on a machine with more than one CPU :meth:`ShmConn.wait` polls the ring for
+``SPIN_TIME`` seconds before it goes to sleep - on a single CPU that would
+only keep the other side from running.
+
+Layout
+======
+
+All values are little endian. The head and tail counters are free running,
+the position in the ring is the counter modulo the ring size.
+
+- A 64 byte header: magic, version and the ring size (a power of two)
+- Two 256 byte control blocks, one for each ring, host to bridge first.
+  Each has the head (written by the producer), the tail (written by the
+  consumer), and a flag for a sleeping reader and a sleeping writer, each
+  on its own 64 byte cache line
+- The data of the host to bridge ring, then the bridge to host ring
+
+Python cannot issue a memory fence. The data is copied into the ring before
+the head is stored, and on a weakly ordered CPU (ARM, for example a
+Raspberry Pi) the bridge could see the new head before the data and read
+stale bytes. The rings are therefore only supported on x86, where stores
+are seen in order - :meth:`ShmConn.create` refuses to make them anywhere
+else. On x86 a wakeup can still in principle be missed, because the flag
+is read before the data stores are seen by the other CPU. Every wait is
+therefore broken up into slices of ``WAIT_SLICE`` seconds, and a missed
+wakeup costs at most one slice.
+
+The head and tail are written by the other side. A ring that says it holds
+more than its size is corrupt - :class:`ConnectionError` is raised, and the
+bridge drops the connection.
+
+The memfd and the two eventfds are handed to the bridge over a Unix socket
+by :meth:`ShmConn.connect`, and the socket stays open so the bridge knows
+when the host has gone. The memfd is sealed against changing its size
+first. A host that shrank it would kill the bridge with SIGBUS, so the
+bridge refuses a memfd that is not sealed.
+
+Run ``python -m serial9.shm [count]`` to compare the round trip latency
+with a socket.
+
+.. autoclass:: serial9.shm.ShmConn
+    :members:
+"""
+# -----------------------------------------------------------------------------
+
+import os
+import sys
+import mmap
+import fcntl
+import time
+import select
+import socket
+import struct
+import platform
+
+SHM_MAGIC = b"S9SHRING"
+SHM_VERSION = 1
+
+# magic, version, ring size
+HEADER = struct.Struct("<8sII")
+HEADER_SIZE = 64
+
+CONTROL_SIZE = 256
+HEAD = 0
+TAIL = 64
+READER_WAITING = 128
+WRITER_WAITING = 192
+
+COUNTER = struct.Struct("<Q")
+FLAG = struct.Struct("<I")
+
+WAIT_SLICE = 0.01
+SPIN_TIME = 0.0001 if len(os.sched_getaffinity(0)) > 1 else 0
+
+# CPUs that keep stores in order, so the data is seen before the head
+ORDERED_MACHINES = ("x86_64", "amd64", "i386", "i486", "i586", "i686", "x86")
+
+# -----------------------------------------------------------------------------
+class _Ring():
+    # One direction of the shared memory, seen from one side
+
+    def __init__(self, mm, control, data, size):
+        self._mm = mm
+        self._control = control
+        self._data = data
+        self._size = size
+        self._mask = size - 1
+
+    def _get(self, offset):
+        return COUNTER.unpack_from(self._mm, self._control + offset)[0]
+
+    def _put(self, offset, value):
+        COUNTER.pack_into(self._mm, self._control + offset, value)
+
+    def _flag(self, offset):
+        return FLAG.unpack_from(self._mm, self._control + offset)[0]
+
+    def _set_flag(self, offset, value):
+        FLAG.pack_into(self._mm, self._control + offset, value)
+
+    def _fill(self, head, tail):
+        n = head - tail
+        if not (0 <= n <= self._size):
+            raise ConnectionError("The shared memory ring is corrupt")
+        return n
+
+    def used(self):
+        return self._fill(self._get(HEAD), self._get(TAIL))
+
+    def write(self, d):
+        '''Copy as much of ``d`` as fits into the ring, return how much'''
+        head = self._get(HEAD)
+        n = min(len(d), self._size - self._fill(head, self._get(TAIL)))
+        if 0 == n:
+            return 0
+
+        start = head & self._mask
+        first = min(n, self._size - start)
+        self._mm[self._data + start:self._data + start + first] = d[:first]
+        if n > first:
+            self._mm[self._data:self._data + n - first] = d[first:n]
+
+        self._put(HEAD, head + n)
+        return n
+
+    def read(self):
+        '''Copy everything in the ring out of it'''
+        tail = self._get(TAIL)
+        n = self._fill(self._get(HEAD), tail)
+        if 0 == n:
+            return b""
+
+        start = tail & self._mask
+        first = min(n, self._size - start)
+        d = self._mm[self._data + start:self._data + start + first]
+        if n > first:
+            d += self._mm[self._data:self._data + n - first]
+
+        self._put(TAIL, tail + n)
+        return d
+
+    def take_flag(self, offset):
+        '''Clear the flag at ``offset``, return True if it was set'''
+        if self._flag(offset):
+            self._set_flag(offset, 0)
+            return True
+        return False
+
+# -----------------------------------------------------------------------------
+class ShmConn():
+    '''A ``conn`` device over a pair of shared memory rings
+
+    Use :meth:`create` or :meth:`connect` for the host side, and
+    :meth:`bridge` for the other side of the same rings. Only the host
+    side closes the shared memory and the eventfds.
+
+    Parameters:
+        mm: The mapped shared memory
+        fds: The memfd, the eventfd that wakes this side and the eventfd
+             that wakes the other side
+        host (bool): True for the host side
+        sock: The socket the fds were passed over, closed with the conn
+    '''
+
+    def __init__(self, mm, fds, host=True, sock=None):
+
+        magic, version, size = HEADER.unpack_from(mm, 0)
+        if (SHM_MAGIC != magic) or (SHM_VERSION != version):
+            raise ValueError("Not a serial9 shared memory ring")
+
+        self._mm = mm
+        self._fds = fds
+        self._host = host
+        self._sock = sock
+        self._wake_fd = fds[1]
+        self._peer_fd = fds[2]
+
+        data = HEADER_SIZE + 2 * CONTROL_SIZE
+        to_bridge = _Ring(mm, HEADER_SIZE, data, size)
+        to_host = _Ring(mm, HEADER_SIZE + CONTROL_SIZE, data + size, size)
+        self._tx_ring, self._rx_ring = (to_bridge, to_host) if host else (to_host, to_bridge)
+
+    @classmethod
+    def create(cls, size=65536):
+        '''Create the shared memory and the eventfds for a new pair of rings
+
+        Parameters:
+            size (int): Bytes in each ring, a power of two
+        '''
+
+        if (size <= 0) or (size & (size - 1)):
+            raise ValueError("The ring size must be a power of two")
+        if platform.machine().lower() not in ORDERED_MACHINES:
+            raise RuntimeError("The shared memory rings need an x86 CPU")
+
+        memfd = os.memfd_create("serial9", os.MFD_CLOEXEC | os.MFD_ALLOW_SEALING)
+        os.ftruncate(memfd, HEADER_SIZE + 2 * CONTROL_SIZE + 2 * size)
+        fcntl.fcntl(memfd, fcntl.F_ADD_SEALS,
+                    fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW | fcntl.F_SEAL_SEAL)
+        mm = mmap.mmap(memfd, 0)
+        HEADER.pack_into(mm, 0, SHM_MAGIC, SHM_VERSION, size)
+
+        flags = os.EFD_NONBLOCK | os.EFD_CLOEXEC
+        return cls(mm, (memfd, os.eventfd(0, flags), os.eventfd(0, flags)))
+
+    @classmethod
+    def connect(cls, path, size=65536):
+        '''Create a pair of rings and hand them to the bridge listening on
+        the Unix socket ``path``
+        '''
+
+        conn = cls.create(size)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            sock.connect(path)
+            socket.send_fds(sock, [SHM_MAGIC], conn.bridge_fds())
+        except OSError:
+            sock.close()
+            conn.close()
+            raise
+        conn._sock = sock
+        return conn
+
+    def bridge_fds(self):
+        '''Return the memfd, the eventfd that wakes the bridge and the
+        eventfd that wakes the host - in that order, as the bridge expects
+        '''
+        return [self._fds[0], self._peer_fd, self._wake_fd]
+
+    def bridge(self):
+        '''Return the bridge side of the same rings, for a bridge written in
+        Python or a test
+        '''
+        return ShmConn(self._mm, (self._fds[0], self._peer_fd, self._wake_fd), host=False)
+
+    def _wake_peer(self):
+        os.eventfd_write(self._peer_fd, 1)
+
+    def _sleep(self, timeout):
+        select.select([self._wake_fd], [], [], timeout)
+        try:
+            os.eventfd_read(self._wake_fd)
+        except BlockingIOError:
+            pass
+
+    def tx(self, d):
+        '''Send all of ``d``, waiting for room in the ring if needed'''
+
+        d = memoryview(d).cast("B")
+        sent = 0
+        while True:
+            sent += self._tx_ring.write(d[sent:])
+            if self._tx_ring.take_flag(READER_WAITING):
+                self._wake_peer()
+            if sent == len(d):
+                return
+
+            self._tx_ring._set_flag(WRITER_WAITING, 1)
+            if self._tx_ring.used() == self._tx_ring._size:
+                self._sleep(WAIT_SLICE)
+
+    def rx(self):
+        '''Return whatever is waiting, without waiting for more'''
+
+        d = self._rx_ring.read()
+        if d and self._rx_ring.take_flag(WRITER_WAITING):
+            self._wake_peer()
+        return d
+
+    def wait(self, timeout=None):
+        '''Wait until there is something to read
+
+        Returns:
+            True if there is data, False after ``timeout`` seconds
+        '''
+
+        spin = time.perf_counter() + SPIN_TIME
+        while 0 == self._rx_ring.used():
+            if time.perf_counter() > spin:
+                break
+        else:
+            return True
+
+        deadline = None if timeout is None else time.monotonic() + timeout
+        while 0 == self._rx_ring.used():
+            remaining = WAIT_SLICE
+            if deadline is not None:
+                remaining = min(remaining, deadline - time.monotonic())
+                if remaining <= 0:
+                    return False
+            self._rx_ring._set_flag(READER_WAITING, 1)
+            if 0 == self._rx_ring.used():
+                self._sleep(remaining)
+        return True
+
+    def close(self):
+        '''Close the host side - the bridge sees the socket close'''
+        if not self._host:
+            return
+        if self._sock is not None:
+            self._sock.close()
+            self._sock = None
+        for fd in self._fds:
+            os.close(fd)
+        self._fds = ()
+        self._mm.close()
+
+# -----------------------------------------------------------------------------
+def _echo_socket(sock):
+    while True:
+        d = sock.recv(65536)
+        if not d:
+            return
+        sock.sendall(d)
+
+def _echo_shm(conn):
+    while True:
+        if not conn.wait(1.0):
+            return
+        d = conn.rx()
+        if d == b"\x00":
+            return
+        conn.tx(d)
+
+def _round_trips(tx, rx, count, length):
+    message = b"\x55" * length
+    times = []
+    for i in range(count):
+        start = time.perf_counter()
+        tx(message)
+        received = 0
+        while received < length:
+            received += len(rx())
+        times.append(time.perf_counter() - start)
+    times.sort()
+    return times[len(times) // 2] * 1e6, times[int(len(times) * 0.99)] * 1e6
+
+def run(count=10000, lengths=(1, 16, 256, 4096)):
+    '''Time round trips through an echo process, over a socket and over
+    the shared memory rings
+
+    Returns:
+        [ (transport, message length, median usec, 99th percentile usec), ... ]
+    '''
+
+    results = []
+
+    a, b = socket.socketpair()
+    pid = os.fork()
+    if 0 == pid: # pragma no cover
+        a.close()
+        _echo_socket(b)
+        os._exit(0)
+    b.close()
+    for length in lengths:
+        results.append(("socket", length, *_round_trips(a.sendall, lambda: a.recv(65536), count, length)))
+    a.close()
+    os.waitpid(pid, 0)
+
+    conn = ShmConn.create()
+    pid = os.fork()
+    if 0 == pid: # pragma no cover
+        _echo_shm(conn.bridge())
+        os._exit(0)
+    for length in lengths:
+        def rx():
+            conn.wait()
+            return conn.rx()
+        results.append(("shared memory", length, *_round_trips(conn.tx, rx, count, length)))
+    conn.tx(b"\x00")
+    os.waitpid(pid, 0)
+    conn.close()
+
+    return results
+
+# -----------------------------------------------------------------------------
+if __name__ == "__main__": # pragma no cover
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 10000
+    print(f"{'transport':<14} {'bytes':>6} {'median usec':>12} {'p99 usec':>9}")
+    for transport, length, median, p99 in run(count):
+        print(f"{transport:<14} {length:>6} {median:>12.1f} {p99:>9.1f}")
@@ -0,0 +1,235 @@
+# -----------------------------------------------------------------------------
+"""Reply timeouts learned for each 9 bit address
+
+Waiting a fixed worst case time for every reply wastes most of the bus time
+when slaves answer quickly. A :class:`Timeouts` instance learns how long each
+address takes to start its reply once the echo of the request has passed,
+and :meth:`Timeouts.transact` only waits that long.
+
+For each address it keeps an exponentially weighted moving average of the
+latency and of its deviation from the average, the same way TCP estimates
+round trip times, and a high percentile of the most recent replies. The
+deadline is the larger of the average plus 4 deviations and the percentile,
+kept between ``floor`` and ``ceiling``. Until an address has answered a few
+times the deadline is the ``ceiling``, so that should be the worst case time
+the application used to wait.
+
+A slave that slows down a little moves the average and the percentile up with
+it. When it slows down past the deadline the reply is missed, and each miss
+in a row doubles the deadline, up to the ``ceiling``, until a reply comes in
+again and is learned from.
+
+The learned values are there for monitoring with :meth:`Timeouts.snapshot`
+or :meth:`Timeouts.prometheus`.
+
+.. autoclass:: serial9.timeouts.Timeouts
+    :members:
+.. autoclass:: serial9.timeouts.AddressTimeout
+    :members:
+"""
+# -----------------------------------------------------------------------------
+
+import time
+import collections
+
+# -----------------------------------------------------------------------------
+class AddressTimeout():
+    '''The reply latency learned for one address
+
+    Parameters:
+        floor (float): Shortest deadline in seconds
+        ceiling (float): Longest deadline in seconds, and the deadline
+                         until ``warmup`` replies have been seen
+        warmup (int): Replies needed before the learned deadline is used
+        window (int): Number of recent replies the percentile is taken over
+        quantile (float): The percentile, as a fraction
+    '''
+
+    # Gains of the moving averages, as in RFC 6298
+    ALPHA = 1 / 8
+    BETA = 1 / 4
+
+    def __init__(self, floor=0.0005, ceiling=0.1, warmup=4, window=64, quantile=0.99):
+        self._floor = floor
+        self._ceiling = ceiling
+        self._warmup = warmup
+        self._quantile = quantile
+        self._recent = collections.deque(maxlen=window)
+
+        self.mean = None
+        self.deviation = None
+        self.replies = 0
+        self.timeouts = 0
+
+        # Doubled for every timeout in a row
+        self._backoff = 1
+
+    def observe(self, seconds):
+        '''Learn from a reply that started ``seconds`` after the request'''
+        if self.mean is None:
+            self.mean = seconds
+            self.deviation = seconds / 2
+        else:
+            self.deviation += self.BETA * (abs(self.mean - seconds) - self.deviation)
+            self.mean += self.ALPHA * (seconds - self.mean)
+
+        self._recent.append(seconds)
+        self.replies += 1
+        self._backoff = 1
+
+    def miss(self):
+        '''Count a request that got no reply before the deadline'''
+        self.timeouts += 1
+        if self._backoff * self._floor < self._ceiling:
+            self._backoff *= 2
+
+    @property
+    def percentile(self):
+        '''The ``quantile`` of the recent reply latencies, ``None`` before any'''
+        if not self._recent:
+            return None
+        recent = sorted(self._recent)
+        return recent[min(len(recent) - 1, int(self._quantile * len(recent)))]
+
+    @property
+    def deadline(self):
+        '''Seconds to wait for the reply to start'''
+        if self.replies < self._warmup:
+            return self._ceiling
+
+        learned = max(self.mean + 4 * self.deviation, self.percentile)
+        return min(self._ceiling, max(self._floor, learned) * self._backoff)
+
+    def snapshot(self):
+        return {
+            "replies": self.replies,
+            "timeouts": self.timeouts,
+            "mean": self.mean,
+            "deviation": self.deviation,
+            "percentile": self.percentile,
+            "deadline": self.deadline,
+        }
+
+# -----------------------------------------------------------------------------
+class Timeouts():
+    '''The reply timeouts for every address on one bus
+
+    Parameters:
+        floor (float): Shortest deadline in seconds
+        ceiling (float): Longest deadline in seconds - the fixed worst case
+                         wait, used until an address has been learned
+        warmup (int): Replies needed before the learned deadline is used
+        window (int): Number of recent replies the percentile is taken over
+        quantile (float): The percentile, as a fraction
+        clock: Function returning the current time in seconds
+        sleep: Function that sleeps for a number of seconds
+    '''
+
+    def __init__(self, floor=0.0005, ceiling=0.1, warmup=4, window=64, quantile=0.99,
+                 clock=time.monotonic, sleep=time.sleep):
+        self._settings = (floor, ceiling, warmup, window, quantile)
+        self._clock = clock
+        self._sleep = sleep
+        self.addresses = {}
+
+    def address(self, address):
+        '''Return the :class:`AddressTimeout` for an address'''
+        timeout = self.addresses.get(address)
+        if timeout is None:
+            timeout = AddressTimeout(*self._settings)
+            self.addresses[address] = timeout
+        return timeout
+
+    def deadline(self, address):
+        '''Seconds to wait for a reply from ``address`` to start'''
+        return self.address(address).deadline
+
+    def transact(self, s9, words, gap=0.004, poll=0.0002, echo=True):
+        '''Send a request and return the reply, waiting no longer than the
+        deadline learned for the address
+
+        Anything received before the request is sent belongs to an earlier
+        request and is dropped. On a half duplex bus the adapter receives
+        the request it sends, so the first ``len(words)`` words received are
+        its echo. They are dropped too, and the deadline starts when the
+        echo has passed - waiting for the echo is bounded by the
+        ``ceiling``. The reply ends when nothing more has come in for
+        ``gap`` seconds, which has to cover the frame gap at the baud rate
+        of the bus and the USB latency.
+
+        Parameters:
+            s9 (Serial9): The bus the slave is on
+            words ([ integer, ... ]): The request, starting with the address
+                                      with bit 9 high
+            gap (float): Quiet time in seconds that ends the reply
+            poll (float): Seconds to sleep between reads
+            echo (bool): False on a full duplex bus, where the request is
+                         not received back
+
+        Returns:
+            [ integer, ... ] - the reply as :meth:`serial9.Serial9.rx` returns
+            it, or ``None`` if it did not start before the deadline
+        '''
+
+        if not words or not (words[0] & 0x100):
+            raise ValueError("a request starts with an address with bit 9 high")
+
+        timeout = self.address(words[0] & 0xff)
+        deadline = timeout.deadline
+        echo_left = len(words) if echo else 0
+
+        s9.rx()
+        s9.tx_words(words)
+        s9.flush()
+        start = self._clock()
+        end = start + (self._settings[1] if echo_left else deadline)
+
+        reply = []
+        last = None
+        while True:
+            d = s9.rx()
+            now = self._clock()
+            if echo_left and d:
+                dropped = min(echo_left, len(d))
+                echo_left -= dropped
+                d = d[dropped:]
+                if not echo_left:
+                    start = now
+                    end = start + deadline
+            if d:
+                if last is None:
+                    timeout.observe(now - start)
+                reply.extend(d)
+                last = now
+            elif last is None:
+                if now >= end:
+                    timeout.miss()
+                    return None
+                self._sleep(min(poll, end - now))
+            elif now - last >= gap:
+                return reply
+            else:
+                self._sleep(poll)
+
+    def snapshot(self):
+        '''Return the learned values for each address as a dict indexed by
+        address, with ``replies``, ``timeouts``, ``mean``, ``deviation``,
+        ``percentile`` and ``deadline`` - times in seconds, ``None`` when
+        nothing has been learned yet
+        '''
+        return {address: t.snapshot() for address, t in sorted(self.addresses.items())}
+
+    def prometheus(self, prefix="serial9"):
+        '''Return the learned values in the Prometheus text exposition format'''
+
+        lines = []
+        for name, kind in (("replies", "counter"), ("timeouts", "counter"),
+                           ("mean", "gauge"), ("deviation", "gauge"),
+                           ("percentile", "gauge"), ("deadline", "gauge")):
+            metric = f"{prefix}_reply_{name}" + ("_total" if "counter" == kind else "_seconds")
+            lines.append(f"# TYPE {metric} {kind}")
+            for address, values in self.snapshot().items():
+                if values[name] is not None:
+                    lines.append(f'{metric}{{address="0x{address:02x}"}} {values[name]:g}')
+
+        return "\n".join(lines) + "\n"
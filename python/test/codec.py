@@ -0,0 +1,241 @@
+# -----------------------------------------------------------------------------
+"""Workloads and every implementation of the escape protocol codec
+
+The escape protocol is implemented in the firmware state machine and in the
+Python library, and both directions have to agree. This module generates
+workload profiles and runs them through:
+
+- Python ``tx8()``/``tx9()``, ``encode()`` and ``tx_words()`` (host to device)
+- Python ``rx()`` (device to host)
+- The firmware, built for the host by ``test/host/build.sh``, in both
+  directions
+
+``test_codec.py`` checks them against each other. Run this file to get the
+throughput and overhead of each one::
+
+    sh test/host/build.sh
+    cd python && PYTHONPATH=. python test/codec.py
+"""
+# -----------------------------------------------------------------------------
+
+import os
+import sys
+import time
+import ctypes
+import random
+
+from serial9 import Serial9
+
+LIBRARY = os.path.join(os.path.dirname(__file__), "..", "..", "build", "libserial9_host.so")
+
+# -----------------------------------------------------------------------------
+def _crc16(data):
+    crc = 0xffff
+    for c in data:
+        crc ^= c
+        for i in range(8):
+            crc = (crc >> 1) ^ 0xa001 if crc & 1 else crc >> 1
+    return crc
+
+def all_8bit(rng, n):
+    return [rng.randrange(0x100) for i in range(n)]
+
+def dense_ff(rng, n):
+    return [rng.choice((0x0ff, 0x0ff, 0x0ff, 0x1ff, 0x000)) for i in range(n)]
+
+def dense_bit9(rng, n):
+    return [0x100 | rng.randrange(0x100) for i in range(n)]
+
+def mdb_frames(rng, n):
+    words = []
+    while len(words) < n:
+        frame = [0x100 | rng.randrange(0x08, 0x100, 0x08)] + all_8bit(rng, rng.randrange(0, 16))
+        words.extend(frame + [sum(frame) & 0xff])
+    return words[:n]
+
+def modbus_frames(rng, n):
+    words = []
+    while len(words) < n:
+        frame = [rng.randrange(1, 248), rng.choice((3, 4, 6, 16))] + all_8bit(rng, rng.randrange(2, 20))
+        crc = _crc16(frame)
+        words.extend(frame + [crc & 0xff, crc >> 8])
+    return words[:n]
+
+def random_words(rng, n):
+    return [rng.randrange(0x200) for i in range(n)]
+
+PROFILES = [
+    ("all 8 bit", all_8bit),
+    ("dense 0xff", dense_ff),
+    ("dense bit 9", dense_bit9),
+    ("MDB frames", mdb_frames),
+    ("Modbus frames", modbus_frames),
+    ("random", random_words),
+]
+
+def chunks(rng, d, largest=64):
+    '''Split ``d`` into random chunks of 1 to ``largest`` items'''
+    result = []
+    i = 0
+    while i < len(d):
+        n = rng.randint(1, largest)
+        result.append(d[i:i + n])
+        i += n
+    return result
+
+# -----------------------------------------------------------------------------
+class CaptureConn():
+    def __init__(self):
+        self.tx_data = bytearray()
+        self.rx_chunks = []
+
+    def tx(self, d):
+        self.tx_data += d
+
+    def rx(self):
+        return self.rx_chunks.pop(0) if self.rx_chunks else b""
+
+def py_tx8_tx9(words):
+    '''Encode with tx8() and tx9() for each run of words with the same bit 9'''
+    conn = CaptureConn()
+    s9 = Serial9(conn)
+    run = bytearray()
+    high = None
+    for w in words:
+        if (w >> 8) != high:
+            if run:
+                (s9.tx9 if high else s9.tx8)(bytes(run))
+            run = bytearray()
+            high = w >> 8
+        run.append(w & 0xff)
+    if run:
+        (s9.tx9 if high else s9.tx8)(bytes(run))
+    return bytes(conn.tx_data)
+
+def py_encode(words):
+    return Serial9.encode(words)
+
+def py_tx_words(words, pieces):
+    conn = CaptureConn()
+    s9 = Serial9(conn)
+    for piece in pieces:
+        s9.tx_words(piece)
+    return bytes(conn.tx_data)
+
+def py_rx(pieces):
+    conn = CaptureConn()
+    conn.rx_chunks = list(pieces)
+    s9 = Serial9(conn)
+    words = []
+    for piece in pieces:
+        words.extend(s9.rx())
+    return words
+
+# -----------------------------------------------------------------------------
+class Firmware():
+    '''The firmware state machine built for the host by ``test/host/build.sh``'''
+
+    def __init__(self, path=LIBRARY):
+        self._lib = ctypes.CDLL(path)
+        self._lib.s9_host_usb_out_length.restype = ctypes.c_size_t
+        self._lib.s9_host_bus_out_length.restype = ctypes.c_size_t
+
+    def host_to_bus(self, pieces):
+        '''Send escaped bytes from the host, return the words on the bus'''
+        lib = self._lib
+        lib.s9_host_begin(9600)
+        for piece in pieces:
+            lib.s9_host_usb_in(bytes(piece), ctypes.c_size_t(len(piece)))
+            lib.s9_host_run()
+        n = lib.s9_host_bus_out_length()
+        out = (ctypes.c_uint16 * n)()
+        lib.s9_host_bus_out(out, ctypes.c_size_t(n))
+        return list(out)
+
+    def begin(self, baud=9600):
+        self._lib.s9_host_begin(baud)
+
+    def usb_in(self, d):
+        '''Queue bytes from the host without running the firmware'''
+        self._lib.s9_host_usb_in(bytes(d), ctypes.c_size_t(len(d)))
+
+    def loop(self, count=1):
+        self._lib.s9_host_loop(count)
+
+    def usb_out(self):
+        '''Return and clear the bytes sent to the host so far'''
+        n = self._lib.s9_host_usb_out_length()
+        out = ctypes.create_string_buffer(n)
+        self._lib.s9_host_usb_out(out, ctypes.c_size_t(n))
+        return out.raw
+
+    def bus_out(self):
+        '''Return and clear the words sent on the bus so far'''
+        n = self._lib.s9_host_bus_out_length()
+        out = (ctypes.c_uint16 * n)()
+        self._lib.s9_host_bus_out(out, ctypes.c_size_t(n))
+        return list(out)
+
+    def bus_to_host(self, pieces):
+        '''Receive words from the bus, return the escaped bytes for the host'''
+        lib = self._lib
+        lib.s9_host_begin(9600)
+        for piece in pieces:
+            words = (ctypes.c_uint16 * len(piece))(*piece)
+            lib.s9_host_bus_in(words, ctypes.c_size_t(len(piece)))
+            lib.s9_host_run()
+        n = lib.s9_host_usb_out_length()
+        out = ctypes.create_string_buffer(n)
+        lib.s9_host_usb_out(out, ctypes.c_size_t(n))
+        return out.raw
+
+# -----------------------------------------------------------------------------
+def implementations(firmware=None):
+    '''Return ``(name, direction, function)`` for every codec
+
+    Encoders take ``(words, pieces of words)`` and return the escaped bytes,
+    decoders take ``(escaped bytes, pieces of escaped bytes)`` and return
+    the words.
+    '''
+
+    result = [
+        ("python tx8/tx9", "encode", lambda words, pieces: py_tx8_tx9(words)),
+        ("python encode", "encode", lambda words, pieces: py_encode(words)),
+        ("python tx_words", "encode", lambda words, pieces: py_tx_words(words, pieces)),
+        ("python rx", "decode", lambda data, pieces: py_rx(pieces)),
+    ]
+    if firmware is not None:
+        result += [
+            ("firmware bus to host", "encode", lambda words, pieces: firmware.bus_to_host(pieces)),
+            ("firmware host to bus", "decode", lambda data, pieces: firmware.host_to_bus(pieces)),
+        ]
+    return result
+
+def bench(n=100000, seed=9):
+    '''Print MB/s of escaped data and the overhead for every profile and codec'''
+
+    firmware = Firmware() if os.path.exists(LIBRARY) else None
+    if firmware is None:
+        print(f"{LIBRARY} not found, run test/host/build.sh for the firmware results")
+
+    print(f"{'profile':<14} {'codec':<22} {'MB/s':>8} {'overhead':>9}")
+    for profile, generate in PROFILES:
+        rng = random.Random(seed)
+        words = generate(rng, n)
+        encoded = Serial9.encode(words)
+        word_pieces = chunks(rng, words)
+        byte_pieces = chunks(rng, encoded)
+
+        for name, direction, codec in implementations(firmware):
+            start = time.perf_counter()
+            if "encode" == direction:
+                codec(words, word_pieces)
+            else:
+                codec(encoded, byte_pieces)
+            elapsed = time.perf_counter() - start
+            print(f"{profile:<14} {name:<22} {len(encoded) / elapsed / 1e6:>8.2f} "
+                  f"{len(encoded) / len(words):>9.3f}")
+
+# -----------------------------------------------------------------------------
+if __name__ == "__main__":
+    bench(int(sys.argv[1]) if len(sys.argv) > 1 else 100000)
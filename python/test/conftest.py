@@ -0,0 +1,62 @@
+import os
+import shutil
+import subprocess
+
+import pytest
+
+import codec
+
+REPO = os.path.join(os.path.dirname(__file__), "..", "..")
+
+class TestDevice():
+    # A connection that keeps what is sent and counts the writes, and
+    # returns what the test put in _rx_buffer once
+    __test__ = False
+
+    def __init__(self):
+        self._tx_buffer = b""
+        self._rx_buffer = b""
+        self.tx_calls = 0
+
+    def rx(self):
+        d = self._rx_buffer
+        self._rx_buffer = b""
+        return d
+
+    def tx(self, d):
+        self.tx_calls += 1
+        self._tx_buffer += d
+
+class FakeClock():
+    # Time that only moves when something sleeps
+
+    def __init__(self):
+        self.now = 100.0
+
+    def clock(self):
+        return self.now
+
+    def sleep(self, t):
+        self.now += t
+
+@pytest.fixture
+def test_device():
+    return TestDevice()
+
+@pytest.fixture
+def fake_clock():
+    return FakeClock()
+
+@pytest.fixture(scope="module")
+def firmware(tmp_path_factory):
+    # Build the firmware for the host the same way test/host/build.sh does
+    if shutil.which("g++") is None:
+        pytest.skip("g++ is needed to build the firmware for the host")
+
+    library = str(tmp_path_factory.mktemp("host") / "libserial9_host.so")
+    sources = ["test/host/serial9_host.cpp", "arduino/serial9/serial9.cpp",
+               "arduino/serial9/serial9_check.cpp", "arduino/serial9/serial9_mux.cpp"]
+    subprocess.run(["g++", "-O2", "-shared", "-fPIC", *sources,
+                    "-I", "test/host", "-I", "arduino/serial9", "-o", library],
+                   cwd=REPO, check=True)
+    return codec.Firmware(library)
@@ -0,0 +1,15 @@
+import pytest
+
+from serial9.benchmark import run
+
+def test_benchmark_calls_per_frame():
+    # Given: No initial conditions
+    # When: The transmit benchmark is run for 100 frames
+    # Then: tx9 + tx8 takes two writes per frame, tx_words one,
+    #       and with write combining all the frames go in one write
+    #
+    results = run(count=100)
+
+    assert [(name, calls) for name, calls, usec in results] == [("tx9 + tx8", 2.0),
+                                                                ("tx_words", 1.0),
+                                                                ("tx_words combined", 0.01)]
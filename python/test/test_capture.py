@@ -0,0 +1,117 @@
+import pytest
+
+from serial9.capture import CaptureWriter, CaptureReader
+
+def write_capture(path, pairs, chunk_records=4):
+    with CaptureWriter(path, chunk_records=chunk_records, grow_chunks=2) as writer:
+        for timestamp, word in pairs:
+            writer.append(timestamp, word)
+
+def test_empty_capture(tmp_path):
+    # Given: A capture file with no records
+    # When: The file is opened by a reader
+    # Then: There are no records and seeking returns the end
+    #
+    path = tmp_path / "empty.s9cap"
+    write_capture(path, [])
+
+    with CaptureReader(path) as reader:
+        assert 0 == len(reader)
+        assert [] == list(reader.records())
+        assert 0 == reader.seek_time(1000)
+
+def test_capture_round_trip(tmp_path):
+    # Given: A capture written across several chunks and file growth
+    # When: The file is read back
+    # Then: Every (timestamp, word) pair is returned in order
+    #
+    path = tmp_path / "trip.s9cap"
+    pairs = [(1000 + 10 * i, (i * 37) & 0x1ff) for i in range(23)]
+    write_capture(path, pairs)
+
+    with CaptureReader(path) as reader:
+        assert 23 == len(reader)
+        assert pairs == list(reader.records())
+        assert pairs[5:14] == list(reader.records(5, 14))
+
+def test_capture_seek_time(tmp_path):
+    # Given: A capture written across several chunks
+    # When: We seek to a time before, inside, between and after the records
+    # Then: We get the index of the first record at or after that time
+    #
+    path = tmp_path / "seek.s9cap"
+    pairs = [(1000 + 10 * i, i) for i in range(23)]
+    write_capture(path, pairs)
+
+    with CaptureReader(path) as reader:
+        assert 0 == reader.seek_time(0)
+        assert 0 == reader.seek_time(1000)
+        assert 9 == reader.seek_time(1090)
+        assert 10 == reader.seek_time(1095)
+        assert 22 == reader.seek_time(1220)
+        assert 23 == reader.seek_time(5000)
+        assert pairs[2:4] == list(reader.between(1020, 1040))
+
+def test_capture_find_address(tmp_path):
+    # Given: A capture with address words in some of the chunks
+    # When: We search for an address
+    # Then: We get the index and timestamp of every matching address word
+    #       and 8 bit data with the same value is not matched
+    #
+    path = tmp_path / "addr.s9cap"
+    words = [0x110, 0x01, 0x02, 0x03,
+             0x120, 0x10, 0x11, 0x12,
+             0x130, 0x04, 0x05, 0x06,
+             0x110, 0x07,]
+    pairs = [(100 * i, w) for i, w in enumerate(words)]
+    write_capture(path, pairs)
+
+    with CaptureReader(path) as reader:
+        assert [(0, 0), (12, 1200)] == list(reader.find_address(0x10))
+        assert [(12, 1200)] == list(reader.find_address(0x110, start=100))
+        assert [(0, 0)] == list(reader.find_address(0x10, stop=1200))
+        assert [] == list(reader.find_address(0x40))
+
+def test_capture_long_gap(tmp_path):
+    # Given: A capture with a gap too long for a record offset
+    # When: The file is read back
+    # Then: The records after the gap start a new chunk, the timestamps
+    #       are correct and the indices carry on from the part full chunk
+    #
+    path = tmp_path / "gap.s9cap"
+    pairs = [(0, 0x101), (1, 0x02), (0x100000000, 0x103), (0x100000001, 0x04),
+             (0x100000002, 0x05), (0x100000003, 0x06), (0x100000004, 0x107)]
+    write_capture(path, pairs)
+
+    with CaptureReader(path) as reader:
+        assert 7 == len(reader)
+        assert pairs == list(reader.records())
+        assert pairs[1:5] == list(reader.records(1, 5))
+        assert 2 == reader.seek_time(0x100000000)
+        assert 6 == reader.seek_time(0x100000004)
+        assert pairs[3:6] == list(reader.between(0x100000001, 0x100000004))
+        assert [(2, 0x100000000)] == list(reader.find_address(0x103, start=1))
+        assert [(6, 0x100000004)] == list(reader.find_address(0x107))
+
+def test_capture_append_many(tmp_path):
+    # Given: Pairs as returned by rx_timed(), some without a timestamp
+    # When: They are appended to the capture
+    # Then: The missing timestamps are filled in with the previous one
+    #
+    path = tmp_path / "many.s9cap"
+    with CaptureWriter(path) as writer:
+        writer.append_many([(None, 0x01), (50, 0x102), (None, 0x03)])
+
+    with CaptureReader(path) as reader:
+        assert [(0, 0x01), (50, 0x102), (50, 0x03)] == list(reader.records())
+
+def test_not_a_capture(tmp_path):
+    # Given: A file that is not a capture file
+    # When: The file is opened by a reader
+    # Then: A ValueError is raised
+    #
+    path = tmp_path / "bad.s9cap"
+    path.write_bytes(bytes(128))
+
+    with pytest.raises(ValueError):
+        CaptureReader(path)
@@ -0,0 +1,48 @@
+import random
+
+import pytest
+
+from serial9 import Serial9
+
+import codec
+
+def first_difference(a, b):
+    for i, (x, y) in enumerate(zip(a, b)):
+        if x != y:
+            return i
+    return min(len(a), len(b))
+
+@pytest.mark.parametrize("profile, generate", codec.PROFILES, ids=[p for p, g in codec.PROFILES])
+@pytest.mark.parametrize("seed", [1, 2, 3])
+def test_codecs_agree(firmware, profile, generate, seed):
+    # Given: A workload profile split into random chunks
+    # When: It is run through every encoder and decoder
+    # Then: Every encoder gives exactly the same escaped bytes
+    #       and every decoder gives back exactly the same words
+    #
+    rng = random.Random(seed)
+    words = generate(rng, 5000)
+    encoded = Serial9.encode(words)
+    word_pieces = codec.chunks(rng, words)
+    byte_pieces = codec.chunks(rng, encoded)
+
+    for name, direction, implementation in codec.implementations(firmware):
+        if "encode" == direction:
+            result = implementation(words, word_pieces)
+            expected = encoded
+        else:
+            result = implementation(encoded, byte_pieces)
+            expected = words
+
+        assert result == expected, (f"{name} differs at {first_difference(result, expected)} "
+                                    f"of {len(expected)}")
+
+def test_firmware_single_byte_chunks(firmware):
+    # Given: Escape sequences that arrive one byte at a time
+    # When: The firmware decodes them
+    # Then: The state machine carries the escapes across the chunks
+    #
+    words = [0x0ff, 0x1ff, 0x101, 0x0ff, 0x001]
+    encoded = Serial9.encode(words)
+
+    assert words == firmware.host_to_bus([encoded[i:i + 1] for i in range(len(encoded))])
@@ -0,0 +1,103 @@
+import pytest
+
+from serial9 import Serial9
+from serial9.metrics import Histogram, Metrics
+
+def test_histogram():
+    # Given: A histogram with bounds 1, 10 and 100
+    # When: Values in each bucket and above the last bound are observed
+    # Then: The snapshot has cumulative counts, the count and the sum
+    #
+    h = Histogram((1, 10, 100))
+
+    for value in (0, 1, 5, 10, 50, 1000):
+        h.observe(value)
+
+    assert h.snapshot() == {"count": 6, "sum": 1066,
+                            "buckets": [(1, 2), (10, 4), (100, 5), (float("inf"), 6)]}
+
+def test_serial9_metrics(test_device):
+    # Given: Serial9 instance with metrics
+    # When: A frame to address 0x30 is sent, an empty poll is made,
+    #       the echo of the frame comes back and then the reply arrives
+    # Then: The bytes per call, the encode and decode times
+    #       and the reply latency for address 0x30 are recorded, once
+    #       the echo is out of the way
+    #
+    metrics = Metrics()
+    s9 = Serial9(test_device, metrics=metrics)
+
+    s9.tx_words([0x130, 0x01, 0x02])
+    assert [] == s9.rx()
+    test_device._rx_buffer = bytes([0xff, 0x01, 0x30, 0x01])
+    assert [0x130, 0x01] == s9.rx()
+    assert {} == metrics.reply_latency_seconds
+    test_device._rx_buffer = bytes([0x02, 0x00])
+    assert [0x02, 0x00] == s9.rx()
+
+    snapshot = metrics.snapshot()
+    assert snapshot["tx_bytes"]["count"] == 1
+    assert snapshot["tx_bytes"]["sum"] == 5
+    assert snapshot["rx_bytes"]["count"] == 3
+    assert snapshot["rx_bytes"]["sum"] == 6
+    assert snapshot["encode_ns_per_byte"]["count"] == 1
+    assert snapshot["decode_ns_per_byte"]["count"] == 2
+    assert list(snapshot["reply_latency_seconds"]) == [0x30]
+    assert snapshot["reply_latency_seconds"][0x30]["count"] == 1
+
+    # When: A frame is sent as tx9() then tx8()
+    # Then: The words of both are part of the echo
+    #
+    s9.tx9(b"\x31")
+    s9.tx8(b"\x01")
+    test_device._rx_buffer = bytes([0xff, 0x01, 0x31])
+    s9.rx()
+    assert sorted(metrics.reply_latency_seconds) == [0x30]
+    test_device._rx_buffer = bytes([0x01, 0x00])
+    s9.rx()
+    assert sorted(metrics.reply_latency_seconds) == [0x30, 0x31]
+    assert metrics.encode_ns_per_byte.count == 3
+
+    # When: The bus is full duplex
+    # Then: There is no echo, the first word back is the reply
+    #
+    s9.full_duplex()
+    s9.tx9(b"\x32")
+    test_device._rx_buffer = bytes([0x00])
+    s9.rx()
+    assert sorted(metrics.reply_latency_seconds) == [0x30, 0x31, 0x32]
+
+def test_serial9_without_metrics(test_device):
+    # Given: Serial9 instance without metrics
+    # When: A frame is sent
+    # Then: No request is tracked
+    #
+    s9 = Serial9(test_device)
+
+    s9.tx_words([0x130, 0x01])
+    s9.tx9(b"\x31")
+
+    assert s9._request is None
+
+def test_prometheus():
+    # Given: Metrics with one reply latency for address 0x30
+    # When: The metrics are exported in Prometheus format
+    # Then: Each histogram has cumulative buckets, a sum and a count
+    #       and the latency is labelled with the address
+    #
+    metrics = Metrics()
+    metrics.tx_bytes.observe(5)
+    metrics.observe_latency(0x30, 0.003)
+
+    text = metrics.prometheus().split("\n")
+
+    assert "# TYPE serial9_tx_bytes histogram" in text
+    assert 'serial9_tx_bytes_bucket{le="4"} 0' in text
+    assert 'serial9_tx_bytes_bucket{le="16"} 1' in text
+    assert 'serial9_tx_bytes_bucket{le="+Inf"} 1' in text
+    assert "serial9_tx_bytes_sum 5" in text
+    assert "serial9_tx_bytes_count 1" in text
+    assert 'serial9_reply_latency_seconds_bucket{address="0x30",le="0.002"} 0' in text
+    assert 'serial9_reply_latency_seconds_bucket{address="0x30",le="0.005"} 1' in text
+    assert 'serial9_reply_latency_seconds_sum{address="0x30"} 0.003' in text
+    assert 'serial9_reply_latency_seconds_count{address="0x30"} 1' in text
@@ -0,0 +1,103 @@
+import pytest
+
+from serial9 import Serial9
+from serial9.mux import Mux
+
+def test_mux_tx(test_device):
+    # Given: A Mux with a Serial9 on channels 0 and 1
+    # When: Data is sent on channel 0, then 1, then 1 again, then 0
+    # Then: A channel select goes first to start with
+    #       and whenever the channel changes
+    #
+    mux = Mux(test_device, 2)
+    bus0 = Serial9(mux.channel(0))
+    bus1 = Serial9(mux.channel(1))
+
+    bus0.tx8(b"\x01")
+    bus1.tx9(b"\x02")
+    bus1.tx8(b"\xff")
+    bus0.set_baud(Serial9.SERIAL_9_BAUD_19200)
+
+    assert test_device._tx_buffer == bytes([0xff, 0x60, 0x01,
+                                            0xff, 0x61, 0xff, 0x01, 0x02,
+                                            0xff, 0xff,
+                                            0xff, 0x60, 0xff, 0x16])
+
+def test_mux_tx_holds_partial_sequence(test_device):
+    # Given: A Mux with credit flow control on channel 1
+    # When: The credit runs out in the middle of an escape sequence
+    #       and channel 0 sends in the meantime
+    # Then: The partial sequence is held back until it is complete
+    #       so the channel select does not split it
+    #
+    mux = Mux(test_device, 2)
+    bus0 = Serial9(mux.channel(0))
+    bus1 = Serial9(mux.channel(1))
+
+    bus1.credit_on()
+    test_device._rx_buffer = bytes([0xff, 0x61, 0xff, 0x52, 0x02])
+    bus1.rx()
+    bus1.tx9(b"\x10")
+
+    assert test_device._tx_buffer == bytes([0xff, 0x61, 0xff, 0x50])
+
+    bus0.tx8(b"\x20")
+    test_device._rx_buffer = bytes([0xff, 0x52, 0x01])
+    bus1.rx()
+
+    assert test_device._tx_buffer == bytes([0xff, 0x61, 0xff, 0x50,
+                                            0xff, 0x60, 0x20,
+                                            0xff, 0x61, 0xff, 0x01, 0x10])
+
+def test_mux_resync(test_device):
+    # Given: A new Mux on an adapter that was left on channel 2 for both
+    #        directions by an earlier host
+    # When: Channel 0 sends, and the adapter answers the channel select
+    #       with its own before sending data from channel 2
+    # Then: The data sent is selected for channel 0 and the data received
+    #       goes to channel 2
+    #
+    mux = Mux(test_device)
+    bus0 = Serial9(mux.channel(0))
+    bus2 = Serial9(mux.channel(2))
+
+    bus0.tx8(b"\x01")
+    assert test_device._tx_buffer == bytes([0xff, 0x60, 0x01])
+
+    test_device._rx_buffer = bytes([0xff, 0x62, 0x05])
+    assert [] == bus0.rx()
+    assert [0x05] == bus2.rx()
+
+def test_mux_rx(test_device):
+    # Given: A Mux with a Serial9 on channels 0 and 1
+    # When: The adapter sends data for both channels
+    #       including records whose payload looks like a channel select
+    # Then: Each channel gets only its own data
+    #       and the channel select is not passed on
+    #
+    mux = Mux(test_device, 2)
+    bus0 = Serial9(mux.channel(0))
+    bus1 = Serial9(mux.channel(1))
+
+    test_device._rx_buffer = bytes([0x01, 0xff, 0x01, 0xff,
+                                    0xff, 0x61, 0x02, 0xff, 0x22, 0xff, 0x60, 0x00, 0x00, 0x03,
+                                    0xff, 0x60, 0xff, 0xff])
+
+    assert [0x01, 0x1ff, 0xff] == bus0.rx()
+    assert [0x02, 0x03] == bus1.rx()
+
+def test_mux_rx_timed(test_device):
+    # Given: A Mux with a Serial9 on channels 0 and 1
+    # When: The adapter sends a timestamp record on channel 1
+    #       whose payload looks like a channel select
+    # Then: The timestamp goes to channel 1
+    #
+    mux = Mux(test_device, 2)
+    bus0 = Serial9(mux.channel(0))
+    bus1 = Serial9(mux.channel(1))
+
+    test_device._rx_buffer = bytes([0xff, 0x61, 0xff, 0x22, 0xff, 0x60, 0x00, 0x00, 0x03,
+                                    0xff, 0x60, 0x04])
+
+    assert [(0x60ff, 0x03)] == bus1.rx_timed()
+    assert [0x04] == bus0.rx()
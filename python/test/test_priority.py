@@ -0,0 +1,73 @@
+import pytest
+
+from serial9 import Serial9
+
+# Bulk frames are FRAME words long, the priority frame words are never
+# used in the bulk frames
+FRAME = 8
+URGENT = [0x1c0, 0x0c1]
+
+# The firmware grants its whole 128 byte queue, less the priority reserve
+GRANT = 128 - 8
+
+class FirmwareConn():
+    '''A ``conn`` device for the firmware built for the host'''
+
+    def __init__(self, firmware):
+        self._firmware = firmware
+
+    def tx(self, d):
+        self._firmware.usb_in(d)
+
+    def rx(self):
+        return self._firmware.usb_out()
+
+def bulk_frames(count):
+    return [[0x100 | (k & 0x3f)] + [(k + i) & 0x3f for i in range(1, FRAME)] for k in range(count)]
+
+# Each bulk frame is FRAME + 4 bytes over USB, with the escape for the
+# address and the FRAME_END - try every one of them, three frames over
+@pytest.mark.parametrize("offset", range(3 * (FRAME + 4)))
+def test_priority_latency(firmware, offset):
+    # Given: The firmware with credit flow control on and a saturated bulk
+    #        lane - far more 8 word frames queued on the host than it has
+    #        credit for
+    # When: A priority frame is sent at every point in a bulk frame
+    # Then: No more than the rest of one bulk frame goes out ahead of it,
+    #       the bulk frames are unchanged and in order
+    #       and every byte of credit comes back
+    #
+    firmware.begin()
+    s9 = Serial9(FirmwareConn(firmware))
+    bus = []
+
+    def step():
+        firmware.loop()
+        s9.rx()
+        bus.extend(firmware.bus_out())
+
+    s9.credit_on()
+    frames = bulk_frames(100)
+    for frame in frames:
+        s9.tx_words(frame)
+        s9.frame_end()
+
+    # Run until the firmware queue is full and the bus busy, then a
+    # little further so the priority frame lands everywhere in a frame
+    for i in range(200 + offset):
+        step()
+    sent = len(bus)
+    backlog = s9.backlog
+
+    s9.tx_priority(URGENT)
+    while (s9.backlog > 0) or (len(bus) < 100 * FRAME + len(URGENT)):
+        step()
+    for i in range(10):
+        step()
+
+    urgent = bus.index(URGENT[0])
+    assert URGENT == bus[urgent:urgent + len(URGENT)]
+    assert urgent - sent <= FRAME - 1
+    assert [w for frame in frames for w in frame] == bus[:urgent] + bus[urgent + len(URGENT):]
+    assert 0 < backlog
+    assert GRANT == s9.credit
@@ -0,0 +1,88 @@
+import pytest
+
+from serial9 import Serial9
+from serial9.replay import frames, Replay
+
+class SlowDevice():
+    # Every write takes write_time seconds of the fake clock
+
+    def __init__(self, fake_clock, write_time=0.0):
+        self._clock = fake_clock
+        self._write_time = write_time
+        self.writes = []
+
+    def tx(self, d):
+        self.writes.append((self._clock.now, d))
+        self._clock.now += self._write_time
+
+def test_frames_split_on_address():
+    # Given: Captured words with bit 9 high at the start of each frame
+    # When: The words are split into frames
+    # Then: Each frame starts at an address word
+    #
+    pairs = [(0, 0x01), (10, 0x110), (20, 0x02), (30, 0x03), (40, 0x120), (50, 0x04)]
+
+    assert [(0, [0x01]), (10, [0x110, 0x02, 0x03]), (40, [0x120, 0x04])] == frames(pairs)
+
+def test_frames_split_on_gap():
+    # Given: Captured 8 bit words with a quiet period
+    # When: The words are split into frames with a gap limit
+    # Then: A new frame starts after the quiet period
+    #
+    pairs = [(0, 0x01), (10, 0x02), (500, 0x03), (510, 0x04)]
+
+    assert [(0, [0x01, 0x02]), (500, [0x03, 0x04])] == frames(pairs, gap=100)
+    assert [(0, [0x01, 0x02, 0x03, 0x04])] == frames(pairs)
+
+def test_replay_timing_and_batching(fake_clock):
+    # Given: Three frames, the first two within the batch window
+    # When: They are replayed at 1x and at 10x speed
+    # Then: The first two frames are sent in one write
+    #       and each write happens at its scheduled time with no drift
+    #
+    device = SlowDevice(fake_clock)
+    r = Replay(Serial9(device), [(0, [0x110, 0xff]), (1000, [0x120]), (100000, [0x130, 0x01])],
+               clock=fake_clock.clock, sleep=fake_clock.sleep, spin=0)
+
+    report = r.run(1)
+
+    assert [(100.0, b"\xff\x01\x10\xff\xff\xff\x01\x20"),
+            (100.1, b"\xff\x01\x30\x01")] == [(round(t, 6), d) for t, d in device.writes]
+    assert 3 == report.frames
+    assert 2 == report.writes
+    assert 12 == report.bytes
+    assert report.max_drift < 1e-9
+
+    device.writes = []
+    start = fake_clock.now
+    report = r.run(10)
+
+    assert pytest.approx(0.01) == device.writes[1][0] - start
+    assert report.max_drift < 1e-9
+
+def test_replay_drift(fake_clock):
+    # Given: A device that takes longer to write than the frame spacing
+    # When: The frames are replayed
+    # Then: The drift grows with every write
+    #
+    device = SlowDevice(fake_clock, write_time=0.015)
+    r = Replay(Serial9(device), [(10000 * i, [0x100 + i]) for i in range(4)],
+               clock=fake_clock.clock, sleep=fake_clock.sleep, spin=0)
+
+    report = r.run(1)
+
+    assert [0.0, 0.005, 0.010, 0.015] == [round(d, 6) for d in report.drift]
+    assert pytest.approx(0.015) == report.final_drift
+    assert pytest.approx(0.0075) == report.mean_drift
+
+def test_replay_nothing(fake_clock):
+    # Given: No frames
+    # When: They are replayed
+    # Then: Nothing is written
+    #
+    device = SlowDevice(fake_clock)
+    report = Replay(Serial9(device), [], clock=fake_clock.clock, sleep=fake_clock.sleep, spin=0).run(2)
+
+    assert [] == device.writes
+    assert 0 == report.writes
+    assert 0.0 == report.max_drift
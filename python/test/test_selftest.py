@@ -0,0 +1,57 @@
+import pytest
+
+from serial9 import Serial9
+from serial9.selftest import sweep, capacity_table
+
+class FakeSelfTest():
+    # Records the baud rate changes and returns a canned result for each
+
+    def __init__(self, results):
+        self._results = results
+        self.bauds = []
+
+    def set_baud(self, baud):
+        self.bauds.append(baud)
+
+    def self_test(self, count, mix, timeout):
+        return self._results.pop(0)
+
+def test_sweep():
+    # Given: A target that passes at 9600 and times out at 115200
+    # When: The self test is swept over both baud rates
+    # Then: The baud rate escape codes are sent in order
+    #       and each result is paired with its baud rate
+    #
+    good = {"words": 1000, "errors": 0, "longest_run": 1000,
+            "elapsed_us": 2000000, "words_per_second": 500.0}
+    s9 = FakeSelfTest([good, None])
+
+    results = sweep(s9, [9600, 115200])
+
+    assert s9.bauds == [Serial9.SERIAL_9_BAUD_9600, Serial9.SERIAL_9_BAUD_115200]
+    assert results == [(9600, good), (115200, None)]
+
+def test_sweep_all_bauds():
+    # Given: A target that always times out
+    # When: The self test is swept without a list of baud rates
+    # Then: Every supported baud rate is tested, slowest first
+    #
+    s9 = FakeSelfTest([None] * len(Serial9.BAUD_CODES))
+
+    results = sweep(s9)
+
+    assert [baud for baud, r in results] == sorted(Serial9.BAUD_CODES)
+
+def test_capacity_table():
+    # Given: Sweep results for one good and one timed out baud rate
+    # When: The capacity table is formatted
+    # Then: The usage is the measured rate over baud / 11
+    #
+    good = {"words": 1000, "errors": 3, "longest_run": 600,
+            "elapsed_us": 2000000, "words_per_second": 436.4}
+
+    lines = capacity_table([(9600, good), (115200, None)]).split("\n")
+
+    assert lines[0].split() == ["baud", "words", "errors", "longest", "words/s", "max/s", "usage"]
+    assert lines[1].split() == ["9600", "1000", "3", "600", "436.4", "872.7", "50.0%"]
+    assert lines[2].split() == ["115200", "timed", "out"]
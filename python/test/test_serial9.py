@@ -3,21 +3,6 @@ import pytest
 
 from serial9 import Serial9
 
-class TestDevice():
-    __test__ = False
-
-    def __init__(self):
-        self._tx_buffer = b""
-        self._rx_buffer = b""
-
-    def rx(self):
-        d = self._rx_buffer
-        self._rx_buffer = b""
-        return d
-
-    def tx(self, d):
-        self._tx_buffer += d
-
 def test_initialization_with_no_connection():
     # Given: No initial conditions
     # When: A Serial9 instance is created with no connection device
@@ -82,27 +67,24 @@ def test_rx_with_no_connection():
 
     assert result_list == s9.rx()
 
-def test_initialization_with_test_device():
+def test_initialization_with_test_device(test_device):
     # Given: No initial conditions
     # When: A Serial9 instance is created with a test device
     # Then: The default connection is the test device
     #       and the initial state is SERIAL9_STATE_IDLE
     #       and the loopback buffer is empty
     #
-    test_device = TestDevice()
-
     s9 = Serial9(test_device)
 
     assert s9._conn == test_device
     assert s9._rx_state == Serial9.SERIAL9_STATE_IDLE
     assert s9._loopback_buffer == b""
 
-def test_tx8_empty_string():
+def test_tx8_empty_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a null string as 8 bit data
     # Then: The test device data buffer has a null string.
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([])
@@ -112,12 +94,11 @@ def test_tx8_empty_string():
     s9.tx8(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx8_not_ff_string():
+def test_tx8_not_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with NO 0xff character as 8 bit data
     # Then: The test device data buffer contains the same string
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([c for c in range(0,0xff)])
@@ -127,13 +108,12 @@ def test_tx8_not_ff_string():
     s9.tx8(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx8_single_ff_string():
+def test_tx8_single_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with a single 0xff character as 8 bit data
     # Then: The test device data buffer contains the same string with each
     #       0xff character replaced by two 0xff characters.
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff])
@@ -143,14 +123,13 @@ def test_tx8_single_ff_string():
     s9.tx8(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx8_leading_ff_string():
+def test_tx8_leading_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with a single 0xff character followed
     #       by many non 0xff characters as 8 bit data
     # Then: The test device data buffer contains the same string with each
     #       0xff character replaced by two 0xff characters.
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff] + [c for c in range(0,0xff)])
@@ -160,14 +139,13 @@ def test_tx8_leading_ff_string():
     s9.tx8(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx8_trailing_ff_string():
+def test_tx8_trailing_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with many non 0xff characters followed
     #       by a single 0xff character as 8 bit data
     # Then: The test device data buffer contains the same string with each
     #       0xff character replaced by two 0xff characters.
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([c for c in range(0,0x100)])
@@ -177,14 +155,13 @@ def test_tx8_trailing_ff_string():
     s9.tx8(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx8_alternating_ff_string():
+def test_tx8_alternating_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with leading, trailing, and every other
     #       character an 0xff as 8 bit data
     # Then: The test device data buffer contains the same string with each
     #       0xff character replaced by two 0xff characters.
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0x00, 0xff, 0x01, 0xff, 0x11, 0xff,])
@@ -194,13 +171,12 @@ def test_tx8_alternating_ff_string():
     s9.tx8(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx8_all_ff_string():
+def test_tx8_all_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with all 0xff as 8 bit data
     # Then: The test device data buffer contains the same string with each
     #       0xff character replaced by two 0xff characters.
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0xff, 0xff, 0xff,])
@@ -210,25 +186,23 @@ def test_tx8_all_ff_string():
     s9.tx8(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx9_empty_string():
+def test_tx9_empty_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a null string as 9 bit data
     # Then: The test device data buffer has a null string.
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     assert b"" == test_device._tx_buffer
     s9.tx9(b"")
     assert b"" == test_device._tx_buffer
 
-def test_tx9_single_not_ff_string():
+def test_tx9_single_not_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with NO 0xff character as 9 bit data
     # Then: The test device data buffer contains the same string with
     #       every byte prefixed by 0xff 0x01
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0x80])
@@ -238,13 +212,12 @@ def test_tx9_single_not_ff_string():
     s9.tx9(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx9_multiple_not_ff_string():
+def test_tx9_multiple_not_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with NO 0xff character as 9 bit data
     # Then: The test device data buffer contains the same string with
     #       every byte prefixed by 0xff 0x01
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0x00, 0x01, 0x02, 0xfe])
@@ -254,13 +227,12 @@ def test_tx9_multiple_not_ff_string():
     s9.tx9(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx9_long_not_ff_string():
+def test_tx9_long_not_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a long string with NO 0xff character as 9 bit data
     # Then: The test device data buffer contains the same string with
     #       every byte prefixed by 0xff 0x01
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([c for c in range(0,255)])
@@ -272,13 +244,12 @@ def test_tx9_long_not_ff_string():
     s9.tx9(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx9_single_ff_string():
+def test_tx9_single_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with a single 0xff character as 9 bit data
     # Then: The test device data buffer contains the same string with
     #       every byte replaced by 0xff 0x01 0xff 
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff])
@@ -288,14 +259,13 @@ def test_tx9_single_ff_string():
     s9.tx9(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx9_leading_ff_string():
+def test_tx9_leading_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with a single 0xff character followed
     #       by many non 0xff characters as 9 bit data
     # Then: The test device data buffer contains the same string with
     #       every byte replaced by 0xff 0x01 0xff 
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0x01, 0x02, 0x03,])
@@ -305,14 +275,13 @@ def test_tx9_leading_ff_string():
     s9.tx9(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx9_trailing_ff_string():
+def test_tx9_trailing_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with many non 0xff characters followed
     #       by a single 0xff character as 8 bit data
     # Then: The test device data buffer contains the same string with
     #       every byte replaced by 0xff 0x01 0xff 
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0x01, 0x02, 0x03, 0xff,])
@@ -322,14 +291,13 @@ def test_tx9_trailing_ff_string():
     s9.tx9(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx9_alternating_ff_string():
+def test_tx9_alternating_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with leading, trailing, and every other
     #       character an 0xff as 9 bit data
     # Then: The test device data buffer contains the same string with
     #       every byte replaced by 0xff 0x01 0xff 
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0x00, 0xff, 0x01, 0xff, 0x11, 0xff,])
@@ -342,13 +310,12 @@ def test_tx9_alternating_ff_string():
     s9.tx9(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_tx9_all_ff_string():
+def test_tx9_all_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: We transmit a string with all 0xff as 8 bit data
     # Then: The test device data buffer contains the same string with
     #       every byte replaced by 0xff 0x01 0xff 
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0xff, 0xff, 0xff,])
@@ -359,13 +326,12 @@ def test_tx9_all_ff_string():
     s9.tx9(test_string)
     assert result_string == test_device._tx_buffer
 
-def test_rx_empty_string():
+def test_rx_empty_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The test device has a null string in the buffer
     # Then: We recieve an empty list
     #       and the state is SERIAL9_STATE_IDLE
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = b""
@@ -375,13 +341,12 @@ def test_rx_empty_string():
     assert result_bytes == s9.rx()
     assert s9._rx_state == Serial9.SERIAL9_STATE_IDLE
 
-def test_rx_not_ff_8bit_string():
+def test_rx_not_ff_8bit_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The test device has a non ff string in the buffer
     # Then: We receive the same string as a list of 8 bit values
     #       and the state is SERIAL9_STATE_IDLE
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([c for c in range(0,0xff)])
@@ -391,13 +356,12 @@ def test_rx_not_ff_8bit_string():
     assert result_bytes == s9.rx()
     assert s9._rx_state == Serial9.SERIAL9_STATE_IDLE
 
-def test_rx_single_ff_string():
+def test_rx_single_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The test device has just ff string in the buffer
     # Then: We recieve an empty list
     #       and the state is SERIAL9_STATE_ESCAPE
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff])
@@ -407,13 +371,12 @@ def test_rx_single_ff_string():
     assert result_bytes == s9.rx()
     assert s9._rx_state == Serial9.SERIAL9_STATE_ESCAPE
 
-def test_rx_single_ff_01_string():
+def test_rx_single_ff_01_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The test device has just ff 01 string in the buffer
     # Then: We recieve an empty list
     #       and the state is SERIAL9_STATE_HIGH
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0x01])
@@ -423,13 +386,12 @@ def test_rx_single_ff_01_string():
     assert result_bytes == s9.rx()
     assert s9._rx_state == Serial9.SERIAL9_STATE_HIGH
 
-def test_rx_single_ff_01_00_string():
+def test_rx_single_ff_01_00_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The test device has just ff 01 string in the buffer
     # Then: We recieve 0x00 with the 9th bit high
     #       and the state is SERIAL9_STATE_IDLE
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0x01, 0x00])
@@ -439,13 +401,12 @@ def test_rx_single_ff_01_00_string():
     assert result_bytes == s9.rx()
     assert s9._rx_state == Serial9.SERIAL9_STATE_IDLE
 
-def test_rx_single_ff_ff_string():
+def test_rx_single_ff_ff_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The test device has just ff ff string in the buffer
     # Then: We recieve 0xff
     #       and the state is SERIAL9_STATE_IDLE
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0xff])
@@ -455,13 +416,12 @@ def test_rx_single_ff_ff_string():
     assert result_bytes == s9.rx()
     assert s9._rx_state == Serial9.SERIAL9_STATE_IDLE
 
-def test_rx_single_ff_02_unhandled_escape_string():
+def test_rx_single_ff_02_unhandled_escape_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The test device has just ff 02 string in the buffer
     # Then: We recieve an empty list
     #       and the state is SERIAL9_STATE_IDLE
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0x02])
@@ -471,14 +431,13 @@ def test_rx_single_ff_02_unhandled_escape_string():
     assert result_bytes == s9.rx()
     assert s9._rx_state == Serial9.SERIAL9_STATE_IDLE
 
-def test_rx_multi_byte_9_bit_string():
+def test_rx_multi_byte_9_bit_string(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The test device has a multi-byte 9 bit string in the buffer
     # Then: We recieve the bytes with 9th bit high
     #       and the state is SERIAL9_STATE_IDLE
     #
     # Note thos 
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0xff, 0x01, 0x00, 0xff, 0x01, 0x055,
@@ -489,7 +448,7 @@ def test_rx_multi_byte_9_bit_string():
     assert result_bytes == s9.rx()
     assert s9._rx_state == Serial9.SERIAL9_STATE_IDLE
 
-def test_rx_bad_state():
+def test_rx_bad_state(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The test device has one or more characters in the buffer
     #       and the rx state is invlaid (for whatever reason)
@@ -498,7 +457,6 @@ def test_rx_bad_state():
     #       and the state is SERIAL9_STATE_IDLE
     #
     # Note thos 
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     test_string = bytes([0x00, 0x01, 0x02,])
@@ -510,17 +468,461 @@ def test_rx_bad_state():
     assert result_bytes == s9.rx()
     assert s9._rx_state == Serial9.SERIAL9_STATE_IDLE
 
-def test_set_baud():
+def test_set_baud(test_device):
     # Given: Serial9 instance initialized with a TestDevice
     # When: The function is called with ANY integer value
     # Then: The test device data buffer contains a 2 character
     #       string that is 0xff and the integer (mod 256)
     #
-    test_device = TestDevice()
     s9 = Serial9(test_device)
 
     result_string = bytes([0xff, 0x17])
 
     s9.set_baud(Serial9.SERIAL_9_BAUD_38400)
 
-    assert result_string == test_device._tx_buffer
\ No newline at end of file
+    assert result_string == test_device._tx_buffer
+def test_sniff_start_stop(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: We start and then stop sniff mode
+    # Then: The test device data buffer contains the two escape sequences
+    #
+    s9 = Serial9(test_device)
+
+    s9.sniff_start()
+    s9.sniff_stop()
+
+    assert bytes([0xff, 0x20, 0xff, 0x21]) == test_device._tx_buffer
+
+def test_full_duplex(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: We switch to full duplex and back
+    # Then: The test device data buffer contains the two escape sequences
+    #
+    s9 = Serial9(test_device)
+
+    s9.full_duplex()
+    s9.full_duplex(False)
+
+    assert bytes([0xff, 0xa0, 0xff, 0xa1]) == test_device._tx_buffer
+
+def test_rx_timed_timestamp_records(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: The test device has words preceded by TIMESTAMP records
+    # Then: Each word is returned with its timestamp
+    #       and the records are not returned as data
+    #
+    s9 = Serial9(test_device)
+
+    test_device._rx_buffer = bytes([0xff, 0x22, 0x78, 0x56, 0x34, 0x12, 0xff, 0x01, 0x42,
+                                    0xff, 0x22, 0x79, 0x56, 0x34, 0x12, 0xff, 0xff,
+                                    0x55,])
+
+    assert [(0x12345678, 0x142), (0x12345679, 0xff), (0x12345679, 0x55)] == s9.rx_timed()
+    assert s9._rx_state == Serial9.SERIAL9_STATE_IDLE
+
+def test_rx_timestamp_record_split(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: A TIMESTAMP record is split across two reads
+    #       and the payload contains ESCAPE characters
+    # Then: The payload is not treated as escaped data
+    #
+    s9 = Serial9(test_device)
+
+    test_device._rx_buffer = bytes([0xff, 0x22, 0xff, 0xff])
+    assert [] == s9.rx()
+    assert s9._rx_state == Serial9.SERIAL9_STATE_RECORD
+
+    test_device._rx_buffer = bytes([0x01, 0x00, 0x10])
+    assert [(0x0001ffff, 0x10)] == s9.rx_timed()
+
+def test_rx_timestamp_wraps(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: The firmware timestamp wraps around
+    # Then: The returned timestamp keeps counting up
+    #
+    s9 = Serial9(test_device)
+
+    test_device._rx_buffer = bytes([0xff, 0x22, 0xf0, 0xff, 0xff, 0xff, 0x01,
+                                    0xff, 0x22, 0x10, 0x00, 0x00, 0x00, 0x02,])
+
+    assert [(0xfffffff0, 0x01), (0x100000010, 0x02)] == s9.rx_timed()
+
+def test_encode():
+    # Given: No initial conditions
+    # When: A list of 8 and 9 bit words is encoded
+    # Then: The result is the same as tx8() and tx9() would send
+    #
+    words = [0x100, 0x00, 0xff, 0x1ff, 0x01, 0xfe, 0x101]
+    result_string = bytes([0xff, 0x01, 0x00, 0x00, 0xff, 0xff, 0xff, 0x01, 0xff,
+                           0x01, 0xfe, 0xff, 0x01, 0x01])
+
+    assert result_string == Serial9.encode(words)
+    assert b"" == Serial9.encode([])
+
+def test_tx_encoded(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: We send already escaped data
+    # Then: The test device data buffer contains the data unchanged
+    #
+    s9 = Serial9(test_device)
+
+    s9.tx_encoded(bytes([0xff, 0x01, 0x10, 0x20]))
+
+    assert bytes([0xff, 0x01, 0x10, 0x20]) == test_device._tx_buffer
+
+def test_tx_encoded_with_no_connection():
+    # Given: No initial conditions
+    # When: A Serial9 instance is created with no connection device
+    #       and we send already escaped data
+    # Then: The loopback buffer has the transmitted data
+    #
+    s9 = Serial9()
+
+    s9.tx_encoded(bytes([0xff, 0xff]))
+
+    assert bytes([0xff, 0xff]) == s9._loopback_buffer
+
+def test_check_commands(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: We select the frame checks, end a frame and set the delivery mode
+    # Then: The test device data buffer contains the escape sequences
+    #
+    s9 = Serial9(test_device)
+
+    s9.set_check(Serial9.SERIAL9_CHECK_CRC)
+    s9.check_end()
+    s9.deliver_good_only()
+    s9.deliver_good_only(False)
+    s9.set_check(Serial9.SERIAL9_CHECK_OFF)
+
+    assert bytes([0xff, 0x32, 0xff, 0x33, 0xff, 0x35, 0xff, 0x34, 0xff, 0x30]) == test_device._tx_buffer
+
+def test_rx_frames(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: The test device has a good frame, a bad frame and part of a frame
+    #       each followed by a CHECK_RESULT record
+    # Then: We receive the complete frames with their check result
+    #       and the partial frame is completed by the next read
+    #
+    s9 = Serial9(test_device)
+
+    test_device._rx_buffer = bytes([0xff, 0x01, 0x10, 0x20, 0x30, 0xff, 0x36, 0x00,
+                                    0x01, 0xff, 0xff, 0xff, 0x36, 0x01,
+                                    0x02, 0x03,])
+
+    assert [(True, [0x110, 0x20, 0x30]), (False, [0x01, 0xff])] == s9.rx_frames()
+
+    test_device._rx_buffer = bytes([0x05, 0xff, 0x36])
+    assert [] == s9.rx_frames()
+
+    test_device._rx_buffer = bytes([0x00])
+    assert [(True, [0x02, 0x03, 0x05])] == s9.rx_frames()
+
+def test_rx_ignores_check_result(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: The test device has a frame followed by a CHECK_RESULT record
+    # Then: rx() returns just the words
+    #
+    s9 = Serial9(test_device)
+
+    test_device._rx_buffer = bytes([0x10, 0x20, 0xff, 0x36, 0x00])
+
+    assert [0x10, 0x20] == s9.rx()
+
+def test_self_test(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: A self test is run
+    #       and the test device has echo data followed by a SELFTEST_RESULT record
+    # Then: The SELFTEST command and its parameters are sent
+    #       and the echo data is discarded
+    #       and the result is decoded
+    #
+    s9 = Serial9(test_device)
+
+    test_device._rx_buffer = bytes([0x12, 0xff, 0x01, 0x34,
+                                    0xff, 0x41,
+                                    0xe8, 0x03, 0x00, 0x00,
+                                    0x02, 0x00, 0x00, 0x00,
+                                    0xf4, 0x01, 0x00, 0x00,
+                                    0x40, 0x42, 0x0f, 0x00,])
+
+    result = s9.self_test(1000, 0x40, timeout=1.0, poll=0)
+
+    assert test_device._tx_buffer == bytes([0xff, 0x40, 0xe8, 0x03, 0x40])
+    assert result == {"words": 1000, "errors": 2, "longest_run": 500,
+                      "elapsed_us": 1000000, "words_per_second": 1000.0}
+
+def test_self_test_timeout(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: A self test is run and no result ever arrives
+    # Then: self_test() returns None
+    #
+    s9 = Serial9(test_device)
+
+    assert s9.self_test(10, timeout=0.0, poll=0) is None
+
+def test_autobaud(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: Autobaud is run and the test device has bus data followed by
+    #       an AUTOBAUD_RESULT record for 9600 baud measured 2% slow
+    # Then: The AUTOBAUD command is sent, the bus data is discarded
+    #       and the result is decoded
+    #
+    s9 = Serial9(test_device)
+
+    test_device._rx_buffer = bytes([0x12, 0xff, 0x91, 0x80, 0x25, 0x00, 0x00, 0xec])
+
+    assert {"baud": 9600, "error_percent": -2.0} == s9.autobaud(timeout=1.0, poll=0)
+    assert test_device._tx_buffer == bytes([0xff, 0x90])
+
+    # When: No result ever arrives
+    # Then: autobaud() returns None
+    #
+    assert s9.autobaud(timeout=0.0, poll=0) is None
+
+    # When: The result is that no standard rate was found
+    # Then: The baud rate is 0
+    #
+    test_device._rx_buffer = bytes([0xff, 0x91, 0x00, 0x00, 0x00, 0x00, 0x00])
+    assert {"baud": 0, "error_percent": 0.0} == s9.autobaud(timeout=1.0, poll=0)
+
+def test_collision_detect(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: Collision detect is turned on and a frame is sent and ended
+    # Then: The commands and the frame are sent as they are
+    #
+    s9 = Serial9(test_device)
+
+    s9.collide_on(2)
+    s9.tx_words([0x130, 0x031])
+    s9.frame_end()
+    s9.collide_off()
+    assert test_device._tx_buffer == bytes([0xff, 0x70, 0x02, 0xff, 0x01, 0x30, 0x31,
+                                            0xff, 0x72, 0xff, 0x71])
+
+    # When: The target reports a collision and then the retry
+    # Then: The data around the records is unchanged
+    #       and the reports are returned once
+    #
+    test_device._rx_buffer = bytes([0x10, 0xff, 0x73, 0x00, 0x02, 0xff, 0x74, 0x01, 0x11])
+    assert [0x10, 0x11] == s9.rx()
+    assert [("collision", 0, 2), ("retried", 1)] == s9.collisions()
+    assert [] == s9.collisions()
+
+def test_credit_flow_control(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: Credit flow control is turned on
+    # Then: CREDIT_ON is sent and nothing else until credit is granted
+    #
+    s9 = Serial9(test_device)
+
+    s9.credit_on()
+    assert test_device._tx_buffer == bytes([0xff, 0x50])
+    assert s9.credit == 0
+
+    test_device._tx_buffer = b""
+    s9.tx8(b"\x01\x02\xff\x03")
+    assert test_device._tx_buffer == b""
+    assert s9.backlog == 5
+
+    # When: The target grants 3 bytes of credit
+    # Then: Only 3 bytes are sent, the escape is split across the grants
+    #
+    test_device._rx_buffer = bytes([0x10, 0xff, 0x52, 0x03, 0x11])
+    assert [0x10, 0x11] == s9.rx()
+    assert test_device._tx_buffer == bytes([0x01, 0x02, 0xff])
+    assert s9.backlog == 2
+    assert s9.credit == 0
+
+    # When: The target grants more credit than the backlog
+    # Then: The rest of the backlog is sent and the credit is kept
+    #
+    test_device._rx_buffer = bytes([0xff, 0x52, 0x10])
+    assert [] == s9.rx()
+    assert test_device._tx_buffer == bytes([0x01, 0x02, 0xff, 0xff, 0x03])
+    assert s9.backlog == 0
+    assert s9.credit == 14
+
+def test_credit_off(test_device):
+    # Given: Credit flow control is on with a backlog
+    # When: Credit flow control is turned off
+    # Then: CREDIT_OFF waits behind the backlog
+    #       and data is sent directly once the backlog is gone
+    #
+    s9 = Serial9(test_device)
+
+    s9.credit_on()
+    s9.tx_encoded(b"\x01\x02")
+    s9.credit_off()
+    test_device._tx_buffer = b""
+
+    test_device._rx_buffer = bytes([0xff, 0x52, 0x02])
+    s9.rx()
+    assert test_device._tx_buffer == bytes([0x01, 0x02])
+    assert s9.credit == 0
+
+    test_device._rx_buffer = bytes([0xff, 0x52, 0x02])
+    s9.rx()
+    assert test_device._tx_buffer == bytes([0x01, 0x02, 0xff, 0x51])
+    assert s9.credit is None
+
+    s9.tx_encoded(b"\x03")
+    assert test_device._tx_buffer == bytes([0x01, 0x02, 0xff, 0x51, 0x03])
+
+def test_tx_priority(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: A priority frame is sent without credit flow control
+    # Then: It goes out at once with its length and a FRAME_END
+    #
+    s9 = Serial9(test_device)
+
+    s9.tx_priority([0x130, 0x0ff])
+    assert test_device._tx_buffer == bytes([0xff, 0x80, 0x07, 0xff, 0x01, 0x30, 0xff, 0xff,
+                                            0xff, 0x72])
+
+    # When: The frame does not fit in the firmware priority lane
+    # Then: A ValueError is raised and nothing is sent
+    #
+    test_device._tx_buffer = b""
+    with pytest.raises(ValueError):
+        s9.tx_priority([0x1ff] * 5)
+    assert test_device._tx_buffer == b""
+
+def test_priority_dropped(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: The test device has data and a PRIORITY_DROPPED record
+    # Then: The data is returned, and the length of the dropped frame
+    #       once
+    #
+    s9 = Serial9(test_device)
+
+    test_device._rx_buffer = bytes([0x12, 0xff, 0x81, 0x0d, 0x34])
+
+    assert [0x12, 0x34] == s9.rx()
+    assert [13] == s9.priority_dropped()
+    assert [] == s9.priority_dropped()
+
+def test_tx_priority_credit(test_device):
+    # Given: Credit flow control is on and the last grant ended in the
+    #        middle of an escape sequence
+    # When: A priority frame is sent
+    # Then: The rest of the escape sequence goes first, then the frame,
+    #       both without waiting for credit, and the backlog stays behind
+    #
+    s9 = Serial9(test_device)
+
+    s9.credit_on()
+    s9.tx_words([0x001, 0x1ab, 0x002])
+    test_device._tx_buffer = b""
+    test_device._rx_buffer = bytes([0xff, 0x52, 0x02])
+    s9.rx()
+    assert test_device._tx_buffer == bytes([0x01, 0xff])
+
+    s9.tx_priority([0x055])
+    assert test_device._tx_buffer == bytes([0x01, 0xff, 0x01, 0xab,
+                                            0xff, 0x80, 0x03, 0x55, 0xff, 0x72])
+    assert s9.credit == -2
+    assert s9.backlog == 1
+
+    # When: The target grants more credit
+    # Then: The debt is paid off before the backlog goes
+    #
+    test_device._rx_buffer = bytes([0xff, 0x52, 0x03])
+    s9.rx()
+    assert test_device._tx_buffer.endswith(bytes([0x72, 0x02]))
+    assert s9.backlog == 0
+
+def test_drain(test_device):
+    # Given: Credit flow control is on with a backlog
+    # When: The backlog is drained
+    # Then: The words received while waiting are returned
+    #
+    s9 = Serial9(test_device)
+
+    s9.credit_on()
+    s9.tx_encoded(b"\x01\x02")
+    test_device._rx_buffer = bytes([0x20, 0xff, 0x52, 0x80])
+
+    assert [0x20] == s9.drain(timeout=1.0)
+    assert s9.backlog == 0
+
+    # When: No credit ever arrives
+    # Then: drain() gives up after the timeout
+    #
+    s9._credit = 0
+    s9.tx_encoded(b"\x03")
+    assert [] == s9.drain(timeout=0.0, poll=0)
+    assert s9.backlog == 1
+
+def test_tx_words(test_device):
+    # Given: Serial9 instance initialized with a TestDevice
+    # When: A frame of mixed 8 and 9 bit words is sent
+    # Then: The whole frame is escaped and sent with one write
+    #
+    s9 = Serial9(test_device)
+
+    s9.tx_words([0x130, 0x01, 0xff, 0x1ff])
+    s9.tx_words(iter([0x02]))
+
+    assert test_device._tx_buffer == bytes([0xff, 0x01, 0x30, 0x01, 0xff, 0xff, 0xff, 0x01, 0xff,
+                                            0x02])
+    assert test_device.tx_calls == 2
+
+def test_write_combining(test_device):
+    # Given: Serial9 instance with write combining on
+    # When: Several frames are sent
+    # Then: Nothing is written until flush()
+    #       and then everything goes in a single write
+    #
+    s9 = Serial9(test_device)
+    s9.write_combining(deadline=10.0)
+
+    s9.tx9(b"\x10")
+    s9.tx8(b"\x01\x02")
+    s9.tx_words([0x111])
+    assert test_device.tx_calls == 0
+
+    s9.flush()
+    assert test_device.tx_calls == 1
+    assert test_device._tx_buffer == bytes([0xff, 0x01, 0x10, 0x01, 0x02, 0xff, 0x01, 0x11])
+
+    s9.flush()
+    assert test_device.tx_calls == 1
+
+def test_write_combining_flush_on_read_and_deadline(test_device):
+    # Given: Serial9 instance with write combining on
+    # When: Data is read from the target
+    #       or a call is made after the deadline
+    # Then: The data held back is sent first
+    #
+    s9 = Serial9(test_device)
+    s9.write_combining(deadline=10.0)
+
+    s9.tx8(b"\x01")
+    s9.rx()
+    assert test_device._tx_buffer == b"\x01"
+
+    s9.tx8(b"\x02")
+    s9._combine_start -= 10.0
+    s9.tx8(b"\x03")
+    assert test_device._tx_buffer == b"\x01\x02\x03"
+    assert test_device.tx_calls == 2
+
+    # When: The deadline passes after the last write, with no more calls
+    # Then: The data stays held until flush() is called
+    #
+    s9.tx8(b"\x06")
+    s9._combine_start -= 10.0
+    assert test_device._tx_buffer == b"\x01\x02\x03"
+    s9.flush()
+    assert test_device._tx_buffer == b"\x01\x02\x03\x06"
+    assert test_device.tx_calls == 3
+
+    # When: Write combining is turned off
+    # Then: Anything held is sent, and every call writes again
+    #
+    s9.tx8(b"\x04")
+    s9.write_combining(None)
+    s9.tx8(b"\x05")
+    assert test_device._tx_buffer == b"\x01\x02\x03\x06\x04\x05"
+    assert test_device.tx_calls == 5
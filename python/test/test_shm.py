@@ -0,0 +1,222 @@
+import os
+import mmap
+import time
+import random
+import shutil
+import socket
+import threading
+import subprocess
+
+import pytest
+
+from serial9 import Serial9
+from serial9.shm import ShmConn, run, HEADER, HEADER_SIZE, CONTROL_SIZE, HEAD, COUNTER, SHM_MAGIC, SHM_VERSION
+
+REPO = os.path.join(os.path.dirname(__file__), "..", "..")
+
+def test_shm_ring_size():
+    # Given: No initial conditions
+    # When: Rings are created with a size that is not a power of two
+    # Then: A ValueError is raised
+    #
+    with pytest.raises(ValueError):
+        ShmConn.create(100)
+    with pytest.raises(ValueError):
+        ShmConn.create(0)
+
+def test_shm_ring_wraps():
+    # Given: A pair of 64 byte rings
+    # When: Random sized pieces go through in both directions many times
+    # Then: Everything comes out in order, across the end of each ring
+    #
+    host = ShmConn.create(64)
+    bridge = host.bridge()
+    rng = random.Random(35)
+
+    for i in range(200):
+        d = bytes(rng.randrange(256) for j in range(rng.randint(1, 64)))
+        host.tx(d)
+        assert d == bridge.rx()
+        bridge.tx(d[::-1])
+        assert d[::-1] == host.rx()
+
+    assert b"" == host.rx()
+    assert b"" == bridge.rx()
+    host.close()
+
+def test_shm_tx_waits_for_room():
+    # Given: A pair of 64 byte rings and a bridge thread reading slowly
+    # When: The host sends much more than fits in the ring
+    # Then: tx() waits for room and the bridge gets every byte in order
+    #       and wait() times out once nothing more is coming
+    #
+    host = ShmConn.create(64)
+    bridge = host.bridge()
+    d = bytes(i & 0xff for i in range(5000))
+    received = bytearray()
+
+    def reader():
+        while len(received) < len(d):
+            if bridge.wait(1.0):
+                received.extend(bridge.rx())
+                time.sleep(0.0001)
+
+    thread = threading.Thread(target=reader)
+    thread.start()
+    host.tx(d)
+    thread.join(5.0)
+
+    assert d == bytes(received)
+    assert not bridge.wait(0.02)
+    host.close()
+
+def test_shm_corrupt_ring():
+    # Given: A pair of rings
+    # When: The head of the host to bridge ring is moved more than the
+    #       ring size past the tail
+    # Then: Both sides refuse to use the ring
+    #
+    host = ShmConn.create(64)
+    bridge = host.bridge()
+
+    COUNTER.pack_into(host._mm, HEADER_SIZE + HEAD, 65)
+    with pytest.raises(ConnectionError):
+        bridge.rx()
+    with pytest.raises(ConnectionError):
+        host.tx(b"\x01")
+    host.close()
+
+def test_shm_serial9():
+    # Given: A Serial9 instance using the host side of the rings
+    # When: Words are sent and received
+    # Then: The escaped bytes go through the rings unchanged
+    #
+    host = ShmConn.create(256)
+    bridge = host.bridge()
+    s9 = Serial9(host)
+
+    s9.tx_words([0x130, 0x0ff, 0x001])
+    assert b"\xff\x01\x30\xff\xff\x01" == bridge.rx()
+
+    bridge.tx(b"\xff\x01\x30\x12")
+    assert [0x130, 0x012] == s9.rx()
+    host.close()
+
+@pytest.fixture
+def bridge(tmp_path):
+    # Build and start serial9_bridge in echo mode, the same way
+    # host/build.sh builds it
+    if shutil.which("g++") is None:
+        pytest.skip("g++ is needed to build the bridge")
+
+    program = str(tmp_path / "serial9_bridge")
+    subprocess.run(["g++", "-O2", "host/serial9_bridge.cpp", "host/serial9_shm.cpp",
+                    "-I", "host", "-o", program], cwd=REPO, check=True)
+
+    path = str(tmp_path / "bridge.sock")
+    process = subprocess.Popen([program, path, "--echo"])
+    for i in range(100):
+        if os.path.exists(path):
+            break
+        time.sleep(0.01)
+    yield path
+    process.kill()
+    process.wait()
+
+def test_shm_bridge_echo(bridge):
+    # Given: serial9_bridge running in echo mode
+    # When: The host connects with 256 byte rings and sends far more
+    #       than fits, twice in a row over separate connections
+    # Then: Everything comes back in order each time
+    #
+    for attempt in range(2):
+        conn = ShmConn.connect(bridge, size=256)
+        d = bytes((i * 7 + attempt) & 0xff for i in range(20000))
+        received = bytearray()
+
+        def reader():
+            while len(received) < len(d):
+                if not conn.wait(2.0):
+                    return
+                received.extend(conn.rx())
+
+        thread = threading.Thread(target=reader)
+        thread.start()
+        conn.tx(d)
+        thread.join(5.0)
+        conn.close()
+
+        assert d == bytes(received)
+
+def test_shm_bridge_corrupt_ring(bridge):
+    # Given: serial9_bridge running in echo mode
+    # When: The host moves the head of its ring far past the tail
+    # Then: The bridge drops the connection
+    #
+    conn = ShmConn.connect(bridge, size=256)
+    COUNTER.pack_into(conn._mm, HEADER_SIZE + HEAD, 1 << 40)
+    conn._wake_peer()
+
+    conn._sock.settimeout(5.0)
+    assert b"" == conn._sock.recv(1)
+    conn.close()
+
+def test_shm_bridge_bad_handshake(bridge):
+    # Given: serial9_bridge running in echo mode
+    # When: A client connects and sends only two fds
+    # Then: The bridge drops the connection, and the next client is served
+    #
+    host = ShmConn.create(256)
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(bridge)
+    socket.send_fds(sock, [b"S9SHRING"], host.bridge_fds()[:2])
+    sock.settimeout(5.0)
+    assert b"" == sock.recv(1)
+    sock.close()
+    host.close()
+
+    conn = ShmConn.connect(bridge, size=256)
+    conn.tx(b"\x42")
+    assert conn.wait(2.0)
+    assert b"\x42" == conn.rx()
+    conn.close()
+
+def test_shm_bridge_unsealed_memfd(bridge):
+    # Given: serial9_bridge running in echo mode
+    # When: A client sends a memfd that could still be shrunk
+    # Then: The bridge drops the connection
+    #
+    memfd = os.memfd_create("serial9", os.MFD_CLOEXEC)
+    os.ftruncate(memfd, HEADER_SIZE + 2 * CONTROL_SIZE + 2 * 256)
+    mm = mmap.mmap(memfd, 0)
+    HEADER.pack_into(mm, 0, SHM_MAGIC, SHM_VERSION, 256)
+    flags = os.EFD_NONBLOCK | os.EFD_CLOEXEC
+    host = ShmConn(mm, (memfd, os.eventfd(0, flags), os.eventfd(0, flags)))
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(bridge)
+    socket.send_fds(sock, [SHM_MAGIC], host.bridge_fds())
+    sock.settimeout(5.0)
+    assert b"" == sock.recv(1)
+    sock.close()
+    host.close()
+
+def test_shm_create_sealed():
+    # Given: No initial conditions
+    # When: A pair of rings is created
+    # Then: The memfd cannot change size
+    #
+    host = ShmConn.create(256)
+    with pytest.raises(PermissionError):
+        os.ftruncate(host.bridge_fds()[0], 0)
+    host.close()
+
+def test_shm_benchmark():
+    # Given: No initial conditions
+    # When: The latency benchmark is run for a few round trips
+    # Then: There is a result for each transport and message length
+    #
+    results = run(count=10, lengths=(1, 64))
+
+    assert [(transport, length) for transport, length, median, p99 in results] == [
+        ("socket", 1), ("socket", 64), ("shared memory", 1), ("shared memory", 64)]
@@ -0,0 +1,195 @@
+import random
+
+import pytest
+
+from serial9 import Serial9
+from serial9.timeouts import AddressTimeout, Timeouts
+
+class Slave():
+    # A half duplex bus: the request is echoed echo_time seconds of the fake
+    # clock after it is sent, and answered latency seconds after that. A
+    # latency of None never answers, an echo_time of None is a full duplex
+    # bus without an echo. A new request drops the answer to the last one
+
+    def __init__(self, fake_clock, reply=b"\x12\x34"):
+        self._clock = fake_clock
+        self._reply = reply
+        self._pending = []
+        self.echo_time = 0.005
+        self.latency = 0.001
+        self.requests = []
+
+    def tx(self, d):
+        self.requests.append(d)
+        self._pending = []
+        due = self._clock.now
+        if self.echo_time is not None:
+            due += self.echo_time
+            self._pending.append((due, d))
+        if self.latency is not None:
+            self._pending.append((due + self.latency, self._reply))
+
+    def rx(self):
+        d = b""
+        while self._pending and (self._clock.now >= self._pending[0][0]):
+            d += self._pending.pop(0)[1]
+        return d
+
+def test_address_timeout_warmup():
+    # Given: A new address
+    # When: Fewer than warmup replies have been seen
+    # Then: The deadline is the ceiling and nothing has been learned
+    #
+    t = AddressTimeout(ceiling=0.1, warmup=4)
+
+    assert 0.1 == t.deadline
+    assert t.mean is None and t.percentile is None
+
+    for i in range(3):
+        t.observe(0.002)
+    assert 0.1 == t.deadline
+
+    t.observe(0.002)
+    assert 0.002 == pytest.approx(t.mean)
+    assert 0.002 <= t.deadline < 0.01
+
+def test_address_timeout_converges():
+    # Given: A slave that answers in 1 to 2 ms
+    # When: Many replies are observed
+    # Then: The deadline covers every recent reply, and is far below the
+    #       ceiling
+    #
+    rng = random.Random(38)
+    t = AddressTimeout(ceiling=0.1)
+
+    samples = [rng.uniform(0.001, 0.002) for i in range(500)]
+    for s in samples:
+        t.observe(s)
+
+    assert 0.0014 < t.mean < 0.0016
+    assert max(samples[-64:]) <= t.deadline < 0.005
+    assert 500 == t.replies
+
+def test_address_timeout_floor_and_backoff():
+    # Given: A slave that answers much faster than the floor
+    # When: Replies are observed, then a run of timeouts
+    # Then: The deadline is the floor, doubles with each timeout up to
+    #       the ceiling, and drops back with the next reply
+    #
+    t = AddressTimeout(floor=0.001, ceiling=0.01)
+
+    for i in range(10):
+        t.observe(0.0001)
+    assert 0.001 == t.deadline
+
+    deadlines = []
+    for i in range(6):
+        t.miss()
+        deadlines.append(t.deadline)
+    assert [0.002, 0.004, 0.008, 0.01, 0.01, 0.01] == pytest.approx(deadlines)
+    assert 6 == t.timeouts
+
+    t.observe(0.0001)
+    assert 0.001 == t.deadline
+
+def test_transact_learns_deadline(fake_clock):
+    # Given: A slave that answers in 1 ms, after a 5 ms echo of the request
+    # When: Requests are made to it
+    # Then: Each reply is returned without the echo, the latency is learned
+    #       from the end of the echo to within a poll and the learned
+    #       deadline is far below the ceiling
+    #
+    slave = Slave(fake_clock)
+    s9 = Serial9(slave)
+    timeouts = Timeouts(ceiling=0.1, clock=fake_clock.clock, sleep=fake_clock.sleep)
+
+    for i in range(20):
+        assert [0x12, 0x34] == timeouts.transact(s9, [0x130, 0x01])
+
+    assert bytes([0xff, 0x01, 0x30, 0x01]) == slave.requests[0]
+    assert 0.001 == pytest.approx(timeouts.address(0x30).mean, abs=0.0003)
+    assert timeouts.deadline(0x30) < 0.005
+
+def test_transact_echo_in_one_read(fake_clock):
+    # Given: A slave whose reply arrives in the same read as the echo
+    # When: A request is made, with and without an echo
+    # Then: Only the words after the echo are the reply, and on a full
+    #       duplex bus nothing is dropped
+    #
+    slave = Slave(fake_clock)
+    slave.latency = 0
+    s9 = Serial9(slave)
+    timeouts = Timeouts(clock=fake_clock.clock, sleep=fake_clock.sleep)
+
+    assert [0x12, 0x34] == timeouts.transact(s9, [0x130, 0x01, 0x02])
+
+    slave.echo_time = None
+    slave.latency = 0.001
+    assert [0x12, 0x34] == timeouts.transact(s9, [0x130, 0x01], echo=False)
+    assert 2 == timeouts.address(0x30).replies
+
+def test_transact_adapts_to_slow_slave(fake_clock):
+    # Given: A slave that has been answering in 1 ms
+    # When: It slows down to 20 ms
+    # Then: The first requests time out well before the ceiling, the
+    #       deadline backs off until a reply gets through, and it is
+    #       learned from
+    #
+    slave = Slave(fake_clock)
+    s9 = Serial9(slave)
+    timeouts = Timeouts(ceiling=0.1, clock=fake_clock.clock, sleep=fake_clock.sleep)
+
+    for i in range(20):
+        timeouts.transact(s9, [0x130])
+
+    slave.latency = 0.02
+    results = []
+    for i in range(10):
+        start = fake_clock.now
+        results.append(timeouts.transact(s9, [0x130]))
+        assert fake_clock.now - start < 0.1
+
+    assert results[0] is None
+    assert [0x12, 0x34] == results[-1]
+    assert 0.02 <= timeouts.deadline(0x30)
+    assert 0 < timeouts.address(0x30).timeouts
+
+def test_transact_no_reply(fake_clock):
+    # Given: A slave that never answers
+    # When: A request is made
+    # Then: None is returned the ceiling after the echo, and the timeout is
+    #       counted
+    #
+    slave = Slave(fake_clock)
+    slave.latency = None
+    timeouts = Timeouts(ceiling=0.05, clock=fake_clock.clock, sleep=fake_clock.sleep)
+
+    start = fake_clock.now
+    assert timeouts.transact(Serial9(slave), [0x140]) is None
+    assert 0.055 == pytest.approx(fake_clock.now - start)
+    assert 1 == timeouts.address(0x40).timeouts
+
+    with pytest.raises(ValueError):
+        timeouts.transact(Serial9(slave), [0x040])
+
+def test_timeouts_monitoring():
+    # Given: Two addresses, one that has answered and one that has not
+    # When: The learned values are read
+    # Then: Both are in the snapshot and the Prometheus export, without
+    #       values for what has not been learned
+    #
+    timeouts = Timeouts(warmup=1)
+    timeouts.address(0x30).observe(0.002)
+    timeouts.address(0x40).miss()
+
+    snapshot = timeouts.snapshot()
+    assert [0x30, 0x40] == list(snapshot)
+    assert 0.002 == snapshot[0x30]["mean"]
+    assert 1 == snapshot[0x40]["timeouts"]
+    assert snapshot[0x40]["mean"] is None
+
+    text = timeouts.prometheus()
+    assert "# TYPE serial9_reply_deadline_seconds gauge" in text
+    assert 'serial9_reply_mean_seconds{address="0x30"} 0.002' in text
+    assert 'serial9_reply_timeouts_total{address="0x40"} 1' in text
+    assert 'serial9_reply_mean_seconds{address="0x40"}' not in text
@@ -11,4 +11,14 @@ class MockSerial
 
 // There is a single instance of MockSerial called Serial somewhere ...
 
-extern MockSerial Serial;
\ No newline at end of file
+extern MockSerial Serial;
+
+// Timing functions from the Arduino core
+
+unsigned long micros(void);
+
+// Program memory is ordinary memory here
+
+#define PROGMEM
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
\ No newline at end of file
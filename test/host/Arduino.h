@@ -0,0 +1,23 @@
+// The host emulator build of the firmware uses this instead of the real
+// Arduino core - Serial is a pair of byte queues, see serial9_host.cpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+class HostSerial
+{
+  public:
+    size_t write(unsigned char c);
+    uint16_t read(void);
+    unsigned int available(void);
+};
+
+extern HostSerial Serial;
+
+unsigned long micros(void);
+
+// Program memory is ordinary memory here
+
+#define PROGMEM
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
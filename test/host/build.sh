@@ -0,0 +1,8 @@
+# Shell script to build the firmware for the host emulator
+#
+# Run from the top level serial9 folder, the shared library goes in the
+# build folder where python/test/codec.py looks for it
+#
+mkdir -p build
+
+g++ -O2 -shared -fPIC test/host/serial9_host.cpp arduino/serial9/serial9.cpp arduino/serial9/serial9_check.cpp arduino/serial9/serial9_mux.cpp -I test/host -I arduino/serial9 -o build/libserial9_host.so
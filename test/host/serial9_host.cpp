@@ -0,0 +1,199 @@
+/* ---------------------------------------------------------------------------
+  serial9_host.cpp - runs the serial9 firmware on the host
+
+  The firmware state machine is compiled unchanged against this file
+  instead of the Arduino core and serial9_atmega_32u.cpp. The USB side is
+  a pair of byte queues, the bus side a pair of word queues, and the UART
+  is always ready - so everything the host sends comes straight out on
+  the bus and vice versa.
+
+  The C interface at the bottom is for Python ctypes, see
+  python/test/codec.py
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "serial9.h"
+#include "Arduino.h"
+
+static std::vector<uint8_t> usb_in;
+static size_t usb_in_pos;
+static std::vector<uint8_t> usb_out;
+
+static std::vector<uint16_t> bus_in;
+static size_t bus_in_pos;
+static std::vector<uint16_t> bus_out;
+
+static unsigned long now;
+
+HostSerial Serial;
+
+size_t HostSerial::write(unsigned char c)
+{
+  usb_out.push_back(c);
+  return 1;
+}
+
+uint16_t HostSerial::read(void)
+{
+  return usb_in[usb_in_pos++];
+}
+
+unsigned int HostSerial::available(void)
+{
+  return usb_in.size() - usb_in_pos;
+}
+
+unsigned long micros(void)
+{
+  return now++;
+}
+
+void serial9_set_8bit_mode(uint8_t ch) {}
+void serial9_set_9bit_mode(uint8_t ch) {}
+void serial9_set_baud(uint8_t ch, uint32_t baud) {}
+uint32_t serial9_baud_actual(uint8_t ch, uint32_t baud)
+{
+  return baud;
+}
+void serial9_start(uint8_t ch) {}
+void serial9_stop(uint8_t ch) {}
+void serial9_talk(uint8_t ch) {}
+void serial9_listen(uint8_t ch) {}
+void serial9_offline(uint8_t ch) {}
+void serial9_duplex(uint8_t ch) {}
+
+bool serial9_rx_available(uint8_t ch)
+{
+  return bus_in_pos < bus_in.size();
+}
+
+uint16_t serial9_read(uint8_t ch)
+{
+  return bus_in[bus_in_pos++];
+}
+
+bool serial9_tx_busy(uint8_t ch)
+{
+  return false;
+}
+
+bool serial9_tx_complete(uint8_t ch)
+{
+  return true;
+}
+
+void serial9_write(uint8_t ch, uint16_t data)
+{
+  bus_out.push_back(data);
+}
+
+// There is no RX pin to time, so autobaud finds nothing
+
+bool serial9_edge_start(uint8_t ch)
+{
+  return false;
+}
+
+void serial9_edge_stop(uint8_t ch) {}
+
+uint16_t serial9_edge_count(uint8_t ch)
+{
+  return 0;
+}
+
+uint32_t serial9_edge_baud(uint8_t ch)
+{
+  return 0;
+}
+
+static Serial9 *s9;
+
+extern "C" {
+
+void s9_host_begin(uint32_t baud)
+{
+  delete s9;
+  s9 = new Serial9();
+  usb_in.clear();
+  usb_in_pos = 0;
+  usb_out.clear();
+  bus_in.clear();
+  bus_in_pos = 0;
+  bus_out.clear();
+  now = 0;
+  s9->begin(baud);
+}
+
+void s9_host_usb_in(const uint8_t *data, size_t length)
+{
+  usb_in.insert(usb_in.end(), data, data + length);
+}
+
+void s9_host_bus_in(const uint16_t *data, size_t length)
+{
+  bus_in.insert(bus_in.end(), data, data + length);
+}
+
+// Run the firmware loop until both inputs are used up, and then a few
+// more times to let it finish off
+//
+void s9_host_run(void)
+{
+  while ((usb_in_pos < usb_in.size()) || (bus_in_pos < bus_in.size())) {
+    s9->loop();
+  }
+  for (int i = 0; i < 4; ++i) {
+    s9->loop();
+  }
+  usb_in.clear();
+  usb_in_pos = 0;
+  bus_in.clear();
+  bus_in_pos = 0;
+}
+
+// Run the firmware loop a given number of times, for tests that feed
+// the host side a little at a time - with the UART always ready, each
+// loop sends at most one word
+//
+void s9_host_loop(int count)
+{
+  for (int i = 0; i < count; ++i) {
+    s9->loop();
+  }
+}
+
+size_t s9_host_usb_out(uint8_t *data, size_t length)
+{
+  if (length > usb_out.size()) {
+    length = usb_out.size();
+  }
+  memcpy(data, usb_out.data(), length);
+  usb_out.erase(usb_out.begin(), usb_out.begin() + length);
+  return length;
+}
+
+size_t s9_host_usb_out_length(void)
+{
+  return usb_out.size();
+}
+
+size_t s9_host_bus_out(uint16_t *data, size_t length)
+{
+  if (length > bus_out.size()) {
+    length = bus_out.size();
+  }
+  memcpy(data, bus_out.data(), length * sizeof(uint16_t));
+  bus_out.erase(bus_out.begin(), bus_out.begin() + length);
+  return length;
+}
+
+size_t s9_host_bus_out_length(void)
+{
+  return bus_out.size();
+}
+
+}
@@ -21,62 +21,112 @@ unsigned int MockSerial::available(void)
     return mock().intReturnValue();
 }
 
-void serial9_set_baud(uint32_t baud)
+unsigned long micros(void)
 {
-    mock().actualCall("serial9_set_baud").withParameter("baud", baud);
+    mock().actualCall("micros");
+    return mock().unsignedLongIntReturnValue();
 }
 
-void serial9_start(void)
+void serial9_set_baud(uint8_t ch, uint32_t baud)
 {
-    mock().actualCall("serial9_start");
+    mock().actualCall("serial9_set_baud").withParameter("ch", ch).withParameter("baud", baud);
 }
 
-void serial9_stop(void)
+uint32_t serial9_baud_actual(uint8_t ch, uint32_t baud)
 {
-    mock().actualCall("serial9_stop");
+    mock().actualCall("serial9_baud_actual").withParameter("ch", ch).withParameter("baud", baud);
+    return mock().unsignedLongIntReturnValue();
 }
 
-void serial9_talk(void)
+void serial9_start(uint8_t ch)
 {
-    mock().actualCall("serial9_talk");
+    mock().actualCall("serial9_start").withParameter("ch", ch);
 }
 
-void serial9_listen(void)
+void serial9_stop(uint8_t ch)
 {
-    mock().actualCall("serial9_listen");
+    mock().actualCall("serial9_stop").withParameter("ch", ch);
 }
 
-void serial9_offline(void)
+void serial9_talk(uint8_t ch)
 {
-    mock().actualCall("serial9_offline");
+    mock().actualCall("serial9_talk").withParameter("ch", ch);
 }
 
-bool serial9_rx_available(void)
+void serial9_listen(uint8_t ch)
 {
-    mock().actualCall("serial9_rx_available");
+    mock().actualCall("serial9_listen").withParameter("ch", ch);
+}
+
+void serial9_offline(uint8_t ch)
+{
+    mock().actualCall("serial9_offline").withParameter("ch", ch);
+}
+
+void serial9_duplex(uint8_t ch)
+{
+    mock().actualCall("serial9_duplex").withParameter("ch", ch);
+}
+
+bool serial9_rx_available(uint8_t ch)
+{
+    mock().actualCall("serial9_rx_available").withParameter("ch", ch);
     return mock().boolReturnValue();
 }
 
-uint16_t serial9_read(void)
+uint16_t serial9_read(uint8_t ch)
 {
-    mock().actualCall("serial9_read");
+    mock().actualCall("serial9_read").withParameter("ch", ch);
     return mock().intReturnValue();
 }
 
-bool serial9_tx_busy(void)
+bool serial9_tx_busy(uint8_t ch)
 {
-    mock().actualCall("serial9_tx_busy");
+    mock().actualCall("serial9_tx_busy").withParameter("ch", ch);
     return mock().boolReturnValue();
 }
 
-bool serial9_tx_complete(void)
+bool serial9_tx_complete(uint8_t ch)
 {
-    mock().actualCall("serial9_tx_complete");
+    mock().actualCall("serial9_tx_complete").withParameter("ch", ch);
     return mock().boolReturnValue();
 }
 
-void serial9_write(uint16_t data)
+void serial9_write(uint8_t ch, uint16_t data)
 {
-    mock().actualCall("serial9_write").withParameter("data", data);
+    mock().actualCall("serial9_write").withParameter("ch", ch).withParameter("data", data);
 }
 
+
+void serial9_set_8bit_mode(uint8_t ch)
+{
+    mock().actualCall("serial9_set_8bit_mode").withParameter("ch", ch);
+}
+
+void serial9_set_9bit_mode(uint8_t ch)
+{
+    mock().actualCall("serial9_set_9bit_mode").withParameter("ch", ch);
+}
+
+bool serial9_edge_start(uint8_t ch)
+{
+    mock().actualCall("serial9_edge_start").withParameter("ch", ch);
+    return mock().boolReturnValue();
+}
+
+void serial9_edge_stop(uint8_t ch)
+{
+    mock().actualCall("serial9_edge_stop").withParameter("ch", ch);
+}
+
+uint16_t serial9_edge_count(uint8_t ch)
+{
+    mock().actualCall("serial9_edge_count").withParameter("ch", ch);
+    return mock().unsignedIntReturnValue();
+}
+
+uint32_t serial9_edge_baud(uint8_t ch)
+{
+    mock().actualCall("serial9_edge_baud").withParameter("ch", ch);
+    return mock().unsignedLongIntReturnValue();
+}
@@ -10,7 +10,7 @@
 #
 mkdir -p build
 
-g++ -D GCOV --coverage test/main.c test/test.c test/mock.cpp arduino/serial9/serial9.cpp -I test -I arduino/serial9  -lCppUTest -lCppUTestExt -o build/test_serial9
+g++ -D GCOV -D SERIAL9_CHANNELS=2 --coverage test/main.c test/test.c test/mock.cpp arduino/serial9/serial9.cpp arduino/serial9/serial9_check.cpp arduino/serial9/serial9_mux.cpp -I test -I arduino/serial9  -lCppUTest -lCppUTestExt -o build/test_serial9
 
 build/test_serial9 -ojunit 
 
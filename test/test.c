@@ -30,9 +30,10 @@ TEST(Serial9, begin)
 //         The low level interface is started
 //         The device is put in listen mode
 
-    mock().expectOneCall("serial9_set_baud").withParameter("baud", 9600);
-    mock().expectOneCall("serial9_start");
-    mock().expectOneCall("serial9_listen");
+    mock().expectOneCall("serial9_set_baud").withParameter("ch", 0).withParameter("baud", 9600);
+    mock().expectOneCall("serial9_set_9bit_mode").withParameter("ch", 0);
+    mock().expectOneCall("serial9_start").withParameter("ch", 0);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
 
     s9->begin(9600);
 
@@ -45,7 +46,7 @@ TEST(Serial9, end)
 //  WHEN:  The end() method is called
 //  THEN:  The low level interface is stopped
 
-    mock().expectOneCall("serial9_stop");
+    mock().expectOneCall("serial9_stop").withParameter("ch", 0);
 
     s9->end();
 
@@ -60,10 +61,11 @@ TEST(Serial9, idle)
 //         And any pending 485 transmission is not complete
 //  THEN:  We do nothing
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-    mock().expectOneCall("serial9_tx_complete").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
 
     s9->loop();
 
@@ -78,10 +80,12 @@ TEST(Serial9, idle_tx_complete_not_writing)
 //         And any pending 485 transmission is complete
 //  THEN:  We do nothing
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-    mock().expectOneCall("serial9_tx_complete").andReturnValue(true);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
 
     s9->loop();
 
@@ -94,8 +98,9 @@ TEST(Serial9, serial9_available_non_escape_8bit_data)
 //  WHEN:  A character with bit9 low is available on serial9
 //  THEN:  The byte is written to the Serial object
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(true);
-    mock().expectOneCall("serial9_read").andReturnValue(0xaa);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(0xaa);
     mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0xaa).andReturnValue(0x01);
 
     s9->loop();
@@ -104,10 +109,12 @@ TEST(Serial9, serial9_available_non_escape_8bit_data)
 //  WHEN:  No characters are available from Serial
 //  THEN:  Nothing else happens
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-    mock().expectOneCall("serial9_tx_complete").andReturnValue(true);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
 
     s9->loop();
 
@@ -121,8 +128,9 @@ TEST(Serial9, serial9_available_escape_8bit_data)
 //         and it is the ESCAPE character
 //  THEN:  The ESCAPE byte is written to the Serial object, twice
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(true);
-    mock().expectOneCall("serial9_read").andReturnValue(0xff);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(0xff);
     mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0xff).andReturnValue(0x01);
     mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0xff).andReturnValue(0x01);
 
@@ -132,10 +140,12 @@ TEST(Serial9, serial9_available_escape_8bit_data)
 //  WHEN:  No characters are available from Serial
 //  THEN:  Nothing else happens
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-    mock().expectOneCall("serial9_tx_complete").andReturnValue(true);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
 
     s9->loop();
 
@@ -150,8 +160,9 @@ TEST(Serial9, serial9_available_9bit_data)
 //         The SERIAL9_HIGH command is written to the Serial object
 //         The lower 8 bits of the character are written to the Serial object
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(true);
-    mock().expectOneCall("serial9_read").andReturnValue(0x01aa);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(0x01aa);
     mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0xff).andReturnValue(0x01);
     mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0x01).andReturnValue(0x01);
     mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0xaa).andReturnValue(0x01);
@@ -162,10 +173,12 @@ TEST(Serial9, serial9_available_9bit_data)
 //  WHEN:  No additional characters are available from Serial
 //  THEN:  Nothing else happens
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-    mock().expectOneCall("serial9_tx_complete").andReturnValue(true);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
 
     s9->loop();
 
@@ -178,16 +191,17 @@ TEST(Serial9, serial_available_non_escape_data)
 //  WHEN:  A non-ESCAPE character is received from Serial
 //  THEN:  The character is written to the serial9 object
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
     mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xaa);
 
 //  THEN:  The serial9 object is placed into talk mode (half duplex)
 //         The character is written to the serial9 object
 
-    mock().expectOneCall("serial9_talk");
-    mock().expectOneCall("serial9_write").withParameter("data", 0xaa);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0xaa);
 
     s9->loop();
 
@@ -195,8 +209,9 @@ TEST(Serial9, serial_available_non_escape_data)
 //  WHEN:  The loop is executed and the serial9 transmitter is busy
 //  THEN:  Nothing happens
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(true);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(true);
 
     s9->loop();
 
@@ -205,11 +220,13 @@ TEST(Serial9, serial_available_non_escape_data)
 //         The loop is executed and the serial9 transmitter is not busy
 //  THEN:  The serial9 object is placed into listen mode (half duplex)
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-    mock().expectOneCall("serial9_tx_complete").andReturnValue(true);
-    mock().expectOneCall("serial9_listen");
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
 
     s9->loop();
 
@@ -222,14 +239,13 @@ TEST(Serial9, serial_available_escaped_9bit_data)
 //  WHEN:  An ESCAPE character is received from Serial
 //  THEN:  ...
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
     mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xff);
 
-//  THEN:  The serial9 object is placed into talk mode (half duplex)
-
-    mock().expectOneCall("serial9_talk");
+//  THEN:  Nothing happens until the next character is read
 
     s9->loop();
 
@@ -237,8 +253,9 @@ TEST(Serial9, serial_available_escaped_9bit_data)
 //  WHEN:  A SERIAL9_HIGH character is received from Serial
 //  THEN:  Nothing happens until the next character is read
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
     mock().expectOneCall("read").onObject(&Serial).andReturnValue(0x01);
 
@@ -246,13 +263,16 @@ TEST(Serial9, serial_available_escaped_9bit_data)
 
 //  GIVEN: SERIAL9_HIGH character is received from Serial
 //  WHEN:  Any other character is received from Serial
-//  THEN:  The character is sent to serial9 with the 9th bit set
+//  THEN:  The serial9 object is placed into talk mode (half duplex)
+//         The character is sent to serial9 with the 9th bit set
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
     mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xaa);
-    mock().expectOneCall("serial9_write").withParameter("data", 0x01aa);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x01aa);
 
     s9->loop();
 
@@ -260,8 +280,9 @@ TEST(Serial9, serial_available_escaped_9bit_data)
 //  WHEN:  The loop is executed and the serial9 transmitter is busy
 //  THEN:  Nothing happens
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(true);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(true);
 
     s9->loop();
 
@@ -270,11 +291,13 @@ TEST(Serial9, serial_available_escaped_9bit_data)
 //         The loop is executed and the serial9 transmitter is not busy
 //  THEN:  The serial9 object is placed into listen mode (half duplex)
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-    mock().expectOneCall("serial9_tx_complete").andReturnValue(true);
-    mock().expectOneCall("serial9_listen");
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
 
     s9->loop();
 
@@ -287,26 +310,28 @@ TEST(Serial9, serial_available_escaped_escape_data)
 //  WHEN:  An ESCAPE character is received from Serial
 //  THEN:  ...
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
     mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xff);
 
-//  THEN:  The serial9 object is placed into talk mode (half duplex)
-
-    mock().expectOneCall("serial9_talk");
+//  THEN:  Nothing happens until the next character is read
 
     s9->loop();
 
 //  GIVEN: An ESCAPE character has been recieved from Serial
 //  WHEN:  An ESCAPE character is received from Serial
-//  THEN:  The ESCAPE character is sent to serial9 with the 9th bit clear
+//  THEN:  The serial9 object is placed into talk mode (half duplex)
+//         The ESCAPE character is sent to serial9 with the 9th bit clear
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
     mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xff);
-    mock().expectOneCall("serial9_write").withParameter("data", 0x00ff);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x00ff);
 
     s9->loop();
 
@@ -315,11 +340,13 @@ TEST(Serial9, serial_available_escaped_escape_data)
 //         The loop is executed and the serial9 transmitter is not busy
 //  THEN:  The serial9 object is placed into listen mode (half duplex)
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-    mock().expectOneCall("serial9_tx_complete").andReturnValue(true);
-    mock().expectOneCall("serial9_listen");
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
 
     s9->loop();
 
@@ -351,14 +378,13 @@ TEST(Serial9, serial_available_escaped_set_baud_data)
         //  WHEN:  An ESCAPE character is received from Serial
         //  THEN:  ...
 
-        mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-        mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+        mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
         mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
         mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xff);
     
-        //  THEN:  The serial9 object is placed into talk mode (half duplex)
-    
-        mock().expectOneCall("serial9_talk");
+        //  THEN:  Nothing happens until the next character is read
     
         s9->loop();
     
@@ -366,24 +392,26 @@ TEST(Serial9, serial_available_escaped_set_baud_data)
         //  WHEN:  A SET_BAUD character is received from Serial
         //  THEN:  The baud rate is updated
     
-        mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-        mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+        mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
         mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
         mock().expectOneCall("read").onObject(&Serial).andReturnValue(baud_test[i].baud_char);
-        mock().expectOneCall("serial9_set_baud").withParameter("baud", baud_test[i].baud_rate);
+        mock().expectOneCall("serial9_set_baud").withParameter("ch", 0).withParameter("baud", baud_test[i].baud_rate);
 
         s9->loop();
 
         //  GIVEN: The baud rate has been changed
         //  WHEN:  No additional characters are available from Serial
         //         The loop is executed and the serial9 transmitter is not busy
-        //  THEN:  The serial9 object is placed into listen mode (half duplex)
+        //  THEN:  Nothing happens, we never left listen mode
     
-        mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-        mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+        mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+        mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
         mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-        mock().expectOneCall("serial9_tx_complete").andReturnValue(true);
-        mock().expectOneCall("serial9_listen");
+        mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
     
         s9->loop();
 
@@ -396,14 +424,13 @@ TEST(Serial9, serial_available_escaped_unknown)
     //  GIVEN: Idle system with available data on Serial
     //  WHEN:  An ESCAPE character is received from Serial
     //  THEN:  ...
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
     mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xff);
 
-    //  THEN:  The serial9 object is placed into talk mode (half duplex)
-
-    mock().expectOneCall("serial9_talk");
+    //  THEN:  Nothing happens until the next character is read
 
     s9->loop();
 
@@ -411,8 +438,9 @@ TEST(Serial9, serial_available_escaped_unknown)
     //  WHEN:  An UNKNOWN character is received from Serial
     //  THEN:  nothing happens
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
     mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xaa);
 
@@ -421,13 +449,14 @@ TEST(Serial9, serial_available_escaped_unknown)
     //  GIVEN: Nothing has happened
     //  WHEN:  No additional characters are available from Serial
     //         The loop is executed and the serial9 transmitter is not busy
-    //  THEN:  The serial9 object is placed into listen mode (half duplex)
+    //  THEN:  Nothing happens, we never left listen mode
 
-    mock().expectOneCall("serial9_rx_available").andReturnValue(false);
-    mock().expectOneCall("serial9_tx_busy").andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
     mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
-    mock().expectOneCall("serial9_tx_complete").andReturnValue(true);
-    mock().expectOneCall("serial9_listen");
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
 
     s9->loop();
     mock().checkExpectations();
@@ -437,3 +466,1189 @@ TEST(Serial9, serial_available_escaped_unknown)
 //       a baud rate change? The reason is that we put the system in talk mode, and expect
 //       the next charaters(s) to be written, or if no writing is happening that the
 //       sytstem goes back in listen mode (it does)
+
+TEST(Serial9, sniff_mode)
+{
+    //  GIVEN: Idle system with available data on Serial
+    //  WHEN:  An ESCAPE SNIFF_START sequence is received from Serial
+    //  THEN:  The serial9 object is placed into listen mode
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
+    mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xff);
+
+    s9->loop();
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
+    mock().expectOneCall("read").onObject(&Serial).andReturnValue(0x20);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
+
+    s9->loop();
+
+    //  GIVEN: The serial9 object is in sniff mode
+    //  WHEN:  A character with bit9 high is available on serial9
+    //  THEN:  A TIMESTAMP record is written to the Serial object
+    //         followed by the escaped character
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(0x01ff);
+    mock().expectOneCall("micros").andReturnValue(0x12345678ul);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0xff).andReturnValue(0x01);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0x22).andReturnValue(0x01);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0x78).andReturnValue(0x01);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0x56).andReturnValue(0x01);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0x34).andReturnValue(0x01);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0x12).andReturnValue(0x01);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0xff).andReturnValue(0x01);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0x01).andReturnValue(0x01);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0xff).andReturnValue(0x01);
+
+    s9->loop();
+
+    //  GIVEN: The serial9 object is in sniff mode
+    //  WHEN:  A non-ESCAPE character is received from Serial
+    //  THEN:  The character is dropped, we never talk on the bus
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
+    mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xaa);
+
+    s9->loop();
+
+    //  GIVEN: The serial9 object is in sniff mode
+    //  WHEN:  An ESCAPE SNIFF_STOP sequence is received from Serial
+    //  THEN:  Received characters are no longer timestamped
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
+    mock().expectOneCall("read").onObject(&Serial).andReturnValue(0xff);
+
+    s9->loop();
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
+    mock().expectOneCall("read").onObject(&Serial).andReturnValue(0x21);
+
+    s9->loop();
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(0x0055);
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", 0x55).andReturnValue(0x01);
+
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+// The tests below use these helpers to set up the mock calls for a
+// single pass through loop() - it makes the longer sequences a lot
+// easier to follow
+
+static void expect_begin(uint32_t baud)
+{
+    mock().expectOneCall("serial9_set_baud").withParameter("ch", 0).withParameter("baud", baud);
+    mock().expectOneCall("serial9_set_9bit_mode").withParameter("ch", 0);
+    mock().expectOneCall("serial9_start").withParameter("ch", 0);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
+}
+
+static void expect_serial_char(unsigned char c)
+{
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
+    mock().expectOneCall("read").onObject(&Serial).andReturnValue(c);
+}
+
+static void expect_serial9_char(uint16_t data)
+{
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(data);
+}
+
+static void expect_idle(void)
+{
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+}
+
+static void expect_write(unsigned char c)
+{
+    mock().expectOneCall("write").onObject(&Serial).withParameter("c", c).andReturnValue(0x01);
+}
+
+static void send_escape(Serial9 *s9, unsigned char c)
+{
+    expect_serial_char(0xff);
+    s9->loop();
+    expect_serial_char(c);
+    s9->loop();
+}
+
+extern uint16_t serial9_crc16_update(uint16_t crc, uint8_t data);
+
+TEST(Serial9, crc16_check_value)
+{
+    //  GIVEN: The standard CRC check string "123456789"
+    //  WHEN:  The Modbus CRC-16 is calculated
+    //  THEN:  The result is the published check value 0x4B37
+
+    const char *check = "123456789";
+    uint16_t crc = 0xffff;
+
+    while (*check) {
+        crc = serial9_crc16_update(crc, *check++);
+    }
+
+    UNSIGNED_LONGS_EQUAL(0x4b37, crc);
+}
+
+TEST(Serial9, check_mdb_tx)
+{
+    //  GIVEN: MDB checks are enabled
+    //  WHEN:  A frame is sent followed by ESCAPE CHECK_END
+    //  THEN:  The 8 bit sum of the frame is sent after the frame
+
+    send_escape(s9, 0x31);
+
+    send_escape(s9, 0x01);
+    expect_serial_char(0x10);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x0110);
+    s9->loop();
+
+    expect_serial_char(0xf8);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x00f8);
+    s9->loop();
+
+    send_escape(s9, 0x33);
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x0008);
+    s9->loop();
+
+    //  GIVEN: The checksum has been sent
+    //  WHEN:  The next frame is sent
+    //  THEN:  The checksum starts again from 0
+
+    expect_serial_char(0x05);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x0005);
+    s9->loop();
+
+    send_escape(s9, 0x33);
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x0005);
+    s9->loop();
+
+    expect_idle();
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, check_crc16_tx)
+{
+    //  GIVEN: CRC-16 checks are enabled
+    //  WHEN:  A Modbus read request is sent followed by ESCAPE CHECK_END
+    //  THEN:  The CRC is sent after the frame, least significant byte first
+
+    const unsigned char frame[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x01 };
+
+    send_escape(s9, 0x32);
+
+    for (unsigned int i = 0; i < sizeof(frame); ++i) {
+        expect_serial_char(frame[i]);
+        mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+        mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", frame[i]);
+        s9->loop();
+    }
+
+    send_escape(s9, 0x33);
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x0084);
+    s9->loop();
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x000a);
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, check_crc16_rx_deliver_good)
+{
+    //  GIVEN: CRC-16 checks are enabled at 9600 baud (4010 usec frame gap)
+    //         and the host only wants good frames
+    //  WHEN:  A good frame is received
+    //  THEN:  Nothing is sent to the host until the bus goes quiet
+
+    const unsigned char frame[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x01, 0x84, 0x0a };
+
+    expect_begin(9600);
+    s9->begin(9600);
+
+    send_escape(s9, 0x32);
+    send_escape(s9, 0x35);
+
+    for (unsigned int i = 0; i < sizeof(frame); ++i) {
+        if (i > 0) {
+            mock().expectOneCall("micros").andReturnValue(1000ul + 1000 * i);
+        }
+        expect_serial9_char(frame[i]);
+        mock().expectOneCall("micros").andReturnValue(1000ul + 1000 * i);
+        s9->loop();
+    }
+
+    mock().expectOneCall("micros").andReturnValue(8000ul + 4010);
+    expect_idle();
+    s9->loop();
+
+    //  WHEN:  The bus has been quiet for more than the frame gap
+    //  THEN:  The frame is sent to the host followed by a good CHECK_RESULT
+
+    mock().expectOneCall("micros").andReturnValue(8000ul + 4011);
+    for (unsigned int i = 0; i < sizeof(frame); ++i) {
+        expect_write(frame[i]);
+    }
+    expect_write(0xff);
+    expect_write(0x36);
+    expect_write(0x00);
+    expect_idle();
+    s9->loop();
+
+    //  WHEN:  A frame with a bad CRC is received
+    //  THEN:  The frame is dropped and a bad CHECK_RESULT is sent
+
+    expect_serial9_char(0x01);
+    mock().expectOneCall("micros").andReturnValue(20000ul);
+    s9->loop();
+
+    mock().expectOneCall("micros").andReturnValue(21000ul);
+    expect_serial9_char(0x83);
+    mock().expectOneCall("micros").andReturnValue(21000ul);
+    s9->loop();
+
+    mock().expectOneCall("micros").andReturnValue(30000ul);
+    expect_write(0xff);
+    expect_write(0x36);
+    expect_write(0x01);
+    expect_idle();
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, check_mdb_rx_deliver_all)
+{
+    //  GIVEN: MDB checks are enabled and the host wants every frame
+    //  WHEN:  A frame is received
+    //  THEN:  Each word is sent to the host as soon as it arrives
+    //         and the CHECK_RESULT is sent once the bus goes quiet
+
+    const uint16_t frame[] = { 0x0001, 0x0002, 0x0103 };
+
+    send_escape(s9, 0x31);
+
+    expect_serial9_char(frame[0]);
+    mock().expectOneCall("micros").andReturnValue(0ul);
+    expect_write(0x01);
+    s9->loop();
+
+    mock().expectOneCall("micros").andReturnValue(0ul);
+    expect_serial9_char(frame[1]);
+    mock().expectOneCall("micros").andReturnValue(0ul);
+    expect_write(0x02);
+    s9->loop();
+
+    //  WHEN:  The last word, with the mode bit set, is received
+    //  THEN:  The frame ends there, without waiting for the bus to go
+    //         quiet
+
+    mock().expectOneCall("micros").andReturnValue(0ul);
+    expect_serial9_char(frame[2]);
+    mock().expectOneCall("micros").andReturnValue(0ul);
+    expect_write(0xff);
+    expect_write(0x01);
+    expect_write(0x03);
+    expect_write(0xff);
+    expect_write(0x36);
+    expect_write(0x00);
+    s9->loop();
+
+    expect_idle();
+    s9->loop();
+
+    //  GIVEN: MDB checks are enabled
+    //  WHEN:  A single word without the mode bit is received
+    //  THEN:  The frame ends when the bus goes quiet, and it is good -
+    //         there is no checksum to check
+
+    expect_serial9_char(0x0000);
+    mock().expectOneCall("micros").andReturnValue(100ul);
+    expect_write(0x00);
+    s9->loop();
+
+    mock().expectOneCall("micros").andReturnValue(101ul);
+    expect_write(0xff);
+    expect_write(0x36);
+    expect_write(0x00);
+    expect_idle();
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, check_echo_not_in_frame)
+{
+    //  GIVEN: CRC-16 checks are enabled at 9600 baud (4010 usec frame gap)
+    //         and the host only wants good frames
+    //  WHEN:  A word is sent and its echo comes back
+    //  THEN:  The echo goes to the host as it is, it does not open a frame
+
+    const unsigned char frame[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x01, 0x84, 0x0a };
+
+    expect_begin(9600);
+    s9->begin(9600);
+
+    send_escape(s9, 0x32);
+    send_escape(s9, 0x35);
+
+    expect_serial_char(0x01);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x01);
+    s9->loop();
+
+    expect_serial9_char(0x01);
+    expect_write(0x01);
+    s9->loop();
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    s9->loop();
+
+    //  WHEN:  The reply comes in right away
+    //  THEN:  It is held as a frame of its own
+
+    for (unsigned int i = 0; i < sizeof(frame); ++i) {
+        if (i > 0) {
+            mock().expectOneCall("micros").andReturnValue(1000ul + 100 * i);
+        }
+        expect_serial9_char(frame[i]);
+        mock().expectOneCall("micros").andReturnValue(1000ul + 100 * i);
+        s9->loop();
+    }
+
+    //  WHEN:  The host sends the next word before the frame gap is up
+    //  THEN:  The reply is complete - it is sent to the host with a good
+    //         CHECK_RESULT before we talk
+
+    mock().expectOneCall("micros").andReturnValue(2000ul);
+    expect_serial_char(0x02);
+    for (unsigned int i = 0; i < sizeof(frame); ++i) {
+        expect_write(frame[i]);
+    }
+    expect_write(0xff);
+    expect_write(0x36);
+    expect_write(0x00);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x02);
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, check_rx_overflow)
+{
+    //  GIVEN: MDB checks are enabled and the host only wants good frames
+    //  WHEN:  A frame longer than the buffer is received
+    //  THEN:  The buffer is sent to the host when it overflows
+    //         and the rest of the frame is passed straight through
+    //         and the CHECK_RESULT is still sent at the end
+
+    send_escape(s9, 0x31);
+    send_escape(s9, 0x35);
+
+    for (unsigned int i = 0; i < SERIAL9_BUFFER_SIZE; ++i) {
+        if (i > 0) {
+            mock().expectOneCall("micros").andReturnValue(0ul);
+        }
+        expect_serial9_char(0x01);
+        mock().expectOneCall("micros").andReturnValue(0ul);
+        s9->loop();
+    }
+
+    mock().expectOneCall("micros").andReturnValue(0ul);
+    expect_serial9_char(0x01);
+    mock().expectOneCall("micros").andReturnValue(0ul);
+    mock().expectNCalls(SERIAL9_BUFFER_SIZE + 1, "write").onObject(&Serial).withParameter("c", 0x01).andReturnValue(0x01);
+    s9->loop();
+
+    mock().expectOneCall("micros").andReturnValue(0ul);
+    expect_serial9_char(SERIAL9_BUFFER_SIZE + 1);
+    mock().expectOneCall("micros").andReturnValue(0ul);
+    expect_write(SERIAL9_BUFFER_SIZE + 1);
+    s9->loop();
+
+    mock().expectOneCall("micros").andReturnValue(1ul);
+    expect_write(0xff);
+    expect_write(0x36);
+    expect_write(0x00);
+    expect_idle();
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+extern uint16_t serial9_prbs(uint16_t lfsr);
+
+TEST(Serial9, escape_split_across_usb_packets)
+{
+    //  GIVEN: An idle serial9 object
+    //  WHEN:  ESCAPE HIGH data arrives with a loop pass in between each
+    //         byte where the UART is done and there is no USB data
+    //  THEN:  The escape state is kept and the word is sent with bit 9
+
+    expect_serial_char(0xff);
+    s9->loop();
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    s9->loop();
+
+    expect_serial_char(0x01);
+    s9->loop();
+
+    expect_serial_char(0xaa);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x01aa);
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+// In full duplex loop() never looks at tx_complete before the rest of the
+// pass, so these are the mock calls for a pass there
+
+static void expect_duplex_pass(int rx_data, int host_data)
+{
+    if (rx_data < 0) {
+        mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    } else {
+        mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+        mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(rx_data);
+        expect_write((unsigned char)rx_data);
+    }
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    if (host_data < 0) {
+        mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+        mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    } else {
+        mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
+        mock().expectOneCall("read").onObject(&Serial).andReturnValue(host_data);
+    }
+}
+
+TEST(Serial9, full_duplex)
+{
+    //  GIVEN: An idle serial9 object
+    //  WHEN:  ESCAPE DUPLEX_ON is received from Serial
+    //  THEN:  DE is asserted for good
+
+    expect_serial_char(0xff);
+    s9->loop();
+    expect_serial_char(0xa0);
+    mock().expectOneCall("serial9_duplex").withParameter("ch", 0);
+    s9->loop();
+
+    //  WHEN:  A word is received from the bus and a byte is available
+    //         from Serial in the same pass
+    //  THEN:  Both are handled in that pass, without talk/listen
+
+    expect_duplex_pass(0x55, 0x42);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x42);
+    s9->loop();
+
+    //  WHEN:  ESCAPE BAUD_9600 is received from Serial
+    //  THEN:  DE is asserted again after the baud rate is set
+
+    expect_duplex_pass(-1, 0xff);
+    s9->loop();
+    expect_duplex_pass(-1, 0x15);
+    mock().expectOneCall("serial9_set_baud").withParameter("ch", 0).withParameter("baud", 9600);
+    mock().expectOneCall("serial9_duplex").withParameter("ch", 0);
+    s9->loop();
+
+    //  WHEN:  The UART is done and there is nothing more to send
+    //  THEN:  We do not go back to listen mode
+
+    expect_duplex_pass(-1, -1);
+    s9->loop();
+
+    //  WHEN:  ESCAPE DUPLEX_OFF is received from Serial
+    //  THEN:  We are back in listen mode, and talk before sending
+
+    expect_duplex_pass(-1, 0xff);
+    s9->loop();
+    expect_duplex_pass(-1, 0xa1);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
+    s9->loop();
+
+    expect_serial_char(0x42);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x42);
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, selftest)
+{
+    //  GIVEN: An initialized serial9 object at 9600 baud (4010 usec frame gap)
+    //  WHEN:  ESCAPE SELFTEST is sent for 2 words with half of them 9 bit
+    //  THEN:  Each word is sent and the echo is checked before the next one
+    //         and a word that is not echoed counts as an error
+    //         and the result record is sent to the host at the end
+
+    uint16_t lfsr = 0xace1;
+    uint16_t word[2];
+
+    for (unsigned int i = 0; i < 2; ++i) {
+        lfsr = serial9_prbs(lfsr);
+        word[i] = (lfsr & 0xff) | (((lfsr >> 8) < 0x80) ? 0x100 : 0);
+    }
+
+    expect_begin(9600);
+    s9->begin(9600);
+
+    send_escape(s9, 0x40);
+    expect_serial_char(0x02);
+    s9->loop();
+    expect_serial_char(0x00);
+    s9->loop();
+    expect_serial_char(0x80);
+    mock().expectOneCall("micros").andReturnValue(1000ul);
+    s9->loop();
+
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", word[0]);
+    mock().expectOneCall("micros").andReturnValue(1010ul);
+    s9->loop();
+
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(word[0]);
+    s9->loop();
+
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", word[1]);
+    mock().expectOneCall("micros").andReturnValue(2000ul);
+    s9->loop();
+
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("micros").andReturnValue(7000ul);
+    s9->loop();
+
+    const unsigned char result[] = { 0xff, 0x41,
+                                     0x02, 0x00, 0x00, 0x00,
+                                     0x01, 0x00, 0x00, 0x00,
+                                     0x01, 0x00, 0x00, 0x00,
+                                     0x70, 0x17, 0x00, 0x00 };
+
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    for (unsigned int i = 0; i < sizeof(result); ++i) {
+        expect_write(result[i]);
+    }
+    mock().expectOneCall("micros").andReturnValue(7000ul);
+    s9->loop();
+
+    //  GIVEN: The self test is finished
+    //  WHEN:  The loop runs again
+    //  THEN:  The transmitter is released as usual
+
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+static void start_autobaud(void)
+{
+    expect_serial_char(0xff);
+    s9->loop();
+    expect_serial_char(0x90);
+    mock().expectOneCall("serial9_edge_start").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("micros").andReturnValue(1000ul);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
+    s9->loop();
+}
+
+TEST(Serial9, autobaud)
+{
+    //  GIVEN: An initialized serial9 object
+    //  WHEN:  ESCAPE AUTOBAUD is sent
+    //  THEN:  The edges on the bus are timed with DE low
+    //         and nothing else happens until enough have been seen
+
+    start_autobaud();
+
+    mock().expectOneCall("serial9_edge_count").withParameter("ch", 0).andReturnValue(10);
+    mock().expectOneCall("micros").andReturnValue(2000ul);
+    s9->loop();
+
+    //  WHEN:  Enough edges have been seen, 2% slower than 9600 baud
+    //  THEN:  9600 baud is set and reported to the host with the error
+    //         against the 9615 baud the USART really runs at
+
+    const unsigned char result[] = { 0xff, 0x91, 0x80, 0x25, 0x00, 0x00, 0xea };
+
+    mock().expectOneCall("serial9_edge_count").withParameter("ch", 0).andReturnValue(64);
+    mock().expectOneCall("serial9_edge_baud").withParameter("ch", 0).andReturnValue(9400ul);
+    mock().expectOneCall("serial9_edge_stop").withParameter("ch", 0);
+    mock().expectOneCall("serial9_baud_actual").withParameter("ch", 0).withParameter("baud", 9600).andReturnValue(9615ul);
+    mock().expectOneCall("serial9_set_baud").withParameter("ch", 0).withParameter("baud", 9600);
+    for (unsigned int i = 0; i < sizeof(result); ++i) {
+        expect_write(result[i]);
+    }
+    s9->loop();
+
+    //  WHEN:  It is run again on a bus at exactly 115200 baud
+    //  THEN:  The error is the 2% the USART is off by at 115200
+
+    const unsigned char fast[] = { 0xff, 0x91, 0x00, 0xc2, 0x01, 0x00, 0xec };
+
+    start_autobaud();
+    mock().expectOneCall("serial9_edge_count").withParameter("ch", 0).andReturnValue(64);
+    mock().expectOneCall("serial9_edge_baud").withParameter("ch", 0).andReturnValue(115200ul);
+    mock().expectOneCall("serial9_edge_stop").withParameter("ch", 0);
+    mock().expectOneCall("serial9_baud_actual").withParameter("ch", 0).withParameter("baud", 115200).andReturnValue(117647ul);
+    mock().expectOneCall("serial9_set_baud").withParameter("ch", 0).withParameter("baud", 115200);
+    for (unsigned int i = 0; i < sizeof(fast); ++i) {
+        expect_write(fast[i]);
+    }
+    s9->loop();
+
+    //  WHEN:  It is run again on a bus at a rate that is not a standard one
+    //  THEN:  The baud rate is left alone and 0 is reported
+
+    const unsigned char odd[] = { 0xff, 0x91, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    start_autobaud();
+    mock().expectOneCall("serial9_edge_count").withParameter("ch", 0).andReturnValue(64);
+    mock().expectOneCall("serial9_edge_baud").withParameter("ch", 0).andReturnValue(31250ul);
+    mock().expectOneCall("serial9_edge_stop").withParameter("ch", 0);
+    for (unsigned int i = 0; i < sizeof(odd); ++i) {
+        expect_write(odd[i]);
+    }
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, autobaud_quiet_bus)
+{
+    //  GIVEN: Autobaud has been started
+    //  WHEN:  Too few edges have been seen after 2 seconds
+    //  THEN:  The baud rate is left alone and 0 is reported
+
+    const unsigned char result[] = { 0xff, 0x91, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    start_autobaud();
+
+    mock().expectOneCall("serial9_edge_count").withParameter("ch", 0).andReturnValue(5);
+    mock().expectOneCall("micros").andReturnValue(2001000ul);
+    mock().expectOneCall("serial9_edge_stop").withParameter("ch", 0);
+    for (unsigned int i = 0; i < sizeof(result); ++i) {
+        expect_write(result[i]);
+    }
+    s9->loop();
+
+    //  GIVEN: A channel whose RX pin cannot be timed
+    //  WHEN:  ESCAPE AUTOBAUD is sent
+    //  THEN:  0 is reported straight away
+
+    expect_serial_char(0xff);
+    s9->loop();
+    expect_serial_char(0x90);
+    mock().expectOneCall("serial9_edge_start").withParameter("ch", 0).andReturnValue(false);
+    for (unsigned int i = 0; i < sizeof(result); ++i) {
+        expect_write(result[i]);
+    }
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, autobaud_quiet_bus_full_duplex)
+{
+    //  GIVEN: Full duplex is on and autobaud has been started
+    //  WHEN:  Too few edges have been seen after 2 seconds
+    //  THEN:  0 is reported and DE is asserted again
+
+    const unsigned char result[] = { 0xff, 0x91, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    expect_serial_char(0xff);
+    s9->loop();
+    expect_serial_char(0xa0);
+    mock().expectOneCall("serial9_duplex").withParameter("ch", 0);
+    s9->loop();
+
+    expect_duplex_pass(-1, 0xff);
+    s9->loop();
+    expect_duplex_pass(-1, 0x90);
+    mock().expectOneCall("serial9_edge_start").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("micros").andReturnValue(1000ul);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
+    s9->loop();
+
+    mock().expectOneCall("serial9_edge_count").withParameter("ch", 0).andReturnValue(5);
+    mock().expectOneCall("micros").andReturnValue(2001000ul);
+    mock().expectOneCall("serial9_edge_stop").withParameter("ch", 0);
+    mock().expectOneCall("serial9_duplex").withParameter("ch", 0);
+    for (unsigned int i = 0; i < sizeof(result); ++i) {
+        expect_write(result[i]);
+    }
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, credit_flow_control)
+{
+    //  GIVEN: An initialized serial9 object
+    //  WHEN:  ESCAPE CREDIT_ON is sent
+    //  THEN:  The queue, less the priority reserve, is granted to the host
+    //         and host data is queued even while the UART is busy
+
+    send_escape(s9, 0x50);
+
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(2);
+    mock().expectOneCall("read").onObject(&Serial).andReturnValue(0x41);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
+    mock().expectOneCall("read").onObject(&Serial).andReturnValue(0x42);
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    expect_write(0xff);
+    expect_write(0x52);
+    expect_write(SERIAL9_TX_QUEUE_SIZE - SERIAL9_CREDIT_RESERVE);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(true);
+    s9->loop();
+
+    //  GIVEN: Two bytes in the queue
+    //  WHEN:  The UART is ready
+    //  THEN:  The bytes are sent from the queue
+    //         and the credit is returned once the queue is empty
+
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x41);
+    s9->loop();
+
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x42);
+    s9->loop();
+
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    expect_write(0xff);
+    expect_write(0x52);
+    expect_write(0x02);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, priority_lane)
+{
+    //  GIVEN: Credit flow control is on
+    //  WHEN:  Two bulk bytes and then a priority frame arrive together
+    //  THEN:  The priority frame goes into its own lane, outside the credit
+
+    send_escape(s9, 0x50);
+
+    const uint8_t host[] = {0x41, 0x42, 0xff, 0x80, 0x01, 0x55};
+    for (unsigned i = 0; i < sizeof(host); ++i) {
+        mock().expectOneCall("available").onObject(&Serial).andReturnValue((int)(sizeof(host) - i));
+        mock().expectOneCall("read").onObject(&Serial).andReturnValue(host[i]);
+    }
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    expect_write(0xff);
+    expect_write(0x52);
+    expect_write(SERIAL9_TX_QUEUE_SIZE - SERIAL9_CREDIT_RESERVE);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(true);
+    s9->loop();
+
+    //  GIVEN: The bulk bytes queued ahead of the priority frame
+    //  WHEN:  The UART is ready
+    //  THEN:  The priority frame is sent first, then the bulk bytes in order
+
+    const uint16_t bus[] = {0x55, 0x41, 0x42};
+    for (unsigned i = 0; i < sizeof(bus) / sizeof(bus[0]); ++i) {
+        mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+        mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+        mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", bus[i]);
+        s9->loop();
+    }
+
+    //  THEN:  Only the bulk bytes are credited
+
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    expect_write(0xff);
+    expect_write(0x52);
+    expect_write(0x02);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, priority_lane_overflow)
+{
+    //  GIVEN: Credit flow control is on and the UART is busy
+    //  WHEN:  Two 10 byte priority frames arrive back to back, and the
+    //         second does not fit in the lane behind the first
+    //  THEN:  The second frame is dropped whole and the host is told
+
+    send_escape(s9, 0x50);
+
+    uint8_t host[2 * 13];
+    for (unsigned f = 0; f < 2; ++f) {
+        host[13 * f + 0] = 0xff;
+        host[13 * f + 1] = 0x80;
+        host[13 * f + 2] = 10;
+        for (unsigned i = 0; i < 10; ++i) {
+            host[13 * f + 3 + i] = 0x10 * f + i + 1;
+        }
+    }
+    for (unsigned i = 0; i < sizeof(host); ++i) {
+        mock().expectOneCall("available").onObject(&Serial).andReturnValue((int)(sizeof(host) - i));
+        mock().expectOneCall("read").onObject(&Serial).andReturnValue(host[i]);
+    }
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    expect_write(0xff);
+    expect_write(0x81);
+    expect_write(10);
+    expect_write(0xff);
+    expect_write(0x52);
+    expect_write(SERIAL9_TX_QUEUE_SIZE - SERIAL9_CREDIT_RESERVE);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(true);
+    s9->loop();
+
+    //  WHEN:  The UART is ready
+    //  THEN:  Only the first frame goes out on the bus
+
+    for (unsigned i = 0; i < 10; ++i) {
+        mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+        mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+        mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+        mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", i + 1);
+        s9->loop();
+    }
+
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+static void expect_ready(void)
+{
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", 0).andReturnValue(false);
+}
+
+static void expect_echo(unsigned long now, uint16_t data)
+{
+    mock().expectOneCall("micros").andReturnValue(now);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(data);
+}
+
+TEST(Serial9, collision_retry)
+{
+    //  GIVEN: An initialized serial9 object at 9600 baud (4010 usec frame gap)
+    //         with collision detect on and 2 retries
+    //  WHEN:  The echo of the first word of a frame does not match
+    //  THEN:  The bus is released right away
+
+    expect_begin(9600);
+    s9->begin(9600);
+
+    send_escape(s9, 0x70);
+    expect_serial_char(0x02);
+    s9->loop();
+
+    expect_serial_char(0x30);
+    mock().expectOneCall("micros").andReturnValue(1000ul);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x30);
+    s9->loop();
+
+    expect_echo(1100ul, 0x55);
+    mock().expectOneCall("serial9_listen").withParameter("ch", 0);
+    s9->loop();
+
+    //  GIVEN: The frame has collided
+    //  WHEN:  The rest of the frame and ESCAPE FRAME_END arrive
+    //  THEN:  The rest of the frame is kept but not sent
+    //         and the collision is reported with 2 retries to go
+
+    expect_serial_char(0x31);
+    s9->loop();
+
+    expect_serial_char(0xff);
+    s9->loop();
+    expect_serial_char(0x72);
+    expect_write(0xff);
+    expect_write(0x73);
+    expect_write(0x00);
+    expect_write(0x02);
+    mock().expectOneCall("micros").andReturnValue(2000ul);
+    s9->loop();
+
+    //  GIVEN: A random backoff of 1 or 2 frame gaps
+    //  WHEN:  The backoff is over
+    //  THEN:  The whole frame is sent again and each echo is checked
+    //         and the host is told it took 1 retry
+
+    unsigned long backoff = 4010ul * (1 + (serial9_prbs(2000) & 1));
+
+    expect_ready();
+    mock().expectOneCall("micros").andReturnValue(2000ul + backoff);
+    s9->loop();
+    expect_ready();
+    mock().expectOneCall("micros").andReturnValue(2001ul + backoff);
+    s9->loop();
+
+    expect_ready();
+    mock().expectOneCall("micros").andReturnValue(20000ul);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x30);
+    s9->loop();
+
+    expect_echo(20010ul, 0x30);
+    mock().expectOneCall("micros").andReturnValue(20020ul);
+    s9->loop();
+
+    expect_ready();
+    mock().expectOneCall("micros").andReturnValue(20100ul);
+    mock().expectOneCall("serial9_talk").withParameter("ch", 0);
+    mock().expectOneCall("serial9_write").withParameter("ch", 0).withParameter("data", 0x31);
+    s9->loop();
+
+    expect_echo(20110ul, 0x31);
+    mock().expectOneCall("micros").andReturnValue(20120ul);
+    s9->loop();
+
+    expect_ready();
+    s9->loop();
+
+    expect_ready();
+    expect_write(0xff);
+    expect_write(0x74);
+    expect_write(0x01);
+    s9->loop();
+
+    mock().checkExpectations();
+}
+
+// A pass through Serial9::loop() for a mux channel with nothing to do,
+// it never asks Serial for data because the mux fills its queue
+
+static void expect_channel_idle(uint8_t ch)
+{
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", ch).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", ch).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", ch).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", ch).andReturnValue(false);
+}
+
+// The channel is ready to take a byte from its queue
+
+static void expect_channel_ready(uint8_t ch)
+{
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", ch).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", ch).andReturnValue(false);
+    mock().expectOneCall("serial9_tx_busy").withParameter("ch", ch).andReturnValue(false);
+}
+
+static void expect_channel_write(uint8_t ch, uint16_t data)
+{
+    expect_channel_ready(ch);
+    mock().expectOneCall("serial9_talk").withParameter("ch", ch);
+    mock().expectOneCall("serial9_write").withParameter("ch", ch).withParameter("data", data);
+}
+
+static void expect_host_bytes(const unsigned char *data, unsigned int length)
+{
+    for (unsigned int i = 0; i < length; ++i) {
+        mock().expectOneCall("available").onObject(&Serial).andReturnValue(1);
+        mock().expectOneCall("read").onObject(&Serial).andReturnValue(data[i]);
+    }
+    mock().expectOneCall("available").onObject(&Serial).andReturnValue(0);
+}
+
+TEST(Serial9, mux_host_to_bus)
+{
+    //  GIVEN: Two channels sharing the USB link
+    //  WHEN:  The host selects channel 1 part way through its data
+    //         and sends 0x1ff, which is ESCAPE HIGH 0xff
+    //  THEN:  Each channel sends only its own words
+    //         and the raw 0xff 0x61 is not taken as a channel select
+    //         and the channel select is answered with the channel of
+    //         the data going to the host
+
+    const unsigned char host[] = { 0x41, 0xff, 0x61, 0xff, 0x01, 0xff, 0x61 };
+
+    Serial9 s9b(1);
+    Serial9Mux mux;
+
+    CHECK_TRUE(mux.add(s9));
+    CHECK_TRUE(mux.add(&s9b));
+    CHECK_FALSE(mux.add(&s9b));
+
+    expect_host_bytes(host, sizeof(host));
+    expect_write(0xff);
+    expect_write(0x60);
+    expect_channel_write(0, 0x41);
+    expect_channel_ready(1); // ESCAPE
+    mux.loop();
+
+    expect_host_bytes(host, 0);
+    expect_channel_idle(0);
+    expect_channel_ready(1); // HIGH
+    mux.loop();
+
+    expect_host_bytes(host, 0);
+    expect_channel_idle(0);
+    expect_channel_write(1, 0x1ff);
+    mux.loop();
+
+    expect_host_bytes(host, 0);
+    expect_channel_idle(0);
+    expect_channel_write(1, 0x61);
+    mux.loop();
+
+    mock().checkExpectations();
+}
+
+TEST(Serial9, mux_bus_to_host)
+{
+    //  GIVEN: Two channels sharing the USB link
+    //  WHEN:  Words arrive on channel 0, then channel 1, then channel 0
+    //  THEN:  The words from channel 0 go to the host as they are
+    //         and a channel select goes first whenever the channel changes
+
+    Serial9 s9b(1);
+    Serial9Mux mux;
+
+    mux.add(s9);
+    mux.add(&s9b);
+
+    expect_host_bytes(NULL, 0);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(0x10);
+    expect_write(0x10);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 1).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 1).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 1).andReturnValue(0x111);
+    expect_write(0xff);
+    expect_write(0x61);
+    expect_write(0xff);
+    expect_write(0x01);
+    expect_write(0x11);
+    mux.loop();
+
+    expect_host_bytes(NULL, 0);
+    mock().expectOneCall("serial9_tx_complete").withParameter("ch", 0).andReturnValue(false);
+    mock().expectOneCall("serial9_rx_available").withParameter("ch", 0).andReturnValue(true);
+    mock().expectOneCall("serial9_read").withParameter("ch", 0).andReturnValue(0x12);
+    expect_write(0xff);
+    expect_write(0x60);
+    expect_write(0x12);
+    expect_channel_idle(1);
+    mux.loop();
+
+    mock().checkExpectations();
+}